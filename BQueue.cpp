@@ -1,4 +1,6 @@
 #include "BQueue.h"
+#include <cstdio>
+#include <vector>
 
 /****************************************************************************************
 /
@@ -13,15 +15,9 @@ BQueue::BQueue(unsigned int id) :
 /
 /
 ****************************************************************************************/
-void BQueue::Push(void* object)
+bool BQueue::Push(void* object, int timeout)
 {
-  while (false == QLock.try_lock())
-  {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
-
-  Queue.push(object);
-  QLock.unlock();
+  return Queue.Push(object, timeout);
 }
 
 /****************************************************************************************
@@ -31,28 +27,7 @@ void BQueue::Push(void* object)
 void* BQueue::Pop(int timeout)
 {
   void* obj = 0;
-  int currentTime = timeout;
-
-  while (0 == this->Count())
-  {
-    if (0 == currentTime)     // Reached timeout
-    {
-      return obj;
-    }
-    else if (0 < currentTime) // Decrement timeout
-    {
-      --currentTime;
-    }
-  }
-
-  while (false == QLock.try_lock())
-  {
-    std::this_thread::sleep_for(std::chrono::nanoseconds(1));
-  }
-
-  obj = Queue.front(); 
-  Queue.pop();
-  QLock.unlock();
+  Queue.Pop(obj, timeout);
 
   return obj;
 }
@@ -63,7 +38,7 @@ void* BQueue::Pop(int timeout)
 ****************************************************************************************/
 unsigned int BQueue::Count() const
 {
-  return Queue.size();
+  return Queue.Count();
 }
 
 /****************************************************************************************
@@ -1,17 +1,22 @@
 #pragma once
 
 // Internal dependencies
+#include "MPMCQueue.h"
 
 // External dependencies
-#include <mutex>
-#include <queue>
 
 // Class Definition
+// Blocking queue of object pointers shared by any number of producers and
+// consumers. It holds at most Capacity objects: Push waits for room just as
+// Pop waits for an object, and returns false if the timeout runs out first.
+// Timeouts are in milliseconds, -1 waits forever.
 class BQueue
 {
 public:
+  static const unsigned int Capacity = 1024;
+
   BQueue(unsigned int id);
-  void Push(void* object);
+  bool Push(void* object, int timeout = -1);
   void* Pop(int timeout = -1);
   unsigned int Count() const;
   unsigned int GetIdentifier() const;
@@ -22,7 +27,6 @@ public:
 
 private:
   unsigned int Identifier;
-  std::queue<void*> Queue;
-  std::mutex QLock;
+  MPMCQueue<void*, Capacity> Queue;
 };
 
@@ -1,28 +1,59 @@
 #include "CRC32.h"
+#include <string.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
 
-const unsigned char CRC32::CRCLookupTable[255] =
-{
-  0x22, 0xfd, 0xe3, 0x5b, 0xba, 0x0e, 0xc7, 0x9d, 0x8e, 0xb1, 0x6a, 0x53, 0x5c, 
-  0x97, 0x86, 0x34, 0x84, 0xb7, 0xf8, 0x6c, 0x9a, 0x0e, 0x01, 0x33, 0xb5, 0x31, 
-  0x7e, 0xc9, 0x2a, 0xec, 0x3e, 0xe1, 0x72, 0x25, 0xcc, 0xa3, 0x11, 0x51, 0x40,
-  0xb2, 0x65, 0x19, 0x6c, 0x39, 0x09, 0x31, 0xb9, 0x7f, 0x4d, 0x87, 0xb4, 0x41,
-  0x35, 0xa9, 0x75, 0x44, 0xc2, 0xa6, 0xfc, 0x39, 0x1f, 0xed, 0xfc, 0x08, 0xd6, 
-  0xd7, 0x64, 0xc3, 0xe3, 0x9f, 0x2d, 0x58, 0x41, 0xae, 0xaa, 0x83, 0x51, 0x67, 
-  0x79, 0xfe, 0x1b, 0x34, 0x9c, 0xa0, 0x48, 0xc4, 0x99, 0x4f, 0xb8, 0x03, 0x4c, 
-  0x7e, 0x03, 0xa3, 0x84, 0x9c, 0x44, 0xb5, 0x3d, 0x2e, 0x3b, 0x7c, 0x44, 0x1e, 
-  0xdc, 0x45, 0xed, 0x64, 0xc3, 0xb5, 0xf7, 0xd3, 0x32, 0x15, 0x95, 0x79, 0x5f, 
-  0xae, 0x12, 0xd1, 0x7b, 0x27, 0xf5, 0xf1, 0x41, 0x59, 0x1a, 0xaa, 0x1f, 0xa2,
-  0x68, 0xec, 0xd1, 0xec, 0xc6, 0xfb, 0xed, 0x2d, 0x42, 0x7d, 0xb2, 0x1a, 0xd8, 
-  0xe1, 0xc1, 0x38, 0x37, 0x89, 0x27, 0x72, 0xf9, 0xcb, 0x89, 0xc9, 0xf1, 0xa3, 
-  0xec, 0xa3, 0x9e, 0xc4, 0x7e, 0x69, 0xa9, 0xc7, 0xdd, 0xdd, 0xfa, 0xe4, 0x17, 
-  0x3d, 0xfb, 0x18, 0x04, 0x79, 0x98, 0x3f, 0xc4, 0x28, 0x11, 0x4e, 0xa1, 0xdd,
-  0x0a, 0xb8, 0x2d, 0xff, 0x93, 0xea, 0x36, 0x9d, 0x7b, 0x87, 0xa2, 0x32, 0xf1, 
-  0xb1, 0x2a, 0x7a, 0x56, 0x7f, 0xbf, 0x5c, 0xb3, 0x93, 0x37, 0x22, 0xdf, 0x07,
-  0x5f, 0x32, 0x62, 0x22, 0xf5, 0x0f, 0xdf, 0x82, 0xbf, 0x18, 0x9a, 0x2f, 0x01,
-  0x79, 0x74, 0x7c, 0x6b, 0x63, 0x37, 0xc5, 0x00, 0xa7, 0x68, 0x82, 0x97, 0xa2,
-  0x3e, 0x64, 0xe1, 0xce, 0x13, 0x44, 0xc6, 0xe8, 0x1b, 0x2f, 0xd5, 0xa5, 0xc9, 
-  0x3b, 0x57, 0x56, 0x1c, 0x02, 0x81, 0x63, 0x7c
-};
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32_TARGET(isa)
+#else
+#include <cpuid.h>
+#define CRC32_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+CRC32::CRC32(unsigned int crc) :
+  Remainder(crc ^ FINAL_EXCLUSIVE_OR)
+{
+  // A zero crc starts a new checksum, anything else resumes from a
+  // previously finalized value.
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Update
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void CRC32::Update(const void* buf, unsigned int len)
+{
+  Remainder = SelectEngine().update(Remainder,
+                                    reinterpret_cast<const unsigned char*>(buf),
+                                    len);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Final
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int CRC32::Final() const
+{
+  return Remainder ^ FINAL_EXCLUSIVE_OR;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Reset
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void CRC32::Reset()
+{
+  Remainder = INITIAL_REMAINDER;
+}
 
 /////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -31,14 +62,262 @@ const unsigned char CRC32::CRCLookupTable[255] =
 /////////////////////////////////////////////////////////////////////////////////////////
 void CRC32::CalculateCRC32(unsigned char* buf, unsigned int len, unsigned int& crc)
 {
-  unsigned char data = 0;
-  unsigned int remainder = (0 == crc ? INITIAL_REMAINDER : crc);
+  // crc == 0 starts a new checksum, otherwise the previous result is extended.
+  CRC32 engine(crc);
+  engine.Update(buf, len);
+  crc = engine.Final();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  EngineName
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const char* CRC32::EngineName()
+{
+  return SelectEngine().name;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SelectEngine
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const CRC32::Engine& CRC32::SelectEngine()
+{
+  static const Engine engine = []()
+  {
+    unsigned int regs[4] = { 0 };
+#ifdef _MSC_VER
+    __cpuid(reinterpret_cast<int*>(regs), 1);
+#else
+    __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+    bool sse42 = (0 != (regs[2] & (1 << 20)));
+    bool pclmul = (0 != (regs[2] & (1 << 1)));
+
+    Engine selected = { &CRC32::UpdateSlicing8, "slicing-by-8" };
+    if ((true == sse42) && (true == pclmul))
+    {
+      selected.update = &CRC32::UpdateCLMUL;
+      selected.name = "pclmulqdq";
+    }
+    else if (true == sse42)
+    {
+      selected.update = &CRC32::UpdateSSE42;
+      selected.name = "sse4.2";
+    }
+
+    return selected;
+  }();
+
+  return engine;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SliceTables
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const unsigned int (*CRC32::SliceTables())[256]
+{
+  static unsigned int tables[8][256];
+  static const bool initialized = []()
+  {
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+      unsigned int remainder = i;
+      for (unsigned int bit = 0; bit < 8; ++bit)
+      {
+        remainder = (remainder >> 1) ^ (POLYNOMIAL & (0 - (remainder & 1)));
+      }
+
+      tables[0][i] = remainder;
+    }
+
+    // Table n advances a byte that sits n positions further from the end.
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+      for (unsigned int n = 1; n < 8; ++n)
+      {
+        unsigned int previous = tables[n - 1][i];
+        tables[n][i] = (previous >> 8) ^ tables[0][previous & 0xFF];
+      }
+    }
+
+    return true;
+  }();
+
+  (void)initialized;
+  return tables;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  UpdateSlicing8
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int CRC32::UpdateSlicing8(unsigned int crc,
+                                   const unsigned char* buf,
+                                   unsigned int len)
+{
+  const unsigned int (*table)[256] = SliceTables();
+
+  while (len >= 8)
+  {
+    unsigned int one = 0;
+    unsigned int two = 0;
+    memcpy(&one, buf, sizeof(one));
+    memcpy(&two, buf + 4, sizeof(two));
+    one ^= crc;
+
+    crc = table[7][one & 0xFF] ^
+          table[6][(one >> 8) & 0xFF] ^
+          table[5][(one >> 16) & 0xFF] ^
+          table[4][one >> 24] ^
+          table[3][two & 0xFF] ^
+          table[2][(two >> 8) & 0xFF] ^
+          table[1][(two >> 16) & 0xFF] ^
+          table[0][two >> 24];
+
+    buf += 8;
+    len -= 8;
+  }
+
+  while (0 != len)
+  {
+    crc = (crc >> 8) ^ table[0][(crc ^ *buf) & 0xFF];
+    ++buf;
+    --len;
+  }
+
+  return crc;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  UpdateSSE42
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+CRC32_TARGET("sse4.2")
+unsigned int CRC32::UpdateSSE42(unsigned int crc,
+                                const unsigned char* buf,
+                                unsigned int len)
+{
+  // Only the 32-bit form of the instruction is available on x86 builds.
+  while (len >= 4)
+  {
+    unsigned int data = 0;
+    memcpy(&data, buf, sizeof(data));
+    crc = _mm_crc32_u32(crc, data);
+    buf += 4;
+    len -= 4;
+  }
+
+  while (0 != len)
+  {
+    crc = _mm_crc32_u8(crc, *buf);
+    ++buf;
+    --len;
+  }
+
+  return crc;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  XPowMod
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int XPowMod(unsigned int n)
+{
+  // x^n mod P in the reflected domain, where 0x80000000 represents x^0.
+  unsigned int value = 0x80000000;
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    value = (value >> 1) ^ (0x82F63B78 & (0 - (value & 1)));
+  }
+
+  return value;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  UpdateCLMUL
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+CRC32_TARGET("sse4.2,pclmul")
+unsigned int CRC32::UpdateCLMUL(unsigned int crc,
+                                const unsigned char* buf,
+                                unsigned int len)
+{
+  if (len < CLMUL_THRESHOLD)
+  {
+    return UpdateSSE42(crc, buf, len);
+  }
 
-  for (unsigned int b = 0; b < len; ++b)
+  // Each 128-bit lane is split into its high-degree (low) and low-degree (high)
+  // quadwords, which are multiplied by x^(d+64-33) and x^(d-33) respectively to
+  // move them d bits forward. The 33 compensates for the 95-bit product of a
+  // 64-bit and 32-bit reflected operand.
+  static const __m128i fold512 = _mm_set_epi32(0, XPowMod(512 - 33),
+                                               0, XPowMod(512 + 64 - 33));
+  static const __m128i fold128 = _mm_set_epi32(0, XPowMod(128 - 33),
+                                               0, XPowMod(128 + 64 - 33));
+
+  // Seed the first lane with the current remainder.
+  __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 32));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 48));
+  x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+  buf += 64;
+  len -= 64;
+
+  // Fold four lanes at a time, 64 bytes per iteration.
+  while (len >= 64)
   {
-    data = buf[b] ^ (remainder >> 28);
-    remainder = CRCLookupTable[data] ^ (remainder << 8);
+    __m128i y0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+    __m128i y1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+    __m128i y2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 32));
+    __m128i y3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 48));
+
+    x0 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, fold512, 0x00),
+                                     _mm_clmulepi64_si128(x0, fold512, 0x11)), y0);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, fold512, 0x00),
+                                     _mm_clmulepi64_si128(x1, fold512, 0x11)), y1);
+    x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, fold512, 0x00),
+                                     _mm_clmulepi64_si128(x2, fold512, 0x11)), y2);
+    x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, fold512, 0x00),
+                                     _mm_clmulepi64_si128(x3, fold512, 0x11)), y3);
+
+    buf += 64;
+    len -= 64;
+  }
+
+  // Collapse the four lanes into one.
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x0, fold128, 0x00),
+                                   _mm_clmulepi64_si128(x0, fold128, 0x11)), x1);
+  x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, fold128, 0x00),
+                                   _mm_clmulepi64_si128(x1, fold128, 0x11)), x2);
+  x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, fold128, 0x00),
+                                   _mm_clmulepi64_si128(x2, fold128, 0x11)), x3);
+
+  // Keep folding whole 16 byte blocks.
+  while (len >= 16)
+  {
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+    x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, fold128, 0x00),
+                                     _mm_clmulepi64_si128(x3, fold128, 0x11)), y);
+    buf += 16;
+    len -= 16;
   }
 
-  crc = remainder ^ FINAL_EXCLUSIVE_OR;
-}
\ No newline at end of file
+  // The remaining lane is congruent to everything folded so far, so running
+  // it through the crc32 instruction from zero yields the remainder.
+  unsigned char lane[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lane), x3);
+  crc = UpdateSSE42(0, lane, sizeof(lane));
+
+  return UpdateSSE42(crc, buf, len);
+}
@@ -1,13 +1,50 @@
 #pragma once
 
+// CRC-32C (Castagnoli) engine. The implementation is picked once at runtime:
+// PCLMULQDQ folding for large buffers, the SSE4.2 crc32 instruction, or a
+// portable slicing-by-8 table walk.
+//
+// Streaming use:
+//   CRC32 crc;
+//   crc.Update(first, firstLen);
+//   crc.Update(second, secondLen);
+//   unsigned int value = crc.Final();
 class CRC32
 {
 public:
+  CRC32(unsigned int crc = 0);
+  void Update(const void* buf, unsigned int len);
+  unsigned int Final() const;
+  void Reset();
+
   static void CalculateCRC32(unsigned char* buf, unsigned int len, unsigned int& crc);
+  static const char* EngineName();
 
 private:
-  static const unsigned char CRCLookupTable[255];
+  typedef unsigned int (*UpdateFunc)(unsigned int, const unsigned char*, unsigned int);
+
+  struct Engine
+  {
+    UpdateFunc update;
+    const char* name;
+  };
+
+  static const Engine& SelectEngine();
+  static const unsigned int (*SliceTables())[256];
+  static unsigned int UpdateSlicing8(unsigned int crc,
+                                     const unsigned char* buf,
+                                     unsigned int len);
+  static unsigned int UpdateSSE42(unsigned int crc,
+                                  const unsigned char* buf,
+                                  unsigned int len);
+  static unsigned int UpdateCLMUL(unsigned int crc,
+                                  const unsigned char* buf,
+                                  unsigned int len);
+
+  unsigned int Remainder;
+
+  static const unsigned int POLYNOMIAL = 0x82F63B78; // Reflected 0x1EDC6F41
   static const unsigned int INITIAL_REMAINDER = 0xFFFFFFFF;
   static const unsigned int FINAL_EXCLUSIVE_OR = 0xFFFFFFFF;
+  static const unsigned int CLMUL_THRESHOLD = 256;
 };
-
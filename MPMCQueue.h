@@ -0,0 +1,398 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef VM_CACHE_LINE
+#define VM_CACHE_LINE 64
+#endif
+
+// Class Definition
+// Bounded multi producer / multi consumer queue storing values inline. Every
+// slot carries a sequence number telling whether it is ready for the producer
+// or the consumer of a given position, so a push or pop only contends on one
+// compare-and-swap of its side's index. The batch variants claim a run of
+// consecutive ready slots with a single compare-and-swap. Blocking variants
+// spin briefly and then sleep, timeouts are wall clock milliseconds.
+template <typename T, unsigned int Capacity>
+class MPMCQueue
+{
+  static_assert((1 < Capacity) && (0 == (Capacity & (Capacity - 1))),
+                "Capacity must be a power of two");
+
+public:
+  MPMCQueue();
+
+  bool TryPush(const T& value);
+  bool TryPop(T& value);
+  unsigned int TryPushN(const T* values, unsigned int count);
+  unsigned int TryPopN(T* values, unsigned int count);
+  bool Push(const T& value, int timeout = -1);
+  bool Pop(T& value, int timeout = -1);
+  unsigned int PushN(const T* values, unsigned int count, int timeout = -1);
+  unsigned int PopN(T* values, unsigned int count, int timeout = -1);
+  unsigned int Count() const;
+
+private:
+  struct Cell
+  {
+    std::atomic<unsigned int> sequence;
+    T value;
+  };
+
+  static const unsigned int Mask = Capacity - 1;
+  static const unsigned int SpinCount = 64;
+
+  unsigned int Claim(std::atomic<unsigned int>& position,
+                     unsigned int count,
+                     unsigned int ready,
+                     unsigned int& pos);
+  bool Wait(std::condition_variable& condition,
+            std::atomic<unsigned int>& waiters,
+            bool consumer,
+            const std::chrono::steady_clock::time_point& deadline,
+            bool forever);
+  void Wake(std::condition_variable& condition,
+            std::atomic<unsigned int>& waiters,
+            unsigned int count);
+
+  Cell Cells[Capacity];
+
+  char CellsPad[VM_CACHE_LINE];
+  std::atomic<unsigned int> EnqueuePos;
+  char EnqueuePad[VM_CACHE_LINE - sizeof(std::atomic<unsigned int>)];
+  std::atomic<unsigned int> DequeuePos;
+  char DequeuePad[VM_CACHE_LINE - sizeof(std::atomic<unsigned int>)];
+
+  // Slow path only
+  std::atomic<unsigned int> ConsumersWaiting;
+  std::atomic<unsigned int> ProducersWaiting;
+  std::mutex WaitLock;
+  std::condition_variable NotEmpty;
+  std::condition_variable NotFull;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+MPMCQueue<T, Capacity>::MPMCQueue() :
+  EnqueuePos(0),
+  DequeuePos(0),
+  ConsumersWaiting(0),
+  ProducersWaiting(0)
+{
+  for (unsigned int i = 0; i < Capacity; ++i)
+  {
+    Cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryPush
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool MPMCQueue<T, Capacity>::TryPush(const T& value)
+{
+  return (1 == TryPushN(&value, 1));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryPop
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool MPMCQueue<T, Capacity>::TryPop(T& value)
+{
+  return (1 == TryPopN(&value, 1));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryPushN
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int MPMCQueue<T, Capacity>::TryPushN(const T* values, unsigned int count)
+{
+  // An empty slot for position pos has sequence pos.
+  unsigned int pos = 0;
+  unsigned int claimed = Claim(EnqueuePos, count, 0, pos);
+  if (0 == claimed)
+  {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < claimed; ++i)
+  {
+    Cell& cell = Cells[(pos + i) & Mask];
+    cell.value = values[i];
+    cell.sequence.store(pos + i + 1, std::memory_order_release);
+  }
+
+  Wake(NotEmpty, ConsumersWaiting, claimed);
+  return claimed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryPopN
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int MPMCQueue<T, Capacity>::TryPopN(T* values, unsigned int count)
+{
+  // A full slot for position pos has sequence pos + 1.
+  unsigned int pos = 0;
+  unsigned int claimed = Claim(DequeuePos, count, 1, pos);
+  if (0 == claimed)
+  {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < claimed; ++i)
+  {
+    Cell& cell = Cells[(pos + i) & Mask];
+    values[i] = cell.value;
+    cell.sequence.store(pos + i + Capacity, std::memory_order_release);
+  }
+
+  Wake(NotFull, ProducersWaiting, claimed);
+  return claimed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Push
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool MPMCQueue<T, Capacity>::Push(const T& value, int timeout)
+{
+  return (1 == PushN(&value, 1, timeout));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Pop
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool MPMCQueue<T, Capacity>::Pop(T& value, int timeout)
+{
+  return (1 == PopN(&value, 1, timeout));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PushN
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int MPMCQueue<T, Capacity>::PushN(const T* values, unsigned int count, int timeout)
+{
+  // Pushes all values unless the timeout (milliseconds, negative waits
+  // forever) runs out first, returns how many made it.
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout < 0 ? 0 : timeout);
+
+  unsigned int pushed = 0;
+  unsigned int spin = 0;
+  while (pushed < count)
+  {
+    unsigned int claimed = TryPushN(values + pushed, count - pushed);
+    pushed += claimed;
+    if ((0 != claimed) || (pushed == count))
+    {
+      continue;
+    }
+
+    if (spin < SpinCount)
+    {
+      ++spin;
+      std::this_thread::yield();
+    }
+    else if (false == Wait(NotFull, ProducersWaiting, false, deadline, timeout < 0))
+    {
+      break;
+    }
+  }
+
+  return pushed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PopN
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int MPMCQueue<T, Capacity>::PopN(T* values, unsigned int count, int timeout)
+{
+  // Waits (milliseconds, negative waits forever) for at least one value, then
+  // takes whatever else is ready up to count without waiting again.
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout < 0 ? 0 : timeout);
+
+  unsigned int spin = 0;
+  while (0 != count)
+  {
+    unsigned int popped = TryPopN(values, count);
+    if (0 != popped)
+    {
+      return popped;
+    }
+
+    if (spin < SpinCount)
+    {
+      ++spin;
+      std::this_thread::yield();
+    }
+    else if (false == Wait(NotEmpty, ConsumersWaiting, true, deadline, timeout < 0))
+    {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Count
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int MPMCQueue<T, Capacity>::Count() const
+{
+  // Approximate while other threads are pushing or popping.
+  int used = static_cast<int>(EnqueuePos.load() - DequeuePos.load());
+  return (used < 0 ? 0 : (static_cast<unsigned int>(used) > Capacity ? Capacity : used));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Claim
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int MPMCQueue<T, Capacity>::Claim(std::atomic<unsigned int>& position,
+                                           unsigned int count,
+                                           unsigned int ready,
+                                           unsigned int& pos)
+{
+  // Counts the consecutive slots ready for this side starting at the current
+  // position and takes them all with one compare-and-swap. A slot ready for
+  // position pos cannot change until someone owns pos, so the run stays valid
+  // for as long as the position has not moved.
+  count = (count > Capacity ? Capacity : count);
+  pos = position.load(std::memory_order_relaxed);
+  while (true)
+  {
+    unsigned int run = 0;
+    bool stale = false;
+    while (run < count)
+    {
+      unsigned int sequence = Cells[(pos + run) & Mask].sequence.load(std::memory_order_acquire);
+      int difference = static_cast<int>(sequence - (pos + run + ready));
+      if (0 == difference)
+      {
+        ++run;
+        continue;
+      }
+
+      // Ahead of us means another thread already took pos.
+      stale = ((0 == run) && (0 < difference));
+      break;
+    }
+
+    if (true == stale)
+    {
+      pos = position.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    if (0 == run)
+    {
+      return 0;
+    }
+
+    if (true == position.compare_exchange_weak(pos, pos + run, std::memory_order_relaxed))
+    {
+      return run;
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wait
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool MPMCQueue<T, Capacity>::Wait(std::condition_variable& condition,
+                                  std::atomic<unsigned int>& waiters,
+                                  bool consumer,
+                                  const std::chrono::steady_clock::time_point& deadline,
+                                  bool forever)
+{
+  // Same handshake as SPSCRing: the waiter count is raised before the slot is
+  // checked again and the other side reads it after publishing a slot.
+  auto ready = [&]()
+  {
+    std::atomic<unsigned int>& position = (true == consumer ? DequeuePos : EnqueuePos);
+    unsigned int pos = position.load();
+    unsigned int sequence = Cells[pos & Mask].sequence.load();
+    return (sequence == pos + (true == consumer ? 1 : 0));
+  };
+
+  std::unique_lock<std::mutex> guard(WaitLock);
+  ++waiters;
+
+  bool signaled = true;
+  if (true == forever)
+  {
+    condition.wait(guard, ready);
+  }
+  else
+  {
+    signaled = condition.wait_until(guard, deadline, ready);
+  }
+
+  --waiters;
+  return signaled;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wake
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+void MPMCQueue<T, Capacity>::Wake(std::condition_variable& condition,
+                                  std::atomic<unsigned int>& waiters,
+                                  unsigned int count)
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (0 != waiters.load())
+  {
+    std::lock_guard<std::mutex> guard(WaitLock);
+    if (1 == count)
+    {
+      condition.notify_one();
+    }
+    else
+    {
+      condition.notify_all();
+    }
+  }
+}
@@ -0,0 +1,376 @@
+#include "PEGenerator.h"
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fixed layout of the headers we write.
+static const unsigned int NtHeadersOffset = 0x40;
+static const unsigned int OptionalHeaderOffset = NtHeadersOffset + 4 + 20;
+static const unsigned int OptionalHeaderSize = 224;
+static const unsigned int SectionTableOffset = OptionalHeaderOffset + OptionalHeaderSize;
+static const unsigned int SectionHeaderSize = 40;
+static const unsigned int ExportDirectorySize = 40;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Generate
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool PEGenerator::Generate(const std::string& path,
+                           const PEGeneratorConfig& config,
+                           std::vector<unsigned int>* functionOffsets)
+{
+  if ((2 > config.numSections) || (MaxSections < config.numSections) ||
+      (MaxExports < config.numExports) ||
+      (8 > config.minFunctionSize) || (config.minFunctionSize > config.maxFunctionSize))
+  {
+    return false;
+  }
+
+  // Function sizes first, everything else is laid out around them. mt19937
+  // output is fixed by the standard and the scaling is done by hand, so a
+  // seed gives the same image on every host.
+  std::mt19937 random(config.seed);
+  std::vector<unsigned int> sizes(config.numExports);
+  for (unsigned int& size : sizes)
+  {
+    double u = random() / 4294967296.0;
+    double scaled = u;
+    for (unsigned int i = 1; i < config.sizeSkew; ++i)
+    {
+      scaled *= u;
+    }
+
+    size = config.minFunctionSize +
+           static_cast<unsigned int>((config.maxFunctionSize - config.minFunctionSize) * scaled);
+  }
+
+  // .text: the entry stub, then every function on its own 16 byte boundary.
+  std::vector<unsigned int> functions(config.numExports);
+  unsigned int textSize = FunctionAlignment;
+  for (unsigned int i = 0; i < config.numExports; ++i)
+  {
+    functions[i] = textSize;
+    textSize = Align(textSize + sizes[i], FunctionAlignment);
+  }
+
+  // .rdata: directory, module name, the three tables, then the names.
+  const char* moduleName = "synthetic.exe";
+  unsigned int moduleNameOffset = ExportDirectorySize;
+  unsigned int addressTable = Align(moduleNameOffset + strlen(moduleName) + 1, 4);
+  unsigned int nameTable = addressTable + config.numExports * 4;
+  unsigned int ordinalTable = nameTable + config.numExports * 4;
+  unsigned int names = ordinalTable + config.numExports * 2;
+  unsigned int rdataSize = names;
+  for (unsigned int i = 0; i < config.numExports; ++i)
+  {
+    rdataSize += ExportName(i).size() + 1;
+  }
+
+  // Headers, with the requested slack after the section table for the
+  // section the packer appends.
+  unsigned int headersSize = Align(SectionTableOffset +
+                                   config.numSections * SectionHeaderSize +
+                                   config.headerSlack,
+                                   FileAlignment);
+
+  unsigned int textRVA = SectionAlignment;
+  unsigned int textRaw = headersSize;
+  unsigned int textRawSize = Align(textSize, FileAlignment);
+  unsigned int rdataRVA = Align(textRVA + textSize, SectionAlignment);
+  unsigned int rdataRaw = textRaw + textRawSize;
+  unsigned int rdataRawSize = Align(rdataSize, FileAlignment);
+  unsigned int dataRVA = Align(rdataRVA + rdataSize, SectionAlignment);
+  unsigned int dataRaw = rdataRaw + rdataRawSize;
+  unsigned int numData = config.numSections - 2;
+  unsigned int imageSize = dataRVA + numData * SectionAlignment;
+  unsigned int fileSize = dataRaw + numData * FileAlignment;
+
+  std::vector<unsigned char> image(fileSize, 0);
+
+  // DOS header: only e_magic and e_lfanew matter to the loader.
+  image[0] = 'M';
+  image[1] = 'Z';
+  Put32(image, 0x3C, NtHeadersOffset);
+
+  // NT signature and file header.
+  Put32(image, NtHeadersOffset, 0x00004550);
+  Put16(image, NtHeadersOffset + 4, 0x014C);               // Machine: i386
+  Put16(image, NtHeadersOffset + 6, config.numSections);
+  Put16(image, NtHeadersOffset + 20, OptionalHeaderSize);
+  Put16(image, NtHeadersOffset + 22, 0x0103);              // No relocs, executable, 32-bit
+
+  // Optional header.
+  unsigned int optional = OptionalHeaderOffset;
+  Put16(image, optional + 0, 0x010B);                      // PE32
+  Put32(image, optional + 4, textRawSize);                 // SizeOfCode
+  Put32(image, optional + 8, rdataRawSize + numData * FileAlignment);
+  Put32(image, optional + 16, textRVA);                    // AddressOfEntryPoint
+  Put32(image, optional + 20, textRVA);                    // BaseOfCode
+  Put32(image, optional + 24, rdataRVA);                   // BaseOfData
+  Put32(image, optional + 28, ImageBase);
+  Put32(image, optional + 32, SectionAlignment);
+  Put32(image, optional + 36, FileAlignment);
+  Put16(image, optional + 40, 6);                          // MajorOperatingSystemVersion
+  Put16(image, optional + 48, 6);                          // MajorSubsystemVersion
+  Put32(image, optional + 56, imageSize);
+  Put32(image, optional + 60, headersSize);
+  Put16(image, optional + 68, 3);                          // Console subsystem
+  Put16(image, optional + 70, 0x8100);                     // NX compatible, TS aware
+  Put32(image, optional + 72, 0x100000);                   // Stack reserve / commit
+  Put32(image, optional + 76, 0x1000);
+  Put32(image, optional + 80, 0x100000);                   // Heap reserve / commit
+  Put32(image, optional + 84, 0x1000);
+  Put32(image, optional + 92, 16);                         // NumberOfRvaAndSizes
+  Put32(image, optional + 96, rdataRVA);                   // Export directory
+  Put32(image, optional + 100, rdataSize);
+
+  // Section table.
+  unsigned int header = SectionTableOffset;
+  PutSection(image, header, ".text", textRVA, textSize, textRaw, textRawSize, 0x60000020);
+  header += SectionHeaderSize;
+  PutSection(image, header, ".rdata", rdataRVA, rdataSize, rdataRaw, rdataRawSize, 0x40000040);
+  for (unsigned int i = 0; i < numData; ++i)
+  {
+    char name[16] = ".data";
+    if (0 != i)
+    {
+      sprintf(name, ".data%u", i);
+    }
+
+    header += SectionHeaderSize;
+    PutSection(image, header, name,
+               dataRVA + i * SectionAlignment, 0x100,
+               dataRaw + i * FileAlignment, FileAlignment,
+               0xC0000040);
+  }
+
+  // Entry stub (xor eax, eax / ret), then the functions padded with int3.
+  unsigned char* text = &image[textRaw];
+  memset(text, 0xCC, textSize);
+  text[0] = 0x33;
+  text[1] = 0xC0;
+  text[2] = 0xC3;
+  for (unsigned int i = 0; i < config.numExports; ++i)
+  {
+    EmitFunction(text + functions[i], sizes[i], i);
+  }
+
+  // Export directory. Names are fixed width so index order is also the
+  // lexical order the loader binary searches in.
+  unsigned int rdata = rdataRaw;
+  Put32(image, rdata + 12, rdataRVA + moduleNameOffset);   // Name
+  Put32(image, rdata + 16, 1);                             // Base
+  Put32(image, rdata + 20, config.numExports);             // NumberOfFunctions
+  Put32(image, rdata + 24, config.numExports);             // NumberOfNames
+  Put32(image, rdata + 28, rdataRVA + addressTable);
+  Put32(image, rdata + 32, rdataRVA + nameTable);
+  Put32(image, rdata + 36, rdataRVA + ordinalTable);
+  memcpy(&image[rdata + moduleNameOffset], moduleName, strlen(moduleName) + 1);
+
+  unsigned int nameOffset = names;
+  for (unsigned int i = 0; i < config.numExports; ++i)
+  {
+    std::string name = ExportName(i);
+    Put32(image, rdata + addressTable + i * 4, textRVA + functions[i]);
+    Put32(image, rdata + nameTable + i * 4, rdataRVA + nameOffset);
+    Put16(image, rdata + ordinalTable + i * 2, i);
+    memcpy(&image[rdata + nameOffset], name.c_str(), name.size() + 1);
+    nameOffset += name.size() + 1;
+  }
+
+  if (0 != functionOffsets)
+  {
+    functionOffsets->resize(config.numExports);
+    for (unsigned int i = 0; i < config.numExports; ++i)
+    {
+      (*functionOffsets)[i] = textRaw + functions[i];
+    }
+  }
+
+  FILE* output = fopen(path.c_str(), "wb");
+  if (0 == output)
+  {
+    return false;
+  }
+
+  bool written = (image.size() == fwrite(image.data(), 1, image.size(), output));
+  return ((0 == fclose(output)) && (true == written));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ExportName
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+std::string PEGenerator::ExportName(unsigned int index)
+{
+  char name[16];
+  sprintf(name, "Func%06u", index);
+  return name;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Run
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+int PEGenerator::Run(int argc, char* argv[])
+{
+  const char* outputPath = 0;
+  PEGeneratorConfig config;
+  for (int i = 2; i < argc; ++i)
+  {
+    if ((0 == strcmp(argv[i], "-e")) && (i + 1 < argc))
+    {
+      config.numExports = strtoul(argv[++i], 0, 10);
+    }
+    else if ((0 == strcmp(argv[i], "-s")) && (i + 1 < argc))
+    {
+      config.numSections = strtoul(argv[++i], 0, 10);
+    }
+    else if ((0 == strcmp(argv[i], "-f")) && (i + 1 < argc))
+    {
+      sscanf(argv[++i], "%u:%u:%u",
+             &config.minFunctionSize, &config.maxFunctionSize, &config.sizeSkew);
+    }
+    else if ((0 == strcmp(argv[i], "-h")) && (i + 1 < argc))
+    {
+      config.headerSlack = strtoul(argv[++i], 0, 0);
+    }
+    else if ((0 == strcmp(argv[i], "-x")) && (i + 1 < argc))
+    {
+      config.seed = strtoul(argv[++i], 0, 0);
+    }
+    else
+    {
+      outputPath = argv[i];
+    }
+  }
+
+  if (0 == outputPath)
+  {
+    printf("Usage: %s --generate <output> [-e exports] [-s sections] "
+           "[-f min:max[:skew]] [-h slack] [-x seed]\n", argv[0]);
+    return 1;
+  }
+
+  if (false == Generate(outputPath, config))
+  {
+    printf("Failed generating %s (exports <= %u, 2 <= sections <= %u, 8 <= min <= max)\n",
+           outputPath, MaxExports, MaxSections);
+    return 1;
+  }
+
+  printf("%s: %u sections, %u exports, functions %u-%u bytes\n",
+         outputPath,
+         config.numSections,
+         config.numExports,
+         config.minFunctionSize,
+         config.maxFunctionSize);
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  EmitFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PEGenerator::EmitFunction(unsigned char* code, unsigned int size, unsigned int index)
+{
+  // Whole instructions only, so the decoder finds the ret where we put it.
+  // The immediates carry the index so no two functions are byte identical.
+  static const unsigned char body[][8] =
+  {
+    { 5, 0xB8, 0, 0, 0, 0 },             // mov eax, imm32
+    { 3, 0x8B, 0x4D, 0x08 },             // mov ecx, [ebp+8]
+    { 5, 0x05, 0, 0, 0, 0 },             // add eax, imm32
+    { 3, 0x83, 0xF8, 0x10 },             // cmp eax, 16
+    { 4, 0x74, 0x02, 0x33, 0xC0 },       // je +2 / xor eax, eax
+    { 3, 0x89, 0x45, 0xFC },             // mov [ebp-4], eax
+    { 2, 0x03, 0xC1 },                   // add eax, ecx
+    { 5, 0xE8, 0, 0, 0, 0 }              // call next
+  };
+  const unsigned int numBody = sizeof(body) / sizeof(body[0]);
+
+  unsigned int pos = 0;
+  code[pos++] = 0x55;                    // push ebp
+  code[pos++] = 0x8B;                    // mov ebp, esp
+  code[pos++] = 0xEC;
+
+  for (unsigned int i = 0; pos + body[i % numBody][0] + 2 <= size; ++i)
+  {
+    const unsigned char* insn = body[i % numBody];
+    memcpy(code + pos, insn + 1, insn[0]);
+    if ((0xB8 == insn[1]) || (0x05 == insn[1]))
+    {
+      unsigned int immediate = index * 0x9E3779B1 + i;
+      memcpy(code + pos + 1, &immediate, 4);
+    }
+
+    pos += insn[0];
+  }
+
+  while (pos + 2 < size)
+  {
+    code[pos++] = 0x90;                  // nop
+  }
+
+  code[pos++] = 0x5D;                    // pop ebp
+  code[pos] = 0xC3;                      // ret
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Put16
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PEGenerator::Put16(std::vector<unsigned char>& image, unsigned int offset, unsigned int value)
+{
+  image[offset] = static_cast<unsigned char>(value);
+  image[offset + 1] = static_cast<unsigned char>(value >> 8);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Put32
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PEGenerator::Put32(std::vector<unsigned char>& image, unsigned int offset, unsigned int value)
+{
+  Put16(image, offset, value);
+  Put16(image, offset + 2, value >> 16);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PutSection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PEGenerator::PutSection(std::vector<unsigned char>& image,
+                             unsigned int header,
+                             const char* name,
+                             unsigned int virtualAddress,
+                             unsigned int virtualSize,
+                             unsigned int rawAddress,
+                             unsigned int rawSize,
+                             unsigned int characteristics)
+{
+  memcpy(&image[header], name, strlen(name));
+  Put32(image, header + 8, virtualSize);
+  Put32(image, header + 12, virtualAddress);
+  Put32(image, header + 16, rawSize);
+  Put32(image, header + 20, rawAddress);
+  Put32(image, header + 36, characteristics);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Align
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int PEGenerator::Align(unsigned int value, unsigned int alignment)
+{
+  return (value + alignment - 1) & ~(alignment - 1);
+}
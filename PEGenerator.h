@@ -0,0 +1,62 @@
+#pragma once
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// PEGenerator writes synthetic PE32 executables for scale testing, so the
+// packer and the export code can be exercised without production binaries.
+// Images hold an entry stub and numExports functions in .text, the export
+// directory in .rdata and empty data sections up to numSections. Each function
+// decodes cleanly and ends in a single ret. The image needs no imports and is
+// written with plain stdio, so generating works on any host.
+//
+// Command line (CLI_APP build):
+//   VMLock --generate <output> [-e exports] [-s sections] [-f min:max[:skew]]
+//                              [-h slack] [-x seed]
+// Function sizes are min + (max - min) * u^skew for uniform u, so a skew of 1
+// is uniform and larger values favour small functions the way real code does.
+//
+/////////////////////////////////////////////////////////////////////////////////////////
+#include <string>
+#include <vector>
+
+struct PEGeneratorConfig
+{
+  unsigned int numSections = 3;      // .text, .rdata, then empty .data sections
+  unsigned int numExports = 1000;
+  unsigned int minFunctionSize = 16;
+  unsigned int maxFunctionSize = 512;
+  unsigned int sizeSkew = 3;
+  unsigned int headerSlack = 0x200;  // Free bytes after the section table
+  unsigned int seed = 1;
+};
+
+class PEGenerator
+{
+public:
+  static bool Generate(const std::string& path,
+                       const PEGeneratorConfig& config,
+                       std::vector<unsigned int>* functionOffsets = 0);
+  static std::string ExportName(unsigned int index);
+  static int Run(int argc, char* argv[]);
+
+  static const unsigned int MaxExports = 65535; // Name ordinals are 16 bits
+  static const unsigned int MaxSections = 64;
+
+private:
+  static void EmitFunction(unsigned char* code, unsigned int size, unsigned int index);
+  static void Put16(std::vector<unsigned char>& image, unsigned int offset, unsigned int value);
+  static void Put32(std::vector<unsigned char>& image, unsigned int offset, unsigned int value);
+  static void PutSection(std::vector<unsigned char>& image,
+                         unsigned int header,
+                         const char* name,
+                         unsigned int virtualAddress,
+                         unsigned int virtualSize,
+                         unsigned int rawAddress,
+                         unsigned int rawSize,
+                         unsigned int characteristics);
+  static unsigned int Align(unsigned int value, unsigned int alignment);
+
+  static const unsigned int ImageBase = 0x400000;
+  static const unsigned int SectionAlignment = 0x1000;
+  static const unsigned int FileAlignment = 0x200;
+  static const unsigned int FunctionAlignment = 16;
+};
@@ -1,4 +1,6 @@
 #include "PortableExecutable.h"
+#include "VMImageWriter.h"
+#include <algorithm>
 #include <fstream>
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -23,11 +25,11 @@ void PortableExecutable::BackupFile(std::string path, std::string newPath)
 // Function:  Attach
 // 
 /////////////////////////////////////////////////////////////////////////////////////////
-bool PortableExecutable::Attach(const char* path, unsigned int preSize)
+bool PortableExecutable::Attach(const char* path, unsigned int preSize, bool mapFile)
 {
   // If path is not specified (NULL), this means we are attaching to the
   // current process. Otherwise we need to open the file specified by path
-  // and read the file contents into memory.
+  // and either read the file contents into memory or map them.
   if (0 == path)
   {
     // Retrieve the virtual base address, DOS, and NT Headers.
@@ -39,9 +41,13 @@ bool PortableExecutable::Attach(const char* path, unsigned int preSize)
   else
   {
     // Open the specified file, if the FileHandle is invalid, this means the
-    // file either doesn't exist or is in use (or prohibited).
+    // file either doesn't exist or is in use (or prohibited). With an output
+    // path set the original is only ever read.
+    unsigned long access = (true == OutputPath.empty() ?
+                            GENERIC_READ | GENERIC_WRITE :
+                            GENERIC_READ);
     FileHandle = CreateFileA(path,
-                             GENERIC_READ | GENERIC_WRITE,
+                             access,
                              FILE_SHARE_READ | FILE_SHARE_WRITE,
                              0,
                              OPEN_EXISTING,
@@ -49,18 +55,36 @@ bool PortableExecutable::Attach(const char* path, unsigned int preSize)
                              0);
     if (INVALID_HANDLE_VALUE != FileHandle)
     {
-      // Retrieve the total stub size, this shouldn't require too much memory
-      // due to be a contentless installer. Copy the file contents to the buf.
       StubFileSize = GetFileSize(FileHandle, 0);
-      FileBuffer = new unsigned char[StubFileSize + preSize];
-      memset(FileBuffer, 0, StubFileSize + preSize);
-
-      unsigned long bytesRead = 0;
-      if (TRUE == ReadFile(FileHandle, FileBuffer, StubFileSize, &bytesRead, 0))
+      if (true == mapFile)
+      {
+        // Large images are mapped rather than read so that parsing only
+        // faults in the pages we actually touch.
+        if (true == MapFileContents())
+        {
+          DosHeader = reinterpret_cast<IMAGE_DOS_HEADER*>(FileBuffer);
+          NtHeaders = reinterpret_cast<IMAGE_NT_HEADERS32*>
+                      (FileBuffer + DosHeader->e_lfanew);
+        }
+      }
+      else
       {
-        DosHeader = reinterpret_cast<IMAGE_DOS_HEADER*>(FileBuffer);
-        NtHeaders = reinterpret_cast<IMAGE_NT_HEADERS32*>
-                    (FileBuffer + DosHeader->e_lfanew);
+        // Retrieve the total stub size, this shouldn't require too much memory
+        // due to be a contentless installer. Copy the file contents to the buf.
+        FileBuffer = new unsigned char[StubFileSize + preSize];
+        memset(FileBuffer, 0, StubFileSize + preSize);
+
+        // The overlay is simply the tail of the buffer in this mode.
+        Overlay = FileBuffer + StubFileSize;
+        OverlayOffset = StubFileSize;
+
+        unsigned long bytesRead = 0;
+        if (TRUE == ReadFile(FileHandle, FileBuffer, StubFileSize, &bytesRead, 0))
+        {
+          DosHeader = reinterpret_cast<IMAGE_DOS_HEADER*>(FileBuffer);
+          NtHeaders = reinterpret_cast<IMAGE_NT_HEADERS32*>
+                      (FileBuffer + DosHeader->e_lfanew);
+        }
       }
     }
   }
@@ -80,6 +104,15 @@ bool PortableExecutable::Attach(const char* path, unsigned int preSize)
       LastSectionHeader = IMAGE_FIRST_SECTION(NtHeaders) +
                           (NtHeaders->FileHeader.NumberOfSections - 1);
 
+      // Build the translation table before anything needs an RVA resolved.
+      BuildSectionTable();
+
+      // A mapped file needs somewhere to put the section we append.
+      if (0 != MappingHandle)
+      {
+        CreateOverlay(preSize);
+      }
+
       // Point ExportDirectory to specified section.
       unsigned int expVAddr = NtHeaders->OptionalHeader.DataDirectory
                               [IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress;
@@ -91,6 +124,13 @@ bool PortableExecutable::Attach(const char* path, unsigned int preSize)
       ExportDirectory = reinterpret_cast<IMAGE_EXPORT_DIRECTORY*>
                         (reinterpret_cast<unsigned char*>(DosHeader) + expVAddr);
 
+      // Index the exports once so that stripping functions does not have to
+      // rescan the export table for every offset.
+      if (0 != FileBuffer)
+      {
+        BuildExportIndex();
+      }
+
       return true;
     }
   }
@@ -142,8 +182,9 @@ void PortableExecutable::InitializeNewSection(const char* name)
 // Function:  FinalizeNewSection
 // 
 /////////////////////////////////////////////////////////////////////////////////////////
-void PortableExecutable::FinalizeNewSection(unsigned int totalSize)
+bool PortableExecutable::FinalizeNewSection(unsigned int totalSize)
 {
+  // Returns whether the image made it to disk.
   if (0 != NewSectionHeader)
   {
     // Set the corresponding size and locations of the section in relation
@@ -162,20 +203,45 @@ void PortableExecutable::FinalizeNewSection(unsigned int totalSize)
     // Increaes the section count.
     ++NtHeaders->FileHeader.NumberOfSections;
 
-    // Write the PE Header contents to the file and update the
-    // end of file location.
-    unsigned long written = 0;
+    // The image goes out once, in file order: everything before the overlay
+    // comes from the file buffer (or mapped view), the remainder from the
+    // overlay. In buffer mode the two are contiguous and make a single range.
     unsigned int totalSize = NewSectionHeader->PointerToRawData + 
                              NewSectionHeader->SizeOfRawData;
-    SetFilePointer(FileHandle, 0, 0, FILE_BEGIN);
-    WriteFile(FileHandle, FileBuffer, totalSize, &written, 0);
-    SetFilePointer(FileHandle, totalSize, 0, FILE_BEGIN);
-    SetEndOfFile(FileHandle);
+    unsigned int headSize = (totalSize < OverlayOffset ? totalSize : OverlayOffset);
+    VMImageWriter writer;
+    writer.Add(FileBuffer, headSize);
+    writer.Add(Overlay, totalSize - headSize);
 
-    // Free the FileBuffer memory now that it is no longer of us.
-    delete[] FileBuffer;
-    FileBuffer = 0;
+    if (false == OutputPath.empty())
+    {
+      bool written = writer.Write(OutputPath);
+      ReleaseFileContents();
+      return written;
+    }
+
+    bool written = writer.Write(FileHandle);
+
+    // Free the FileBuffer memory now that it is no longer of us. A mapped
+    // view must be released before the file can be resized.
+    ReleaseFileContents();
+    SetFilePointer(FileHandle, totalSize, 0, FILE_BEGIN);
+    return ((FALSE != SetEndOfFile(FileHandle)) && (true == written));
   }
+
+  return false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SetOutputPath
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PortableExecutable::SetOutputPath(const std::string& path)
+{
+  // Packs into a new file instead of the attached one, which is then opened
+  // read only. Saves copying the original, but must be set before Attach.
+  OutputPath = path;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -187,18 +253,10 @@ void PortableExecutable::InsertIntoNewSection(unsigned char* data,
                                               unsigned int len,
                                               unsigned int offset) const
 {
+  // Only the buffer is updated, FinalizeNewSection writes the whole image.
   if (INVALID_HANDLE_VALUE != FileHandle)
   {
-    SetFilePointer(FileHandle,
-                   NewSectionHeader->PointerToRawData + offset,
-                   0,
-                   FILE_BEGIN);
-
-    unsigned long bytesWritten = 0;
-    WriteFile(FileHandle, data, len, &bytesWritten, 0);
-
-    // Update file buffer
-    memcpy(&FileBuffer[NewSectionHeader->PointerToRawData + offset], data, len);
+    memcpy(PtrToFileOffset(NewSectionHeader->PointerToRawData + offset), data, len);
   }
 }
 
@@ -236,7 +294,7 @@ char* PortableExecutable::PointerToLastSection(unsigned int offset)
 /////////////////////////////////////////////////////////////////////////////////////////
 unsigned char* PortableExecutable::PtrToLastSectionBuf(unsigned int offset)
 {
-  return &FileBuffer[LastSectionHeader->PointerToRawData + offset];
+  return PtrToFileOffset(LastSectionHeader->PointerToRawData + offset);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -244,52 +302,301 @@ unsigned char* PortableExecutable::PtrToLastSectionBuf(unsigned int offset)
 // Function:  DestroyExportFunction
 // 
 /////////////////////////////////////////////////////////////////////////////////////////
-bool PortableExecutable::DestroyExportFunction(unsigned int offset, 
-                                               unsigned int numDeleted)
+bool PortableExecutable::DestroyExportFunction(unsigned int offset)
 {
-  for (unsigned int i = 0; i < ExportDirectory->NumberOfFunctions + numDeleted; ++i)
+  std::unordered_map<unsigned int, unsigned int>::iterator entry =
+    ExportOffsetIndex.find(offset);
+  if (ExportOffsetIndex.end() == entry)
   {
-    unsigned int addressOfNames = ExportDirectory->AddressOfNames;
-    SetExportRVA(addressOfNames);
+    return false;
+  }
 
-    unsigned int funcNameAddress = reinterpret_cast<unsigned int*>
-      (reinterpret_cast<char*>(DosHeader) + addressOfNames)[i];
-    SetExportRVA(funcNameAddress);
+  return DestroyExportSlot(entry->second);
+}
 
-    unsigned int addressOfOrdinals = ExportDirectory->AddressOfNameOrdinals;
-    SetExportRVA(addressOfOrdinals);
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  DestroyExportFunctions
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int PortableExecutable::DestroyExportFunctions
+  (const std::vector<unsigned int>& offsets)
+{
+  unsigned int numDeleted = 0;
+  for (unsigned int i = 0; i < offsets.size(); ++i)
+  {
+    if (true == DestroyExportFunction(offsets[i]))
+    {
+      ++numDeleted;
+    }
+  }
 
-    unsigned int addressOfFunctions = ExportDirectory->AddressOfFunctions;
-    SetExportRVA(addressOfFunctions);
+  return numDeleted;
+}
 
-    char* functionName = reinterpret_cast<char*>
-      (reinterpret_cast<char*>(DosHeader) + funcNameAddress);
-    unsigned short functionOrd = reinterpret_cast<unsigned short*>
-      (reinterpret_cast<char*>(DosHeader) + addressOfOrdinals)[i];
-    unsigned int functionOffset = reinterpret_cast<unsigned int*>
-      (reinterpret_cast<char*>(DosHeader) + addressOfFunctions)[i];
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RebuildExportDirectory
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool PortableExecutable::RebuildExportDirectory()
+{
+  // Stripping leaves zeroed slots and empty names behind, which breaks the
+  // sorted name table GetProcAddress binary searches. Rewrite the directory
+  // in place: ordinals are kept, so the address table stays indexed by them
+  // with 0 in stripped slots and only the holes before the first and after
+  // the last live export are trimmed (Base moves up). The name and ordinal
+  // tables are compacted and sorted, then come the strings. Only shrinks, so
+  // the result always fits in the original directory.
+  if ((0 == FileBuffer) || (0 == ExportDirectory))
+  {
+    return false;
+  }
+
+  IMAGE_DATA_DIRECTORY& directory =
+    NtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+  if (0 == directory.Size)
+  {
+    return false;
+  }
 
-    if (functionOffset == offset)
+  unsigned int directoryRVA = directory.VirtualAddress;
+  unsigned int directoryEnd = directoryRVA + directory.Size;
+  char* base = reinterpret_cast<char*>(DosHeader);
+
+  // Live slots keep their position between the first and the last one.
+  unsigned int first = 0;
+  while ((first < Exports.size()) && (0 == Exports[first].address))
+  {
+    ++first;
+  }
+
+  unsigned int last = Exports.size();
+  while ((last > first) && (0 == Exports[last - 1].address))
+  {
+    --last;
+  }
+
+  // Forwarders are strings inside the directory, keep them as such.
+  std::vector<std::string> forwarders(last - first);
+  std::vector<unsigned int> named;
+  for (unsigned int slot = first; slot < last; ++slot)
+  {
+    const FunctionExport& entry = Exports[slot];
+    if (0 == entry.address)
     {
-      // Clear function name
-      memset(functionName, 0, strlen(functionName));
+      continue;
+    }
 
-      // Clear function ordinal
-      reinterpret_cast<unsigned short*>
-        (reinterpret_cast<char*>(DosHeader) + addressOfOrdinals)[i] = 0;
+    if ((entry.address >= directoryRVA) && (entry.address < directoryEnd))
+    {
+      unsigned int forwarder = entry.address;
+      SetExportRVA(forwarder);
+      forwarders[slot - first] = base + forwarder;
+    }
 
-      // Clear function address
-      reinterpret_cast<unsigned int*>
-        (reinterpret_cast<char*>(DosHeader) + addressOfFunctions)[i] = 0;
+    if (NoExportName != entry.nameIndex)
+    {
+      named.push_back(slot);
+    }
+  }
 
-      // Decrement Number of functions
-      --ExportDirectory->NumberOfFunctions;
+  std::sort(named.begin(), named.end(), [&](unsigned int left, unsigned int right)
+  {
+    return (Exports[left].name < Exports[right].name);
+  });
 
-      return true;
+  unsigned int moduleName = ExportDirectory->Name;
+  SetExportRVA(moduleName);
+  std::string module = base + moduleName;
+
+  // Lay out the new directory, tables first and strings after.
+  unsigned int addressTable = sizeof(IMAGE_EXPORT_DIRECTORY);
+  unsigned int nameTable = addressTable + (last - first) * sizeof(unsigned int);
+  unsigned int ordinalTable = nameTable + named.size() * sizeof(unsigned int);
+  unsigned int strings = ordinalTable + named.size() * sizeof(unsigned short);
+
+  unsigned int size = strings + module.size() + 1;
+  for (const std::string& forwarder : forwarders)
+  {
+    size += (true == forwarder.empty() ? 0 : forwarder.size() + 1);
+  }
+
+  for (unsigned int slot : named)
+  {
+    size += Exports[slot].name.size() + 1;
+  }
+
+  if (size > directory.Size)
+  {
+    return false;
+  }
+
+  std::vector<unsigned char> table(directory.Size, 0);
+  IMAGE_EXPORT_DIRECTORY* header = reinterpret_cast<IMAGE_EXPORT_DIRECTORY*>(table.data());
+  *header = *ExportDirectory;
+  header->Base = ExportDirectory->Base + first;
+  header->NumberOfFunctions = last - first;
+  header->NumberOfNames = named.size();
+  header->AddressOfFunctions = directoryRVA + addressTable;
+  header->AddressOfNames = directoryRVA + nameTable;
+  header->AddressOfNameOrdinals = directoryRVA + ordinalTable;
+
+  unsigned int* functions = reinterpret_cast<unsigned int*>(table.data() + addressTable);
+  unsigned int* names = reinterpret_cast<unsigned int*>(table.data() + nameTable);
+  unsigned short* ordinals = reinterpret_cast<unsigned short*>(table.data() + ordinalTable);
+
+  unsigned int position = strings;
+  header->Name = directoryRVA + position;
+  memcpy(table.data() + position, module.c_str(), module.size() + 1);
+  position += module.size() + 1;
+
+  for (unsigned int slot = first; slot < last; ++slot)
+  {
+    const std::string& forwarder = forwarders[slot - first];
+    functions[slot - first] = Exports[slot].address;
+    if (false == forwarder.empty())
+    {
+      functions[slot - first] = directoryRVA + position;
+      memcpy(table.data() + position, forwarder.c_str(), forwarder.size() + 1);
+      position += forwarder.size() + 1;
     }
   }
 
-  return false;
+  for (unsigned int i = 0; i < named.size(); ++i)
+  {
+    const std::string& name = Exports[named[i]].name;
+    names[i] = directoryRVA + position;
+    ordinals[i] = static_cast<unsigned short>(named[i] - first);
+    memcpy(table.data() + position, name.c_str(), name.size() + 1);
+    position += name.size() + 1;
+  }
+
+  // One copy over the old directory, the tail is left zeroed.
+  memcpy(ExportDirectory, table.data(), table.size());
+  directory.Size = size;
+
+  BuildExportIndex();
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FindExportByName
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+int PortableExecutable::FindExportByName(const std::string& name) const
+{
+  std::unordered_map<std::string, unsigned int>::const_iterator entry =
+    ExportNameIndex.find(name);
+  if (ExportNameIndex.end() == entry)
+  {
+    return -1;
+  }
+
+  return static_cast<int>(entry->second);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BuildExportIndex
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PortableExecutable::BuildExportIndex()
+{
+  Exports.clear();
+  ExportOffsetIndex.clear();
+  ExportNameIndex.clear();
+
+  if (0 == NtHeaders->OptionalHeader.DataDirectory
+           [IMAGE_DIRECTORY_ENTRY_EXPORT].Size)
+  {
+    return;
+  }
+
+  // Resolve the three export arrays once.
+  unsigned int addressOfFunctions = ExportDirectory->AddressOfFunctions;
+  SetExportRVA(addressOfFunctions);
+  unsigned int addressOfNames = ExportDirectory->AddressOfNames;
+  SetExportRVA(addressOfNames);
+  unsigned int addressOfOrdinals = ExportDirectory->AddressOfNameOrdinals;
+  SetExportRVA(addressOfOrdinals);
+
+  char* base = reinterpret_cast<char*>(DosHeader);
+  ExportFunctionTable = reinterpret_cast<unsigned int*>(base + addressOfFunctions);
+  ExportNameTable = reinterpret_cast<unsigned int*>(base + addressOfNames);
+  ExportOrdinalTable = reinterpret_cast<unsigned short*>(base + addressOfOrdinals);
+
+  // Function slots first, the first slot exporting an address wins.
+  unsigned int numFunctions = ExportDirectory->NumberOfFunctions;
+  Exports.resize(numFunctions);
+  ExportOffsetIndex.reserve(numFunctions);
+  for (unsigned int i = 0; i < numFunctions; ++i)
+  {
+    Exports[i].address = ExportFunctionTable[i];
+    Exports[i].nameIndex = NoExportName;
+    if (0 != Exports[i].address)
+    {
+      ExportOffsetIndex.insert(std::make_pair(Exports[i].address, i));
+    }
+  }
+
+  // Names refer to function slots through the ordinal table.
+  unsigned int numNames = ExportDirectory->NumberOfNames;
+  ExportNameIndex.reserve(numNames);
+  for (unsigned int i = 0; i < numNames; ++i)
+  {
+    unsigned int slot = ExportOrdinalTable[i];
+    if (slot >= numFunctions)
+    {
+      continue;
+    }
+
+    unsigned int funcNameAddress = ExportNameTable[i];
+    SetExportRVA(funcNameAddress);
+
+    Exports[slot].name = base + funcNameAddress;
+    Exports[slot].nameIndex = i;
+    ExportNameIndex.insert(std::make_pair(Exports[slot].name, slot));
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  DestroyExportSlot
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool PortableExecutable::DestroyExportSlot(unsigned int slot)
+{
+  FunctionExport& entry = Exports[slot];
+  if (0 == entry.address)
+  {
+    return false;
+  }
+
+  ExportOffsetIndex.erase(entry.address);
+
+  if (NoExportName != entry.nameIndex)
+  {
+    // Clear function name
+    unsigned int funcNameAddress = ExportNameTable[entry.nameIndex];
+    SetExportRVA(funcNameAddress);
+    char* functionName = reinterpret_cast<char*>(DosHeader) + funcNameAddress;
+    memset(functionName, 0, strlen(functionName));
+    ExportNameIndex.erase(entry.name);
+
+    // Clear function ordinal
+    ExportOrdinalTable[entry.nameIndex] = 0;
+  }
+
+  // Clear function address
+  ExportFunctionTable[slot] = 0;
+  entry.address = 0;
+
+  // Decrement Number of functions
+  --ExportDirectory->NumberOfFunctions;
+
+  return true;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -303,19 +610,166 @@ void PortableExecutable::SetExportRVA(unsigned int& virtual_addr)
   // the data directory resides somewhere inside one of the sections.
   if (0 != FileBuffer)
   {
-    for (IMAGE_SECTION_HEADER* section = FirstSectionHeader;
-         section != LastSectionHeader;
-         ++section)
+    RVAToOffset(virtual_addr, virtual_addr);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RVAToOffset
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool PortableExecutable::RVAToOffset(unsigned int rva, unsigned int& offset) const
+{
+  const SectionRange* range = FindRVARange(rva);
+  if (0 == range)
+  {
+    return false;
+  }
+
+  offset = range->rawAddress + (rva - range->virtualAddress);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  OffsetToRVA
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool PortableExecutable::OffsetToRVA(unsigned int offset, unsigned int& rva) const
+{
+  const SectionRange* range = FindOffsetRange(offset);
+  if (0 == range)
+  {
+    return false;
+  }
+
+  rva = range->virtualAddress + (offset - range->rawAddress);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RVAExtent
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int PortableExecutable::RVAExtent(unsigned int rva) const
+{
+  // Bytes from rva to the end of the range containing it.
+  const SectionRange* range = FindRVARange(rva);
+  return (0 == range ? 0 : range->virtualEnd - rva);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  OffsetExtent
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int PortableExecutable::OffsetExtent(unsigned int offset) const
+{
+  // Bytes from offset to the end of the raw data containing it.
+  const SectionRange* range = FindOffsetRange(offset);
+  return (0 == range ? 0 : range->rawEnd - offset);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FindRVARange
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const SectionRange* PortableExecutable::FindRVARange(unsigned int rva) const
+{
+  // Find the last range starting at or before rva.
+  std::vector<SectionRange>::const_iterator range =
+    std::upper_bound(SectionsByRVA.begin(), SectionsByRVA.end(), rva,
+                     [](unsigned int value, const SectionRange& entry)
+                     {
+                       return value < entry.virtualAddress;
+                     });
+  if (SectionsByRVA.begin() == range)
+  {
+    return 0;
+  }
+
+  --range;
+  return (rva < range->virtualEnd ? &(*range) : 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FindOffsetRange
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const SectionRange* PortableExecutable::FindOffsetRange(unsigned int offset) const
+{
+  // Find the last range starting at or before offset.
+  std::vector<SectionRange>::const_iterator range =
+    std::upper_bound(SectionsByOffset.begin(), SectionsByOffset.end(), offset,
+                     [](unsigned int value, const SectionRange& entry)
+                     {
+                       return value < entry.rawAddress;
+                     });
+  if (SectionsByOffset.begin() == range)
+  {
+    return 0;
+  }
+
+  --range;
+  return (offset < range->rawEnd ? &(*range) : 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BuildSectionTable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PortableExecutable::BuildSectionTable()
+{
+  SectionsByRVA.clear();
+  SectionsByOffset.clear();
+
+  // The headers map onto themselves.
+  SectionRange headers = { 0,
+                           NtHeaders->OptionalHeader.SizeOfHeaders,
+                           0,
+                           NtHeaders->OptionalHeader.SizeOfHeaders };
+  SectionsByRVA.push_back(headers);
+
+  IMAGE_SECTION_HEADER* section = FirstSectionHeader;
+  for (unsigned int i = 0; i < NtHeaders->FileHeader.NumberOfSections; ++i)
+  {
+    // Some linkers leave VirtualSize empty, fall back on the raw size.
+    unsigned int virtualSize = (0 != section->Misc.VirtualSize ?
+                                section->Misc.VirtualSize :
+                                section->SizeOfRawData);
+
+    SectionRange range = { section->VirtualAddress,
+                           section->VirtualAddress + virtualSize,
+                           section->PointerToRawData,
+                           section->PointerToRawData + section->SizeOfRawData };
+    SectionsByRVA.push_back(range);
+    ++section;
+  }
+
+  // Uninitialized sections have no file backing and cannot be found by offset.
+  for (unsigned int i = 0; i < SectionsByRVA.size(); ++i)
+  {
+    if (SectionsByRVA[i].rawEnd > SectionsByRVA[i].rawAddress)
     {
-      if (virtual_addr < (section->VirtualAddress + section->Misc.VirtualSize))
-      {
-        virtual_addr = section->PointerToRawData + 
-                       virtual_addr - 
-                       section->VirtualAddress;
-        break;
-      }
+      SectionsByOffset.push_back(SectionsByRVA[i]);
     }
   }
+
+  std::sort(SectionsByRVA.begin(), SectionsByRVA.end(),
+            [](const SectionRange& a, const SectionRange& b)
+            {
+              return a.virtualAddress < b.virtualAddress;
+            });
+  std::sort(SectionsByOffset.begin(), SectionsByOffset.end(),
+            [](const SectionRange& a, const SectionRange& b)
+            {
+              return a.rawAddress < b.rawAddress;
+            });
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -328,6 +782,16 @@ void* PortableExecutable::GetBaseAddress()
   return reinterpret_cast<void*>(DosHeader);
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  GetStubFileSize
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int PortableExecutable::GetStubFileSize() const
+{
+  return StubFileSize;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////
 //
 // Function:  Constructor
@@ -335,15 +799,21 @@ void* PortableExecutable::GetBaseAddress()
 /////////////////////////////////////////////////////////////////////////////////////////
 PortableExecutable::PortableExecutable() :
   FileHandle(INVALID_HANDLE_VALUE),
+  MappingHandle(0),
   ImageBase(0),
   FileBuffer(0),
+  Overlay(0),
+  OverlayOffset(0),
   StubFileSize(0),
   DosHeader(0),
   NtHeaders(0),
   FirstSectionHeader(0),
   LastSectionHeader(0),
   NewSectionHeader(0),
-  ExportDirectory(0)
+  ExportDirectory(0),
+  ExportFunctionTable(0),
+  ExportNameTable(0),
+  ExportOrdinalTable(0)
 {
 
 }
@@ -355,17 +825,13 @@ PortableExecutable::PortableExecutable() :
 /////////////////////////////////////////////////////////////////////////////////////////
 PortableExecutable::~PortableExecutable()
 {
+  // Incase ::FinalizeNewSection() was not called, free the memory.
+  ReleaseFileContents();
+
   if (INVALID_HANDLE_VALUE != FileHandle)
   {
     CloseHandle(FileHandle);
   }
-
-  // Incase ::FinalizeNewSection() was not called, free the memory.
-  if (0 != FileBuffer)
-  {
-    delete[] FileBuffer;
-    FileBuffer = 0;
-  }
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -380,3 +846,98 @@ unsigned int PortableExecutable::AlignToBoundary(unsigned int address,
 
   return address + (0 == correction ? 0 : alignment - correction);
 }
+
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  MapFileContents
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool PortableExecutable::MapFileContents()
+{
+  // The view is copy-on-write: header patches and virtualized functions land
+  // in private pages and the file itself is only touched by FinalizeNewSection.
+  MappingHandle = CreateFileMappingA(FileHandle, 0, PAGE_WRITECOPY, 0, 0, 0);
+  if (0 == MappingHandle)
+  {
+    return false;
+  }
+
+  FileBuffer = reinterpret_cast<unsigned char*>
+               (MapViewOfFile(MappingHandle, FILE_MAP_COPY, 0, 0, 0));
+  if (0 == FileBuffer)
+  {
+    CloseHandle(MappingHandle);
+    MappingHandle = 0;
+    return false;
+  }
+
+  // Until the section table is known the overlay starts at the end of file.
+  OverlayOffset = StubFileSize;
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CreateOverlay
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PortableExecutable::CreateOverlay(unsigned int preSize)
+{
+  // The new section will be placed right after the last section's raw data,
+  // which may sit before the end of file if the image carries trailing data.
+  // Start the overlay there so the new section is always contiguous.
+  unsigned int sectionEnd =
+    AlignToBoundary(LastSectionHeader->PointerToRawData +
+                    LastSectionHeader->SizeOfRawData,
+                    NtHeaders->OptionalHeader.FileAlignment);
+  OverlayOffset = (sectionEnd < StubFileSize ? sectionEnd : StubFileSize);
+
+  unsigned int overlaySize = StubFileSize - OverlayOffset + preSize;
+  Overlay = new unsigned char[overlaySize];
+  memset(Overlay, 0, overlaySize);
+  memcpy(Overlay, FileBuffer + OverlayOffset, StubFileSize - OverlayOffset);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PtrToFileOffset
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned char* PortableExecutable::PtrToFileOffset(unsigned int offset) const
+{
+  if (offset < OverlayOffset)
+  {
+    return FileBuffer + offset;
+  }
+
+  return Overlay + (offset - OverlayOffset);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ReleaseFileContents
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void PortableExecutable::ReleaseFileContents()
+{
+  if (0 != MappingHandle)
+  {
+    // Mapped mode owns the view and a separately allocated overlay.
+    if (0 != FileBuffer)
+    {
+      UnmapViewOfFile(FileBuffer);
+    }
+
+    CloseHandle(MappingHandle);
+    MappingHandle = 0;
+    delete[] Overlay;
+  }
+  else if (0 != FileBuffer)
+  {
+    delete[] FileBuffer;
+  }
+
+  FileBuffer = 0;
+  Overlay = 0;
+}
\ No newline at end of file
@@ -1,11 +1,22 @@
 #pragma once
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <Windows.h>
 
 struct FunctionExport
 {
   std::string name;
   unsigned int address;
+  unsigned int nameIndex; // Slot in AddressOfNames, NoExportName if unnamed.
+};
+
+struct SectionRange
+{
+  unsigned int virtualAddress;
+  unsigned int virtualEnd;
+  unsigned int rawAddress;
+  unsigned int rawEnd;
 };
 
 class PortableExecutable
@@ -13,9 +24,10 @@ class PortableExecutable
 public:
   static void BackupFile(std::string path, std::string newPath);
 
-  bool Attach(const char* path = 0, unsigned int preSize = 0);
+  bool Attach(const char* path = 0, unsigned int preSize = 0, bool mapFile = false);
   void InitializeNewSection(const char* name);
-  void FinalizeNewSection(unsigned int totalSize);
+  bool FinalizeNewSection(unsigned int totalSize);
+  void SetOutputPath(const std::string& path);
   void InsertIntoNewSection(unsigned char* data,
                             unsigned int len,
                             unsigned int offset) const;
@@ -24,9 +36,17 @@ public:
                               unsigned int len) const;
   char* PointerToLastSection(unsigned int offset);
   unsigned char* PtrToLastSectionBuf(unsigned int offset);
-  bool DestroyExportFunction(unsigned int offset, unsigned int numDeleted);
+  bool DestroyExportFunction(unsigned int offset);
+  unsigned int DestroyExportFunctions(const std::vector<unsigned int>& offsets);
+  bool RebuildExportDirectory();
+  int FindExportByName(const std::string& name) const;
   void SetExportRVA(unsigned int& virtual_addr);
+  bool RVAToOffset(unsigned int rva, unsigned int& offset) const;
+  bool OffsetToRVA(unsigned int offset, unsigned int& rva) const;
+  unsigned int RVAExtent(unsigned int rva) const;
+  unsigned int OffsetExtent(unsigned int offset) const;
   void* GetBaseAddress();
+  unsigned int GetStubFileSize() const;
   PortableExecutable();
   ~PortableExecutable();
 
@@ -38,12 +58,41 @@ public:
   IMAGE_SECTION_HEADER* NewSectionHeader;
   IMAGE_EXPORT_DIRECTORY* ExportDirectory;
 
+  // Export table indexed by function slot (ordinal - Base). Only built when
+  // attached to a file.
+  std::vector<FunctionExport> Exports;
+
+  static const unsigned int NoExportName = 0xFFFFFFFF;
+
 private:
   unsigned int AlignToBoundary(unsigned int address, unsigned int alignment);
+  bool MapFileContents();
+  void CreateOverlay(unsigned int preSize);
+  unsigned char* PtrToFileOffset(unsigned int offset) const;
+  void ReleaseFileContents();
+  void BuildSectionTable();
+  const SectionRange* FindRVARange(unsigned int rva) const;
+  const SectionRange* FindOffsetRange(unsigned int offset) const;
+  void BuildExportIndex();
+  bool DestroyExportSlot(unsigned int slot);
 
   HANDLE FileHandle;
+  HANDLE MappingHandle;
   unsigned char* ImageBase;
   unsigned char* FileBuffer;
+  unsigned char* Overlay;
+  unsigned int OverlayOffset;
   unsigned int StubFileSize;
+  std::string OutputPath;
+
+  // Headers and sections sorted by RVA and by file offset for binary search.
+  std::vector<SectionRange> SectionsByRVA;
+  std::vector<SectionRange> SectionsByOffset;
+
+  unsigned int* ExportFunctionTable;
+  unsigned int* ExportNameTable;
+  unsigned short* ExportOrdinalTable;
+  std::unordered_map<unsigned int, unsigned int> ExportOffsetIndex;
+  std::unordered_map<std::string, unsigned int> ExportNameIndex;
 };
 
@@ -0,0 +1,457 @@
+#include "ProtectionManager.h"
+#include <algorithm>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Instance
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+ProtectionManager& ProtectionManager::Instance()
+{
+  static ProtectionManager manager;
+  return manager;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Acquire
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::Acquire(void* address, unsigned int size)
+{
+  ProtectRange range = { address, size };
+  return Acquire(std::vector<ProtectRange>(1, range));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Acquire
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::Acquire(const std::vector<ProtectRange>& ranges)
+{
+  std::vector<uintptr_t> pages;
+  CollectPages(ranges, pages);
+
+  std::lock_guard<std::mutex> guard(Lock);
+
+  // Either every page is writable afterwards or none of them changed.
+  std::vector<uintptr_t> acquired;
+  if (false == MakeWritable(pages, acquired))
+  {
+    RestorePages(acquired);
+    return false;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Release
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void ProtectionManager::Release(void* address, unsigned int size)
+{
+  ProtectRange range = { address, size };
+  Release(std::vector<ProtectRange>(1, range));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Release
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void ProtectionManager::Release(const std::vector<ProtectRange>& ranges)
+{
+  std::vector<uintptr_t> pages;
+  CollectPages(ranges, pages);
+
+  std::lock_guard<std::mutex> guard(Lock);
+  RestorePages(pages);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Guard
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::Guard(std::vector<GuardedPage>& pages)
+{
+  // The pages come sorted. Each one's original protection is filled in before
+  // it goes away, so a fault on it can already be resolved.
+  std::lock_guard<std::mutex> guard(Lock);
+
+  // One call per contiguous run of pages.
+  unsigned int i = 0;
+  while (i < pages.size())
+  {
+    unsigned int count = 1;
+    while ((i + count < pages.size()) &&
+           (pages[i + count].page == pages[i].page + (count * PageSize)))
+    {
+      ++count;
+    }
+
+    std::vector<Protection> originals(count, 0);
+    if (false == QueryProtection(pages[i].page, count, originals.data()))
+    {
+      return false;
+    }
+
+    for (unsigned int j = 0; j < count; ++j)
+    {
+      pages[i + j].original = static_cast<unsigned long>(originals[j]);
+    }
+
+    if (false == SetProtection(pages[i].page, count, NoAccessProtection()))
+    {
+      return false;
+    }
+
+    ++NumProtectCalls;
+    i += count;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Expose
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::Expose(const GuardedPage& guarded)
+{
+  // Readable and writable but not executable, so a guarded page can be
+  // decrypted while nothing is able to run from it. Same rules as Unguard.
+  ++NumProtectCalls;
+  return SetProtection(guarded.page, 1, DataProtection());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Unguard
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::Unguard(const GuardedPage& guarded)
+{
+  // Called from fault handlers, so it must not lock or allocate.
+  ++NumProtectCalls;
+  return SetProtection(guarded.page, 1, static_cast<Protection>(guarded.original));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  GetPageSize
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int ProtectionManager::GetPageSize() const
+{
+  return PageSize;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  WritablePages
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int ProtectionManager::WritablePages()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return static_cast<unsigned int>(Pages.size());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ProtectCalls
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int ProtectionManager::ProtectCalls()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return NumProtectCalls;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+ProtectionManager::ProtectionManager() :
+  PageSize(QueryPageSize()),
+  NumProtectCalls(0)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CollectPages
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void ProtectionManager::CollectPages(const std::vector<ProtectRange>& ranges,
+                                     std::vector<uintptr_t>& pages) const
+{
+  // Every page touched by any range, sorted and counted once per call.
+  for (const ProtectRange& range : ranges)
+  {
+    if (0 == range.size)
+    {
+      continue;
+    }
+
+    uintptr_t first = reinterpret_cast<uintptr_t>(range.address) & ~(uintptr_t)(PageSize - 1);
+    uintptr_t last = (reinterpret_cast<uintptr_t>(range.address) + range.size - 1) &
+                     ~(uintptr_t)(PageSize - 1);
+    for (uintptr_t page = first; page <= last; page += PageSize)
+    {
+      pages.push_back(page);
+    }
+  }
+
+  std::sort(pages.begin(), pages.end());
+  pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  MakeWritable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::MakeWritable(const std::vector<uintptr_t>& pages,
+                                     std::vector<uintptr_t>& acquired)
+{
+  unsigned int i = 0;
+  while (i < pages.size())
+  {
+    std::map<uintptr_t, PageState>::iterator state = Pages.find(pages[i]);
+    if (Pages.end() != state)
+    {
+      ++state->second.refCount;
+      acquired.push_back(pages[i]);
+      ++i;
+      continue;
+    }
+
+    // Extend the run over every following page that is not writable yet.
+    unsigned int count = 1;
+    while ((i + count < pages.size()) &&
+           (pages[i + count] == pages[i] + (count * PageSize)) &&
+           (Pages.end() == Pages.find(pages[i + count])))
+    {
+      ++count;
+    }
+
+    std::vector<Protection> originals(count, 0);
+    if ((false == QueryProtection(pages[i], count, originals.data())) ||
+        (false == SetProtection(pages[i], count, WritableProtection())))
+    {
+      return false;
+    }
+
+    ++NumProtectCalls;
+    for (unsigned int j = 0; j < count; ++j)
+    {
+      PageState newState = { 1, originals[j] };
+      Pages[pages[i + j]] = newState;
+      acquired.push_back(pages[i + j]);
+    }
+
+    i += count;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RestorePages
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void ProtectionManager::RestorePages(const std::vector<uintptr_t>& pages)
+{
+  // Pages whose last writer left, still in ascending order.
+  std::vector<uintptr_t> expired;
+  for (uintptr_t page : pages)
+  {
+    std::map<uintptr_t, PageState>::iterator state = Pages.find(page);
+    if ((Pages.end() != state) && (0 == --state->second.refCount))
+    {
+      expired.push_back(page);
+    }
+  }
+
+  // Restore each contiguous run sharing the same original protection at once.
+  unsigned int i = 0;
+  while (i < expired.size())
+  {
+    Protection original = Pages[expired[i]].original;
+    unsigned int count = 1;
+    while ((i + count < expired.size()) &&
+           (expired[i + count] == expired[i] + (count * PageSize)) &&
+           (original == Pages[expired[i + count]].original))
+    {
+      ++count;
+    }
+
+    SetProtection(expired[i], count, original);
+    ++NumProtectCalls;
+
+    for (unsigned int j = 0; j < count; ++j)
+    {
+      Pages.erase(expired[i + j]);
+    }
+
+    i += count;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  QueryPageSize
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int ProtectionManager::QueryPageSize()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return static_cast<unsigned int>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  QueryProtection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::QueryProtection(uintptr_t page,
+                                        unsigned int count,
+                                        Protection* protections) const
+{
+  uintptr_t address = page;
+  unsigned int index = 0;
+
+#ifdef _WIN32
+  // Each query describes a whole region of pages sharing one protection.
+  while (index < count)
+  {
+    MEMORY_BASIC_INFORMATION info;
+    if (0 == VirtualQuery(reinterpret_cast<void*>(address), &info, sizeof(info)))
+    {
+      return false;
+    }
+
+    uintptr_t regionEnd = reinterpret_cast<uintptr_t>(info.BaseAddress) + info.RegionSize;
+    while ((index < count) && (address < regionEnd))
+    {
+      protections[index++] = info.Protect;
+      address += PageSize;
+    }
+  }
+#else
+  // Mappings are listed in ascending order, as are the pages.
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (0 == maps)
+  {
+    return false;
+  }
+
+  char line[512];
+  while ((index < count) && (0 != fgets(line, sizeof(line), maps)))
+  {
+    unsigned long long start = 0;
+    unsigned long long end = 0;
+    char perms[5] = { 0 };
+    if (3 != sscanf(line, "%llx-%llx %4s", &start, &end, perms))
+    {
+      continue;
+    }
+
+    Protection protection = ('r' == perms[0] ? PROT_READ : 0) |
+                            ('w' == perms[1] ? PROT_WRITE : 0) |
+                            ('x' == perms[2] ? PROT_EXEC : 0);
+    while ((index < count) && (address >= start) && (address < end))
+    {
+      protections[index++] = protection;
+      address += PageSize;
+    }
+  }
+
+  fclose(maps);
+#endif
+
+  return (index == count);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SetProtection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool ProtectionManager::SetProtection(uintptr_t page,
+                                      unsigned int count,
+                                      Protection protection) const
+{
+  unsigned int size = count * PageSize;
+
+#ifdef _WIN32
+  unsigned long oldProtect;
+  return (0 != VirtualProtect(reinterpret_cast<void*>(page), size, protection, &oldProtect));
+#else
+  return (0 == mprotect(reinterpret_cast<void*>(page), size, protection));
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  WritableProtection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+ProtectionManager::Protection ProtectionManager::WritableProtection()
+{
+#ifdef _WIN32
+  return PAGE_EXECUTE_READWRITE;
+#else
+  return PROT_READ | PROT_WRITE | PROT_EXEC;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  DataProtection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+ProtectionManager::Protection ProtectionManager::DataProtection()
+{
+#ifdef _WIN32
+  return PAGE_READWRITE;
+#else
+  return PROT_READ | PROT_WRITE;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  NoAccessProtection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+ProtectionManager::Protection ProtectionManager::NoAccessProtection()
+{
+  // No access rather than no execute, 32-bit processes may run without DEP.
+#ifdef _WIN32
+  return PAGE_NOACCESS;
+#else
+  return PROT_NONE;
+#endif
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// A byte range whose pages need to be writable for a while.
+struct ProtectRange
+{
+  void* address;
+  unsigned int size;
+};
+
+// A page made inaccessible by Guard, with the protection it had before.
+struct GuardedPage
+{
+  uintptr_t page;
+  unsigned long original;
+};
+
+// Class Definition
+// Reference counts writable windows over code pages. Pages are made writable
+// when the first writer arrives and get their original protection back when
+// the last one leaves. Adjacent pages are changed together so that a batch of
+// ranges costs one protection call per contiguous run instead of one per range.
+// Pages can also be guarded (made inaccessible) until their first fault. The
+// caller owns the guarded pages and their original protection, so Expose and
+// Unguard take no lock and allocate nothing and can run inside a fault handler.
+class ProtectionManager
+{
+public:
+  static ProtectionManager& Instance();
+
+  bool Acquire(void* address, unsigned int size);
+  bool Acquire(const std::vector<ProtectRange>& ranges);
+  void Release(void* address, unsigned int size);
+  void Release(const std::vector<ProtectRange>& ranges);
+  bool Guard(std::vector<GuardedPage>& pages);
+  bool Expose(const GuardedPage& guarded);
+  bool Unguard(const GuardedPage& guarded);
+  unsigned int GetPageSize() const;
+  unsigned int WritablePages();
+  unsigned int ProtectCalls();
+
+private:
+#ifdef _WIN32
+  typedef unsigned long Protection;
+#else
+  typedef int Protection;
+#endif
+
+  struct PageState
+  {
+    unsigned int refCount;
+    Protection original;
+  };
+
+  ProtectionManager();
+  void CollectPages(const std::vector<ProtectRange>& ranges,
+                    std::vector<uintptr_t>& pages) const;
+  bool MakeWritable(const std::vector<uintptr_t>& pages,
+                    std::vector<uintptr_t>& acquired);
+  void RestorePages(const std::vector<uintptr_t>& pages);
+
+  // Platform layer
+  static unsigned int QueryPageSize();
+  bool QueryProtection(uintptr_t page, unsigned int count, Protection* protections) const;
+  bool SetProtection(uintptr_t page, unsigned int count, Protection protection) const;
+  static Protection WritableProtection();
+  static Protection DataProtection();
+  static Protection NoAccessProtection();
+
+  unsigned int PageSize;
+  std::atomic<unsigned int> NumProtectCalls;
+  std::map<uintptr_t, PageState> Pages;
+  std::mutex Lock;
+};
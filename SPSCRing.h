@@ -0,0 +1,254 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define VM_CACHE_LINE 64
+
+// Class Definition
+// Bounded single producer / single consumer ring. Push and pop are lock free;
+// the mutex and condition variables are only touched when one side actually
+// has to sleep (ring empty or full), and timeouts are wall clock milliseconds.
+// The producer and consumer indices live on separate cache lines together with
+// a cached copy of the other side's index, so the fast path rarely shares a
+// line with the other thread.
+template <typename T, unsigned int Capacity>
+class SPSCRing
+{
+  static_assert((0 != Capacity) && (0 == (Capacity & (Capacity - 1))),
+                "Capacity must be a power of two");
+
+public:
+  SPSCRing();
+
+  bool TryPush(const T& value);
+  bool TryPop(T& value);
+  bool Push(const T& value, int timeout = -1);
+  bool Pop(T& value, int timeout = -1);
+  unsigned int Count() const;
+
+private:
+  static const unsigned int Mask = Capacity - 1;
+  static const unsigned int SpinCount = 64;
+
+  bool Wait(std::condition_variable& condition,
+            std::atomic<bool>& waiting,
+            bool consumer,
+            int timeout);
+  void Wake(std::condition_variable& condition, std::atomic<bool>& waiting);
+
+  // Consumer line
+  std::atomic<unsigned int> Head;
+  unsigned int CachedTail;
+  char ConsumerPad[VM_CACHE_LINE - sizeof(std::atomic<unsigned int>) - sizeof(unsigned int)];
+
+  // Producer line
+  std::atomic<unsigned int> Tail;
+  unsigned int CachedHead;
+  char ProducerPad[VM_CACHE_LINE - sizeof(std::atomic<unsigned int>) - sizeof(unsigned int)];
+
+  T Slots[Capacity];
+
+  // Slow path only
+  std::atomic<bool> ConsumerWaiting;
+  std::atomic<bool> ProducerWaiting;
+  std::mutex WaitLock;
+  std::condition_variable NotEmpty;
+  std::condition_variable NotFull;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+SPSCRing<T, Capacity>::SPSCRing() :
+  Head(0),
+  CachedTail(0),
+  Tail(0),
+  CachedHead(0),
+  ConsumerWaiting(false),
+  ProducerWaiting(false)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryPush
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool SPSCRing<T, Capacity>::TryPush(const T& value)
+{
+  unsigned int tail = Tail.load(std::memory_order_relaxed);
+  if (Capacity == (tail - CachedHead))
+  {
+    CachedHead = Head.load(std::memory_order_acquire);
+    if (Capacity == (tail - CachedHead))
+    {
+      return false;
+    }
+  }
+
+  Slots[tail & Mask] = value;
+  Tail.store(tail + 1, std::memory_order_release);
+  Wake(NotEmpty, ConsumerWaiting);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryPop
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool SPSCRing<T, Capacity>::TryPop(T& value)
+{
+  unsigned int head = Head.load(std::memory_order_relaxed);
+  if (head == CachedTail)
+  {
+    CachedTail = Tail.load(std::memory_order_acquire);
+    if (head == CachedTail)
+    {
+      return false;
+    }
+  }
+
+  value = Slots[head & Mask];
+  Head.store(head + 1, std::memory_order_release);
+  Wake(NotFull, ProducerWaiting);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Push
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool SPSCRing<T, Capacity>::Push(const T& value, int timeout)
+{
+  // timeout is in milliseconds, negative waits forever. The other side is
+  // usually only a few instructions away, so spin briefly before sleeping.
+  for (unsigned int spin = 0; spin < SpinCount; ++spin)
+  {
+    if (true == TryPush(value))
+    {
+      return true;
+    }
+
+    std::this_thread::yield();
+  }
+
+  while (false == TryPush(value))
+  {
+    if (false == Wait(NotFull, ProducerWaiting, false, timeout))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Pop
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool SPSCRing<T, Capacity>::Pop(T& value, int timeout)
+{
+  // timeout is in milliseconds, negative waits forever. The other side is
+  // usually only a few instructions away, so spin briefly before sleeping.
+  for (unsigned int spin = 0; spin < SpinCount; ++spin)
+  {
+    if (true == TryPop(value))
+    {
+      return true;
+    }
+
+    std::this_thread::yield();
+  }
+
+  while (false == TryPop(value))
+  {
+    if (false == Wait(NotEmpty, ConsumerWaiting, true, timeout))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Count
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+unsigned int SPSCRing<T, Capacity>::Count() const
+{
+  return Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wait
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+bool SPSCRing<T, Capacity>::Wait(std::condition_variable& condition,
+                                 std::atomic<bool>& waiting,
+                                 bool consumer,
+                                 int timeout)
+{
+  // The waiting flag is raised before the ring is checked again, and the
+  // other side checks the flag after publishing its index, so one of the two
+  // always sees the other (both use sequentially consistent operations).
+  auto ready = [&]()
+  {
+    unsigned int used = Tail.load() - Head.load();
+    return (true == consumer ? 0 != used : Capacity != used);
+  };
+
+  std::unique_lock<std::mutex> guard(WaitLock);
+  waiting.store(true);
+
+  bool signaled = true;
+  if (timeout < 0)
+  {
+    condition.wait(guard, ready);
+  }
+  else
+  {
+    signaled = condition.wait_for(guard, std::chrono::milliseconds(timeout), ready);
+  }
+
+  waiting.store(false);
+  return signaled;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wake
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename T, unsigned int Capacity>
+void SPSCRing<T, Capacity>::Wake(std::condition_variable& condition,
+                                 std::atomic<bool>& waiting)
+{
+  // Only pay for the mutex when the other side is asleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (true == waiting.load())
+  {
+    std::lock_guard<std::mutex> guard(WaitLock);
+    condition.notify_one();
+  }
+}
@@ -0,0 +1,575 @@
+#include "VMArena.h"
+#include "ProtectionManager.h"
+#include "VMCipher.h"
+#include "VMFaultHandler.h"
+#include "X86Decoder.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Instance
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMArena& VMArena::Instance()
+{
+  static VMArena arena;
+  return arena;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Enable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::Enable(bool enable)
+{
+  // Functions already placed stay in the arena until they are freed. Stays
+  // off under the fault handler: it decrypts guarded pages in place, so a
+  // copy taken from the image could be ciphertext or plain code.
+  Active = ((true == enable) && (false == VMFaultHandler::Instance().Enabled()));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Enabled
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMArena::Enabled() const
+{
+  return Active.load(std::memory_order_relaxed);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Place
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned char* VMArena::Place(const unsigned char* code,
+                              unsigned int size,
+                              const unsigned char* key)
+{
+  // Left writable until Commit, so the next placement can share the chunk.
+  std::lock_guard<std::mutex> guard(Lock);
+  unsigned char* slot = PlaceLocked(code, size, key);
+  if (0 != slot)
+  {
+    Unsealed.store(true, std::memory_order_release);
+  }
+
+  return slot;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PlaceAll
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::PlaceAll(const std::vector<VMArenaRequest>& requests,
+                       const unsigned char* key,
+                       std::vector<unsigned char*>& slots)
+{
+  // All chunks touched by the batch are sealed with one flip each.
+  std::lock_guard<std::mutex> guard(Lock);
+
+  slots.assign(requests.size(), 0);
+  for (unsigned int i = 0; i < requests.size(); ++i)
+  {
+    slots[i] = PlaceLocked(requests[i].code, requests[i].size, key);
+  }
+
+  Seal();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Commit
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::Commit()
+{
+  // Called before every jump into the arena, a single load unless something
+  // was placed since the last seal.
+  if (false == Unsealed.load(std::memory_order_acquire))
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(Lock);
+  Seal();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Free
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::Free(unsigned char* slot, unsigned int size)
+{
+  unsigned int sizeClass = SizeClass(size);
+  if (sizeClass >= NumClasses)
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(Lock);
+  VMArenaChunk* chunk = FindChunk(slot);
+  if (0 == chunk)
+  {
+    return;
+  }
+
+  unsigned int slotSize = MinSlotSize << sizeClass;
+  --chunk->live;
+  CountPages(*chunk, slot, slotSize, -1);
+  FreeSlots[sizeClass].push_back(slot);
+
+  // Plaintext can only be wiped while nothing runs from it. A sealed chunk is
+  // wiped as a whole once its last function leaves, and stays writable for
+  // the next batch. Until then it drains, and only its pages no live slot
+  // touches any more can be wiped.
+  if (true == chunk->writable)
+  {
+    memset(slot, 0xCC, slotSize);
+  }
+  else if ((0 == chunk->live) && (true == SetWritable(*chunk, true)))
+  {
+    memset(chunk->base, 0xCC, chunk->used);
+  }
+  else
+  {
+    unsigned int first = static_cast<unsigned int>(slot - chunk->base) / PageSize;
+    unsigned int last = static_cast<unsigned int>(slot - chunk->base + slotSize - 1) / PageSize;
+    for (unsigned int page = first; page <= last; ++page)
+    {
+      if (0 == chunk->pageLive[page])
+      {
+        WipePage(chunk->base + (page * PageSize));
+      }
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Flips
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMArena::Flips()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return NumFlips;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  LiveSlots
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMArena::LiveSlots()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+
+  unsigned int live = 0;
+  for (const std::pair<const uintptr_t, VMArenaChunk>& chunk : Chunks)
+  {
+    live += chunk.second.live;
+  }
+
+  return live;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ChunkCount
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMArena::ChunkCount()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return static_cast<unsigned int>(Chunks.size());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMArena::VMArena() :
+  Active(false),
+  Unsealed(false),
+  NumFlips(0),
+  PageSize(ProtectionManager::Instance().GetPageSize())
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PlaceLocked
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned char* VMArena::PlaceLocked(const unsigned char* code,
+                                    unsigned int size,
+                                    const unsigned char* key)
+{
+  unsigned int sizeClass = SizeClass(size);
+  if ((0 == size) || (sizeClass >= NumClasses))
+  {
+    return 0;
+  }
+
+  unsigned char* slot = Allocate(sizeClass);
+  if (0 == slot)
+  {
+    return 0;
+  }
+
+  // Decrypt the copy, the image keeps the encrypted original untouched.
+  unsigned int slotSize = MinSlotSize << sizeClass;
+  memcpy(slot, code, size);
+  VMCipher::Apply(slot, size, key);
+  memset(slot + size, 0xCC, slotSize - size);
+
+  if ((true == IsSelfReferencing(slot, size, code)) ||
+      (false == Relocate(slot, size, code)))
+  {
+    memset(slot, 0xCC, slotSize);
+    FreeSlots[sizeClass].push_back(slot);
+    return 0;
+  }
+
+  VMArenaChunk* chunk = FindChunk(slot);
+  ++chunk->live;
+  CountPages(*chunk, slot, slotSize, 1);
+  return slot;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Allocate
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned char* VMArena::Allocate(unsigned int sizeClass)
+{
+  unsigned int slotSize = MinSlotSize << sizeClass;
+
+  // Reuse a free slot from a chunk nothing runs from, preferring one that is
+  // already writable so no flip is needed. Sealed chunks still running
+  // something are draining and hand out nothing.
+  std::vector<unsigned char*>& freeList = FreeSlots[sizeClass];
+  int candidate = -1;
+  for (unsigned int i = 0; i < freeList.size(); ++i)
+  {
+    VMArenaChunk* chunk = FindChunk(freeList[i]);
+    if (true == chunk->writable)
+    {
+      candidate = i;
+      break;
+    }
+
+    if ((candidate < 0) && (0 == chunk->live))
+    {
+      candidate = i;
+    }
+  }
+
+  if (candidate >= 0)
+  {
+    unsigned char* slot = freeList[candidate];
+    VMArenaChunk* chunk = FindChunk(slot);
+    if ((false == chunk->writable) && (false == SetWritable(*chunk, true)))
+    {
+      return 0;
+    }
+
+    freeList[candidate] = freeList.back();
+    freeList.pop_back();
+    return slot;
+  }
+
+  // Carve a new slot from a chunk with room left.
+  for (std::pair<const uintptr_t, VMArenaChunk>& entry : Chunks)
+  {
+    VMArenaChunk& chunk = entry.second;
+    if ((chunk.used + slotSize <= ChunkSize) &&
+        ((true == chunk.writable) || (0 == chunk.live)))
+    {
+      if ((false == chunk.writable) && (false == SetWritable(chunk, true)))
+      {
+        continue;
+      }
+
+      unsigned char* slot = chunk.base + chunk.used;
+      chunk.used += slotSize;
+      return slot;
+    }
+  }
+
+  // Start a new chunk, writable until its first seal.
+#ifdef _WIN32
+  unsigned char* base = reinterpret_cast<unsigned char*>
+                        (VirtualAlloc(0, ChunkSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+  unsigned char* base = reinterpret_cast<unsigned char*>
+                        (mmap(0, ChunkSize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (MAP_FAILED == base)
+  {
+    base = 0;
+  }
+#endif
+  if (0 == base)
+  {
+    return 0;
+  }
+
+  VMArenaChunk chunk = { base, slotSize, 0, true,
+                         std::vector<unsigned short>(ChunkSize / PageSize, 0) };
+  Chunks[reinterpret_cast<uintptr_t>(base)] = chunk;
+  return base;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Seal
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::Seal()
+{
+  // Empty chunks stay writable, they hold nothing to run.
+  for (std::pair<const uintptr_t, VMArenaChunk>& entry : Chunks)
+  {
+    if ((true == entry.second.writable) && (0 != entry.second.live))
+    {
+      SetWritable(entry.second, false);
+    }
+  }
+
+  Unsealed.store(false, std::memory_order_release);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SetWritable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMArena::SetWritable(VMArenaChunk& chunk, bool writable)
+{
+#ifdef _WIN32
+  unsigned long oldProtect;
+  bool success = (0 != VirtualProtect(chunk.base,
+                                      ChunkSize,
+                                      (true == writable ? PAGE_READWRITE : PAGE_EXECUTE_READ),
+                                      &oldProtect));
+#else
+  bool success = (0 == mprotect(chunk.base,
+                                ChunkSize,
+                                PROT_READ | (true == writable ? PROT_WRITE : PROT_EXEC)));
+#endif
+
+  if (true == success)
+  {
+    chunk.writable = writable;
+    ++NumFlips;
+  }
+
+  return success;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CountPages
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::CountPages(VMArenaChunk& chunk, unsigned char* slot, unsigned int size, int delta)
+{
+  // Slots of different classes share pages, and a large one may straddle two.
+  unsigned int first = static_cast<unsigned int>(slot - chunk.base) / PageSize;
+  unsigned int last = static_cast<unsigned int>(slot - chunk.base + size - 1) / PageSize;
+  for (unsigned int page = first; page <= last; ++page)
+  {
+    chunk.pageLive[page] = static_cast<unsigned short>(chunk.pageLive[page] + delta);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  WipePage
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMArena::WipePage(unsigned char* page)
+{
+  // A page of a draining chunk that nothing runs from any more. It stays RW
+  // until the chunk is flipped as a whole again.
+#ifdef _WIN32
+  unsigned long oldProtect;
+  bool success = (0 != VirtualProtect(page, PageSize, PAGE_READWRITE, &oldProtect));
+#else
+  bool success = (0 == mprotect(page, PageSize, PROT_READ | PROT_WRITE));
+#endif
+
+  if (true == success)
+  {
+    memset(page, 0xCC, PageSize);
+    ++NumFlips;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FindChunk
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMArenaChunk* VMArena::FindChunk(const unsigned char* address)
+{
+  // Last chunk starting at or before address.
+  std::map<uintptr_t, VMArenaChunk>::iterator chunk =
+    Chunks.upper_bound(reinterpret_cast<uintptr_t>(address));
+  if (Chunks.begin() == chunk)
+  {
+    return 0;
+  }
+
+  --chunk;
+  if (address >= chunk->second.base + ChunkSize)
+  {
+    return 0;
+  }
+
+  return &chunk->second;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SizeClass
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMArena::SizeClass(unsigned int size)
+{
+  unsigned int sizeClass = 0;
+  while ((sizeClass < NumClasses) && ((MinSlotSize << sizeClass) < size))
+  {
+    ++sizeClass;
+  }
+
+  return sizeClass;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Relocate
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMArena::Relocate(unsigned char* slot, unsigned int size, const unsigned char* original)
+{
+  // Branches inside the function move along with it. Those leaving it keep
+  // their target, which only rel32 encodings can reach from the arena.
+  long long delta = static_cast<long long>(reinterpret_cast<intptr_t>(original)) -
+                    static_cast<long long>(reinterpret_cast<intptr_t>(slot));
+
+  unsigned int pos = 0;
+  while (pos < size)
+  {
+    X86Instruction insn;
+    if (false == X86Decoder::Decode(slot + pos, size - pos, insn))
+    {
+      return false;
+    }
+
+    if (0 != (insn.flow & X86_FLOW_RELATIVE))
+    {
+      long long target = static_cast<long long>(pos) + insn.relTarget;
+      if ((target < 0) || (target >= size))
+      {
+        if (4 != insn.relSize)
+        {
+          return false;
+        }
+
+        int displacement = 0;
+        memcpy(&displacement, slot + pos + insn.relOffset, sizeof(displacement));
+
+        long long moved = displacement + delta;
+        if (moved != static_cast<int>(moved))
+        {
+          return false;
+        }
+
+        displacement = static_cast<int>(moved);
+        memcpy(slot + pos + insn.relOffset, &displacement, sizeof(displacement));
+      }
+    }
+
+    pos += insn.length;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  IsSelfReferencing
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMArena::IsSelfReferencing(const unsigned char* slot,
+                                unsigned int size,
+                                const unsigned char* original)
+{
+  // Absolute addresses are not relocated, so anything pointing back into the
+  // original would run or read the encrypted image. The decoder does not say
+  // where immediates and displacements sit, so every dword after the first
+  // byte of each instruction is checked; a false match only means the
+  // function is decrypted in place instead.
+  uintptr_t start = reinterpret_cast<uintptr_t>(original);
+  uintptr_t end = start + size;
+
+  unsigned int pos = 0;
+  while (pos < size)
+  {
+    X86Instruction insn;
+    if (false == X86Decoder::Decode(slot + pos, size - pos, insn))
+    {
+      return true;
+    }
+
+    for (unsigned int i = 1; i + sizeof(unsigned int) <= insn.length; ++i)
+    {
+      unsigned int value = 0;
+      memcpy(&value, slot + pos + i, sizeof(value));
+      if ((value >= start) && (value < end))
+      {
+        return true;
+      }
+    }
+
+    // jmp [table + index * scale] dispatches through a table of absolute
+    // addresses that may live anywhere, typically back into this function.
+    unsigned int opcode = pos;
+    while ((opcode < pos + insn.length) &&
+           ((0x66 == slot[opcode]) || (0x67 == slot[opcode]) || (0xF0 == slot[opcode]) ||
+            (0xF2 == slot[opcode]) || (0xF3 == slot[opcode]) || (0x2E == slot[opcode]) ||
+            (0x36 == slot[opcode]) || (0x3E == slot[opcode]) || (0x26 == slot[opcode]) ||
+            (0x64 == slot[opcode]) || (0x65 == slot[opcode])))
+    {
+      ++opcode;
+    }
+
+    if ((opcode + 2 < pos + insn.length) &&
+        (0xFF == slot[opcode]) &&
+        (4 == ((slot[opcode + 1] >> 3) & 7)) &&
+        (3 != (slot[opcode + 1] >> 6)) &&
+        (4 == (slot[opcode + 1] & 7)))
+    {
+      return true;
+    }
+
+    pos += insn.length;
+  }
+
+  return false;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// A block of executable memory carved into slots.
+struct VMArenaChunk
+{
+  unsigned char* base;
+  unsigned int used;  // Bytes handed out by the bump allocator
+  unsigned int live;  // Slots currently holding a decrypted function
+  bool writable;      // RW while being filled or wiped, RX otherwise
+  std::vector<unsigned short> pageLive; // Live slots touching each page
+};
+
+// One function to place, as found (encrypted) in the image.
+struct VMArenaRequest
+{
+  const unsigned char* code;
+  unsigned int size;
+};
+
+// Class Definition
+// Executable arena that functions are decrypted into instead of in place, so
+// image pages stay clean and shared between processes. Slots come in fixed
+// power of two size classes and are reused through per-class free lists.
+// Pages are never writable and executable at the same time: chunks are only
+// made writable while nothing runs from them (freshly carved or drained).
+// A slot freed while other functions in its sealed chunk may still run cannot
+// be wiped with the chunk. The chunk then drains: it hands out no slots until
+// it is empty, pages left without a live slot are wiped and made non-executable
+// straight away, and the rest of the plaintext is wiped with the last function.
+// Placements pile up in the open chunk and are sealed back to RX together,
+// either at the end of PlaceAll or by Commit right before anything runs from
+// the arena, so a burst of unlocks shares one chunk and one flip. rel32
+// branches leaving the function are re-targeted with the instruction decoder.
+// Functions holding absolute references into themselves (jump tables, pushed
+// return labels) cannot be moved and are refused. The arena cannot be enabled
+// while the fault handler is.
+class VMArena
+{
+public:
+  static VMArena& Instance();
+
+  void Enable(bool enable);
+  bool Enabled() const;
+  unsigned char* Place(const unsigned char* code, unsigned int size, const unsigned char* key);
+  void PlaceAll(const std::vector<VMArenaRequest>& requests,
+                const unsigned char* key,
+                std::vector<unsigned char*>& slots);
+  void Commit();
+  void Free(unsigned char* slot, unsigned int size);
+
+  unsigned int Flips();
+  unsigned int LiveSlots();
+  unsigned int ChunkCount();
+
+  static const unsigned int ChunkSize = 0x10000;
+  static const unsigned int MinSlotSize = 64;
+  static const unsigned int NumClasses = 7; // 64 bytes to 4KB
+
+private:
+  VMArena();
+  unsigned char* PlaceLocked(const unsigned char* code,
+                             unsigned int size,
+                             const unsigned char* key);
+  unsigned char* Allocate(unsigned int sizeClass);
+  void Seal();
+  bool SetWritable(VMArenaChunk& chunk, bool writable);
+  void CountPages(VMArenaChunk& chunk, unsigned char* slot, unsigned int size, int delta);
+  void WipePage(unsigned char* page);
+  VMArenaChunk* FindChunk(const unsigned char* address);
+  static unsigned int SizeClass(unsigned int size);
+  static bool Relocate(unsigned char* slot, unsigned int size, const unsigned char* original);
+  static bool IsSelfReferencing(const unsigned char* slot,
+                                unsigned int size,
+                                const unsigned char* original);
+
+  std::map<uintptr_t, VMArenaChunk> Chunks; // Keyed by base address
+  std::vector<unsigned char*> FreeSlots[NumClasses];
+  std::atomic<bool> Active;
+  std::atomic<bool> Unsealed; // Placements waiting for Commit
+  unsigned int NumFlips;
+  unsigned int PageSize;
+  std::mutex Lock;
+};
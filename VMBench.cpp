@@ -0,0 +1,1521 @@
+#include "VMBench.h"
+#include "BQueue.h"
+#include "CRC32.h"
+#include "MPMCQueue.h"
+#include "PEGenerator.h"
+#include "PortableExecutable.h"
+#include "ProtectionManager.h"
+#include "SPSCRing.h"
+#include "VMCipher.h"
+#include "VMFaultHandler.h"
+#include "VMFunctionTable.h"
+#include "VMPacker.h"
+#include "VMRemoteWatchdog.h"
+#include "VMUtils.h"
+#include "VMWatchdog.h"
+#include "X86Decoder.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+//
+// Static declarations
+//
+std::vector<VMBenchResult> VMBench::Results;
+unsigned int VMBench::Repeats = 5;
+
+static const double Megabyte = 1024.0 * 1024.0;
+
+#ifdef CLI_APP
+// The CLI build owns the process, so it can count every heap allocation.
+// malloc is counted too where it can be hooked: through the CRT allocation
+// hook in Windows debug builds and by interposing it on glibc. operator new
+// goes through malloc, so it only counts on its own where malloc is not seen.
+static std::atomic<unsigned long long> HeapAllocations(0);
+
+#if defined(_WIN32) && defined(_DEBUG)
+#define VM_COUNT_MALLOC
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CountAllocation
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static int CountAllocation(int type, void*, size_t, int, long, const unsigned char*, int)
+{
+  if ((_HOOK_ALLOC == type) || (_HOOK_REALLOC == type))
+  {
+    ++HeapAllocations;
+  }
+
+  return TRUE;
+}
+#elif defined(__GLIBC__)
+#define VM_COUNT_MALLOC
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* block, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+  ++HeapAllocations;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  ++HeapAllocations;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* block, size_t size)
+{
+  ++HeapAllocations;
+  return __libc_realloc(block, size);
+}
+#endif
+
+void* operator new(size_t size)
+{
+#ifndef VM_COUNT_MALLOC
+  ++HeapAllocations;
+#endif
+  void* block = malloc(0 == size ? 1 : size);
+  if (0 == block)
+  {
+    throw std::bad_alloc();
+  }
+
+  return block;
+}
+
+void operator delete(void* block) noexcept
+{
+  free(block);
+}
+#endif
+
+// Heartbeat master used by the queue handshake benchmark.
+static HeartQueue* BenchInQ = 0;
+static HeartQueue* BenchOutQ = 0;
+
+// Region used by the fault benchmark, the tables its unlock callback looks
+// functions up in and the key they are encrypted with.
+static unsigned char* BenchFaultBase = 0;
+static const VMFunctionTable* BenchFaultTable = 0;
+static const VMFunctionTable* BenchMacroTable = 0;
+static unsigned char BenchKey[VM_KEY_LEN] = { 0 };
+
+// Fake module used by the function lookup benchmark.
+static unsigned char* BenchLookupBase = 0;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BestOf
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename F>
+static double BestOf(unsigned int repeats, F func)
+{
+  // Seconds taken by the fastest of repeats calls.
+  double best = 0;
+  for (unsigned int i = 0; i < repeats; ++i)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    func();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if ((0 == i) || (seconds < best))
+    {
+      best = seconds;
+    }
+  }
+
+  return best;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchHeartTask
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static void BenchHeartTask()
+{
+  unsigned int beat = 0;
+  while (true == BenchInQ->TryPop(beat))
+  {
+    BenchOutQ->Push(beat + 1);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchTranslate
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static void* BenchTranslate(unsigned int offset)
+{
+  return BenchFaultBase + offset;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchLookupTranslate
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static void* BenchLookupTranslate(unsigned int offset)
+{
+  return BenchLookupBase + offset;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchUnlock
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static bool BenchUnlock(const void* func)
+{
+  // Decrypts in place the way AcquireFunction does, minus the reference
+  // count, so the fault and explicit paths pay for the same work.
+  const VMFunctionEntry* entry = BenchFaultTable->Find(func);
+  if (0 == entry)
+  {
+    entry = BenchMacroTable->Find(func);
+  }
+
+  if ((0 == entry) ||
+      (false == ProtectionManager::Instance().Acquire(entry->address, entry->function->size)))
+  {
+    return false;
+  }
+
+  VMCipher::Apply(entry->address, entry->function->size, BenchKey);
+  ProtectionManager::Instance().Release(entry->address, entry->function->size);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ReferenceXOR
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static void ReferenceXOR(unsigned char* ptr, unsigned int size, unsigned int uid)
+{
+  // The per byte keystream the cipher kernels replaced, kept verbatim.
+  for (unsigned int i = 0; i < size; ++i)
+  {
+    unsigned char key = 0;
+    switch (i % 8)
+    {
+    case 0:
+      key = uid & 0x000000FF;
+      break;
+    case 1:
+      key = (uid & 0x00000FF0) >> 4;
+      break;
+    case 2:
+      key = (uid & 0x0000FF00) >> 8;
+      break;
+    case 3:
+      key = (uid & 0x000FF000) >> 12;
+      break;
+    case 4:
+      key = (uid & 0x00FF0000) >> 16;
+      break;
+    case 5:
+      key = (uid & 0x0FF00000) >> 20;
+      break;
+    case 6:
+      key = (uid & 0xFF000000) >> 24;
+      break;
+    case 7:
+      key = (uid & 0xF0000000) >> 28;
+      break;
+    }
+
+    ptr[i] ^= key;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Run
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+int VMBench::Run(int argc, char* argv[])
+{
+  const char* outputPath = 0;
+  unsigned int maxExports = 10000;
+  std::vector<std::string> images;
+  for (int i = 2; i < argc; ++i)
+  {
+    if ((0 == strcmp(argv[i], "-o")) && (i + 1 < argc))
+    {
+      outputPath = argv[++i];
+    }
+    else if ((0 == strcmp(argv[i], "-g")) && (i + 1 < argc))
+    {
+      maxExports = strtoul(argv[++i], 0, 10);
+    }
+    else if ((0 == strcmp(argv[i], "-r")) && (i + 1 < argc))
+    {
+      Repeats = strtoul(argv[++i], 0, 10);
+      Repeats = (0 == Repeats ? 1 : Repeats);
+    }
+    else
+    {
+      images.push_back(argv[i]);
+    }
+  }
+
+  Results.clear();
+  BenchCRC32();
+  BenchCipher();
+  BenchDecoder();
+  BenchFunctionLookup();
+  BenchVirtualize();
+  BenchProtection();
+  BenchQueues();
+  BenchMPMCScaling();
+  BenchHeartbeat();
+  BenchWatchdog();
+  for (const std::string& image : images)
+  {
+    BenchImage(image);
+  }
+
+  // Export count sweep over generated images.
+  const unsigned int sweep[] = { 100, 1000, 10000, PEGenerator::MaxExports };
+  for (unsigned int exports : sweep)
+  {
+    if (exports > maxExports)
+    {
+      break;
+    }
+
+    PEGeneratorConfig config;
+    config.numExports = exports;
+    std::string path = "VMBench-" + std::to_string(exports) + ".exe";
+    if (true == PEGenerator::Generate(path, config))
+    {
+      BenchImage(path);
+    }
+
+    remove(path.c_str());
+  }
+
+  // Installs a process-wide handler, so it runs once everything else is done.
+  BenchFaults();
+
+  // Leaves a helper process that only goes away with us, so it runs last.
+  BenchRemoteHeartbeat(argv[0]);
+
+  return (true == WriteJson(outputPath) ? 0 : 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Check
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+int VMBench::Check(int argc, char* argv[])
+{
+  struct SelfCheck
+  {
+    const char* name;
+    bool (*check)();
+  };
+
+  const SelfCheck checks[] =
+  {
+    { "cipher", &CheckCipher },
+    { "decoder", &CheckDecoder },
+    { "heartbeat_allocations", &CheckHeartbeatAllocations },
+  };
+
+  // Each check prints what it found wrong, the exit code counts the failures.
+  int failed = 0;
+  for (const SelfCheck& check : checks)
+  {
+    bool passed = check.check();
+    printf("%s: %s\n", check.name, (true == passed ? "ok" : "FAILED"));
+    failed += (true == passed ? 0 : 1);
+  }
+
+  return failed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchCRC32
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchCRC32()
+{
+  std::vector<unsigned char> buffer(1 << 20);
+  for (unsigned int i = 0; i < buffer.size(); ++i)
+  {
+    buffer[i] = static_cast<unsigned char>(i * 31);
+  }
+
+  const unsigned int sizes[] = { 64, 4096, 1 << 20 };
+  for (unsigned int size : sizes)
+  {
+    unsigned int iterations = (64 << 20) / size;
+    double seconds = BestOf(Repeats, [&]()
+    {
+      unsigned int crc = 0;
+      for (unsigned int i = 0; i < iterations; ++i)
+      {
+        CRC32::CalculateCRC32(buffer.data(), size, crc);
+      }
+    });
+
+    Record("crc32", "size=" + std::to_string(size), "MB/s",
+           (static_cast<double>(size) * iterations) / seconds / Megabyte, iterations);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchCipher
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchCipher()
+{
+  std::vector<unsigned char> buffer(1 << 20, 0x5A);
+  const unsigned int iterations = 64;
+
+  // With an explicit uid the key stream is rebuilt on every call, as the
+  // packer does. Without one the cached process key is used.
+  double seconds = BestOf(Repeats, [&]()
+  {
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      VMUtils::XORvSection(buffer.data(), buffer.size(), 0x12345678);
+    }
+  });
+  Record("xor_section", "size=1048576,key=uid", "MB/s",
+         (buffer.size() * static_cast<double>(iterations)) / seconds / Megabyte, iterations);
+
+  seconds = BestOf(Repeats, [&]()
+  {
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      VMUtils::XORvSection(buffer.data(), buffer.size());
+    }
+  });
+  Record("xor_section", "size=1048576,key=cached", "MB/s",
+         (buffer.size() * static_cast<double>(iterations)) / seconds / Megabyte, iterations);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchDecoder
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchDecoder()
+{
+  // One long function, decoded instruction by instruction.
+  std::vector<unsigned char> code(1 << 16);
+  FillCode(code.data(), code.size());
+
+  unsigned int instructions = 0;
+  for (unsigned int pos = 0; pos < code.size(); ++instructions)
+  {
+    X86Instruction insn;
+    if (false == X86Decoder::Decode(code.data() + pos, code.size() - pos, insn))
+    {
+      break;
+    }
+
+    pos += insn.length;
+  }
+
+  const unsigned int iterations = 64;
+  double seconds = BestOf(Repeats, [&]()
+  {
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      X86Decoder::FunctionExtent(code.data(), code.size());
+    }
+  });
+  Record("decoder_function_extent", "size=65536", "Minsn/s",
+         (static_cast<double>(instructions) * iterations) / seconds / 1e6, iterations);
+
+  // Many short functions, decoded in parallel.
+  const unsigned int numFunctions = 4096;
+  const unsigned int functionSize = 256;
+  std::vector<unsigned char> image(numFunctions * functionSize);
+  std::vector<unsigned int> offsets(numFunctions);
+  std::vector<unsigned int> limits(numFunctions, functionSize);
+  for (unsigned int i = 0; i < numFunctions; ++i)
+  {
+    offsets[i] = i * functionSize;
+    FillCode(image.data() + offsets[i], functionSize);
+  }
+
+  unsigned int hardware = std::thread::hardware_concurrency();
+  for (unsigned int threads = 1; threads <= (hardware > 1 ? hardware : 1); threads *= 2)
+  {
+    std::vector<unsigned int> lengths;
+    seconds = BestOf(Repeats, [&]()
+    {
+      X86Decoder::FunctionExtents(image.data(), offsets, limits, lengths, threads);
+    });
+    Record("decoder_function_extents", "functions=4096,threads=" + std::to_string(threads),
+           "functions/s", numFunctions / seconds, numFunctions);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchFunctionLookup
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchFunctionLookup()
+{
+  // The function table probe VUNLOCK does against the linear scan over the
+  // layout it replaced. The addresses are never dereferenced.
+  const unsigned int counts[] = { 10, 1000, 100000 };
+  for (unsigned int numFunctions : counts)
+  {
+    const unsigned int stride = 16;
+    std::vector<unsigned char> module(numFunctions * stride);
+    BenchLookupBase = module.data();
+
+    std::vector<unsigned char> layoutBuffer(sizeof(VMLayout) + numFunctions * sizeof(VMFunction));
+    VMLayout* layout = reinterpret_cast<VMLayout*>(layoutBuffer.data());
+    layout->header.numFunctions = numFunctions;
+    for (unsigned int i = 0; i < numFunctions; ++i)
+    {
+      layout->functions[i].offset = i * stride;
+      layout->functions[i].size = stride;
+    }
+
+    VMFunctionTable table;
+    table.Build(layout, &BenchLookupTranslate);
+
+    // Queries walk the functions in a scattered but repeatable order.
+    const unsigned int tableLookups = 1000000;
+    unsigned int found = 0;
+    double seconds = BestOf(Repeats, [&]()
+    {
+      for (unsigned int i = 0; i < tableLookups; ++i)
+      {
+        unsigned int index = (i * 2654435761u) % numFunctions;
+        found += (0 != table.Find(module.data() + index * stride) ? 1 : 0);
+      }
+    });
+    Record("function_lookup", "functions=" + std::to_string(numFunctions) + ",mode=table",
+           "ns/lookup", seconds * 1e9 / tableLookups, tableLookups);
+
+    // The scan compares image offsets, as the old VUNLOCK did.
+    unsigned int scanLookups = 100000000 / numFunctions;
+    scanLookups = (scanLookups > tableLookups ? tableLookups : scanLookups);
+    seconds = BestOf(Repeats, [&]()
+    {
+      for (unsigned int i = 0; i < scanLookups; ++i)
+      {
+        unsigned int index = (i * 2654435761u) % numFunctions;
+        unsigned int offset = static_cast<unsigned int>(module.data() + index * stride - BenchLookupBase);
+        for (unsigned int j = 0; j < layout->header.numFunctions; ++j)
+        {
+          if (offset == layout->functions[j].offset)
+          {
+            ++found;
+            break;
+          }
+        }
+      }
+    });
+    Record("function_lookup", "functions=" + std::to_string(numFunctions) + ",mode=scan",
+           "ns/lookup", seconds * 1e9 / scanLookups, scanLookups);
+
+    BenchLookupBase = 0;
+    if (0 == found)
+    {
+      printf("function_lookup: no function found\n");
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchVirtualize
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchVirtualize()
+{
+  const unsigned int numFunctions = 4096;
+  const unsigned int functionSize = 256;
+  const unsigned int regionSize = numFunctions * functionSize;
+
+  // In place, through the protection manager, as at runtime. Removing the
+  // virtualization restores the code for the next round.
+  unsigned char* region = AllocatePages(regionSize);
+  if (0 != region)
+  {
+    for (unsigned int i = 0; i < numFunctions; ++i)
+    {
+      FillCode(region + i * functionSize, functionSize);
+    }
+
+    double bestVirtualize = 0;
+    double bestRemove = 0;
+    for (unsigned int repeat = 0; repeat < Repeats; ++repeat)
+    {
+      std::vector<unsigned int> sizes(numFunctions);
+      double virtualize = BestOf(1, [&]()
+      {
+        for (unsigned int i = 0; i < numFunctions; ++i)
+        {
+          sizes[i] = VMUtils::VirtualizeFunction(region + i * functionSize,
+                                                 VMUtils::UniqueId,
+                                                 functionSize);
+        }
+      });
+
+      double remove = BestOf(1, [&]()
+      {
+        for (unsigned int i = 0; i < numFunctions; ++i)
+        {
+          VMUtils::RemoveVirtualization(region + i * functionSize, sizes[i]);
+        }
+      });
+
+      bestVirtualize = ((0 == repeat) || (virtualize < bestVirtualize) ? virtualize : bestVirtualize);
+      bestRemove = ((0 == repeat) || (remove < bestRemove) ? remove : bestRemove);
+    }
+
+    Record("virtualize_function", "size=256", "ns/function",
+           bestVirtualize * 1e9 / numFunctions, numFunctions);
+    Record("remove_virtualization", "size=256", "ns/function",
+           bestRemove * 1e9 / numFunctions, numFunctions);
+    FreePages(region, regionSize);
+  }
+
+  // Offline, over a file image held in memory.
+  std::vector<unsigned char> image(regionSize);
+  std::vector<unsigned int> offsets(numFunctions);
+  std::vector<unsigned int> limits(numFunctions, functionSize);
+  for (unsigned int i = 0; i < numFunctions; ++i)
+  {
+    offsets[i] = i * functionSize;
+  }
+
+  unsigned int hardware = std::thread::hardware_concurrency();
+  for (unsigned int threads = 1; threads <= (hardware > 1 ? hardware : 1); threads *= 2)
+  {
+    double best = 0;
+    for (unsigned int repeat = 0; repeat < Repeats; ++repeat)
+    {
+      for (unsigned int i = 0; i < numFunctions; ++i)
+      {
+        FillCode(image.data() + offsets[i], functionSize);
+      }
+
+      std::vector<unsigned int> lengths;
+      double seconds = BestOf(1, [&]()
+      {
+        VMUtils::VirtualizeBuffer(image.data(), regionSize, offsets, limits,
+                                  0x12345678, lengths, threads);
+      });
+      best = ((0 == repeat) || (seconds < best) ? seconds : best);
+    }
+
+    Record("virtualize_buffer", "functions=4096,threads=" + std::to_string(threads), "MB/s",
+           regionSize / best / Megabyte, numFunctions);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchProtection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchProtection()
+{
+  ProtectionManager& manager = ProtectionManager::Instance();
+  const unsigned int pageSize = manager.GetPageSize();
+  const unsigned int numPages = 256;
+  unsigned char* region = AllocatePages(numPages * pageSize);
+  if (0 == region)
+  {
+    return;
+  }
+
+  // One small range at a time.
+  const unsigned int iterations = 10000;
+  double seconds = BestOf(Repeats, [&]()
+  {
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      manager.Acquire(region, 16);
+      manager.Release(region, 16);
+    }
+  });
+  Record("protect_single", "size=16", "ns/op", seconds * 1e9 / iterations, iterations);
+
+  // A batch of ranges over contiguous pages, as in a multi-function unlock.
+  std::vector<ProtectRange> ranges;
+  for (unsigned int i = 0; i < numPages; ++i)
+  {
+    ProtectRange range = { region + i * pageSize, 64 };
+    ranges.push_back(range);
+  }
+
+  unsigned int calls = manager.ProtectCalls();
+  seconds = BestOf(Repeats, [&]()
+  {
+    manager.Acquire(ranges);
+    manager.Release(ranges);
+  });
+  calls = manager.ProtectCalls() - calls;
+
+  Record("protect_batch", "ranges=256", "us/batch", seconds * 1e6, ranges.size());
+  Record("protect_batch", "ranges=256", "calls/batch",
+         static_cast<double>(calls) / Repeats, ranges.size());
+
+  FreePages(region, numPages * pageSize);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchFaults
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchFaults()
+{
+  // One encrypted function per page, so every first touch is a fault. The
+  // second half of the region is never guarded and is unlocked explicitly
+  // before each call, as VUNLOCK does.
+  const unsigned int pageSize = ProtectionManager::Instance().GetPageSize();
+  const unsigned int numFunctions = 256;
+  BenchFaultBase = AllocatePages(2 * numFunctions * pageSize);
+  if (0 == BenchFaultBase)
+  {
+    return;
+  }
+
+  // The handler keeps pointers into the layouts and tables for the rest of
+  // the process, so none of them are freed.
+  VMCipher::BuildKeyStream(0x12345678, BenchKey);
+  VMFunctionTable* tables[2] = { 0 };
+  for (unsigned int half = 0; half < 2; ++half)
+  {
+    unsigned char* layoutBuffer = new unsigned char[sizeof(VMLayout) + numFunctions * sizeof(VMFunction)]();
+    VMLayout* layout = reinterpret_cast<VMLayout*>(layoutBuffer);
+    layout->header.numFunctions = numFunctions;
+    for (unsigned int i = 0; i < numFunctions; ++i)
+    {
+      unsigned int offset = (half * numFunctions + i) * pageSize;
+      layout->functions[i].offset = offset;
+      layout->functions[i].size = 64;
+      FillCode(BenchFaultBase + offset, 64);
+      VMCipher::Apply(BenchFaultBase + offset, 64, BenchKey);
+    }
+
+    tables[half] = new VMFunctionTable();
+    tables[half]->Build(layout, &BenchTranslate);
+  }
+
+  BenchFaultTable = tables[0];
+  BenchMacroTable = tables[1];
+
+  volatile unsigned char sink = 0;
+  double seconds = BestOf(1, [&]()
+  {
+    for (unsigned int i = 0; i < numFunctions; ++i)
+    {
+      unsigned char* function = BenchFaultBase + (numFunctions + i) * pageSize;
+      BenchUnlock(function);
+      sink = sink + function[0];
+    }
+  });
+
+  Record("function_unlock", "path=macro,functions=256", "us/function",
+         seconds * 1e6 / numFunctions, numFunctions);
+
+  if (false == VMFaultHandler::Instance().Enable(*tables[0], &BenchUnlock, BenchKey))
+  {
+    return;
+  }
+
+  seconds = BestOf(1, [&]()
+  {
+    for (unsigned int i = 0; i < numFunctions; ++i)
+    {
+      sink = sink + BenchFaultBase[i * pageSize];
+    }
+  });
+
+  Record("function_unlock", "path=fault,functions=256", "us/function",
+         seconds * 1e6 / numFunctions, VMFaultHandler::Instance().Faults());
+  Record("fault_handler", "functions=256", "us/fault",
+         VMFaultHandler::Instance().AverageLatency(), VMFaultHandler::Instance().Faults());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchQueues
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchQueues()
+{
+  const unsigned int iterations = 1000000;
+
+  // BQueue, uncontended and between two threads.
+  BQueue bqueue(0);
+  double seconds = BestOf(Repeats, [&]()
+  {
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      bqueue.Push(&bqueue);
+      bqueue.Pop();
+    }
+  });
+  Record("bqueue_push_pop", "threads=1", "ns/op", seconds * 1e9 / iterations, iterations);
+
+  seconds = BestOf(Repeats, [&]()
+  {
+    std::thread producer([&]()
+    {
+      for (unsigned int i = 0; i < iterations; ++i)
+      {
+        bqueue.Push(&bqueue);
+      }
+    });
+
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      bqueue.Pop();
+    }
+
+    producer.join();
+  });
+  Record("bqueue_stream", "producers=1,consumers=1", "Mitems/s", iterations / seconds / 1e6, iterations);
+
+  // SPSCRing streaming and ping-pong.
+  SPSCRing<unsigned int, 1024>* ring = new SPSCRing<unsigned int, 1024>();
+  seconds = BestOf(Repeats, [&]()
+  {
+    std::thread producer([&]()
+    {
+      for (unsigned int i = 0; i < iterations; ++i)
+      {
+        ring->Push(i);
+      }
+    });
+
+    unsigned int value = 0;
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+      ring->Pop(value);
+    }
+
+    producer.join();
+  });
+  Record("spsc_stream", "capacity=1024", "Mitems/s", iterations / seconds / 1e6, iterations);
+  delete ring;
+
+  HeartQueue* ping = new HeartQueue();
+  HeartQueue* pong = new HeartQueue();
+  const unsigned int roundTrips = 100000;
+  seconds = BestOf(Repeats, [&]()
+  {
+    std::thread echo([&]()
+    {
+      unsigned int value = 0;
+      for (unsigned int i = 0; i < roundTrips; ++i)
+      {
+        ping->Pop(value);
+        pong->Push(value);
+      }
+    });
+
+    unsigned int value = 0;
+    for (unsigned int i = 0; i < roundTrips; ++i)
+    {
+      ping->Push(i);
+      pong->Pop(value);
+    }
+
+    echo.join();
+  });
+  Record("spsc_roundtrip", "capacity=16", "ns/roundtrip", seconds * 1e9 / roundTrips, roundTrips);
+  delete ping;
+  delete pong;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchMPMCScaling
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchMPMCScaling()
+{
+  const unsigned int iterations = 1000000;
+  typedef MPMCQueue<unsigned int, 1024> Queue;
+  Queue* queue = new Queue();
+
+  unsigned int hardware = std::thread::hardware_concurrency();
+  unsigned int maxPairs = (hardware > 2 ? hardware / 2 : 1);
+  const unsigned int batches[] = { 1, 16 };
+  for (unsigned int batch : batches)
+  {
+    for (unsigned int pairs = 1; pairs <= maxPairs; pairs *= 2)
+    {
+      double seconds = BestOf(Repeats, [&]()
+      {
+        std::atomic<unsigned int> consumed(0);
+        std::vector<std::thread> threads;
+        for (unsigned int p = 0; p < pairs; ++p)
+        {
+          threads.push_back(std::thread([&, p]()
+          {
+            unsigned int values[16] = { 0 };
+            unsigned int share = iterations / pairs + (p < iterations % pairs ? 1 : 0);
+            for (unsigned int sent = 0; sent < share; )
+            {
+              unsigned int count = (share - sent < batch ? share - sent : batch);
+              sent += queue->PushN(values, count);
+            }
+          }));
+
+          threads.push_back(std::thread([&]()
+          {
+            unsigned int values[16];
+            while (consumed.load() < iterations)
+            {
+              consumed += queue->PopN(values, batch, 10);
+            }
+          }));
+        }
+
+        for (std::thread& thread : threads)
+        {
+          thread.join();
+        }
+      });
+
+      Record("mpmc_stream",
+             "producers=" + std::to_string(pairs) + ",consumers=" + std::to_string(pairs) +
+             ",batch=" + std::to_string(batch),
+             "Mitems/s", iterations / seconds / 1e6, iterations);
+    }
+  }
+
+  delete queue;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchHeartbeat
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchHeartbeat()
+{
+  // Queue handshake through the watchdog, the way HeartBeatSlave and
+  // HeartBeatTask exchange beats.
+  BenchInQ = new HeartQueue();
+  BenchOutQ = new HeartQueue();
+  unsigned int task = VMWatchdog::Instance().Schedule(&BenchHeartTask, 0);
+  VMWatchdog::Instance().Start();
+
+  const unsigned int beats = 20000;
+  double cpu = CPUSeconds();
+  unsigned long long allocations = Allocations();
+  double seconds = BestOf(1, [&]()
+  {
+    unsigned int beat = 0;
+    for (unsigned int i = 0; i < beats; ++i)
+    {
+      BenchInQ->Push(beat);
+      VMWatchdog::Instance().Trigger(task);
+      BenchOutQ->Pop(beat, 1000);
+    }
+  });
+  cpu = CPUSeconds() - cpu;
+  allocations = Allocations() - allocations;
+
+  Record("heartbeat_queue", "mode=handshake", "ns/beat", seconds * 1e9 / beats, beats);
+  Record("heartbeat_queue", "mode=handshake", "cpu_ns/beat", cpu * 1e9 / beats, beats);
+  Record("heartbeat_queue", "mode=handshake", "allocations/beat",
+         static_cast<double>(allocations) / beats, beats);
+
+  // Epoch publish, the application side of the non-blocking protocol.
+  const unsigned int epochs = 10000000;
+  cpu = CPUSeconds();
+  allocations = Allocations();
+  seconds = BestOf(1, [&]()
+  {
+    for (unsigned int i = 0; i < epochs; ++i)
+    {
+      VMUtils::HeartBeatEpoch();
+    }
+  });
+  cpu = CPUSeconds() - cpu;
+  allocations = Allocations() - allocations;
+
+  Record("heartbeat_epoch", "mode=publish", "ns/beat", seconds * 1e9 / epochs, epochs);
+  Record("heartbeat_epoch", "mode=publish", "cpu_ns/beat", cpu * 1e9 / epochs, epochs);
+  Record("heartbeat_epoch", "mode=publish", "allocations/beat",
+         static_cast<double>(allocations) / epochs, epochs);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchWatchdog
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchWatchdog()
+{
+  const std::chrono::milliseconds window(1000);
+
+  // The old heartbeat thread: wake up every millisecond and look.
+  unsigned int polls = 0;
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + window;
+  while (std::chrono::steady_clock::now() < end)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ++polls;
+  }
+  Record("watchdog_wakeups", "mode=poll,sleep_ms=1", "wakeups/s", polls, polls);
+
+  // The scheduler with a single 10 ms task sleeps until each deadline.
+  VMWatchdog& watchdog = VMWatchdog::Instance();
+  watchdog.Start();
+  unsigned int task = watchdog.Schedule(&BenchHeartTask, 10);
+  unsigned int wakeups = watchdog.Wakeups();
+  std::this_thread::sleep_for(window);
+  wakeups = watchdog.Wakeups() - wakeups;
+  watchdog.Configure(task, 0, 0, 0);
+
+  Record("watchdog_wakeups", "mode=scheduler,period_ms=10", "wakeups/s", wakeups, wakeups);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchRemoteHeartbeat
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchRemoteHeartbeat(const char* helperPath)
+{
+  // The helper kills us if beats stop for longer than the timeout, which
+  // leaves room for writing the results.
+  unsigned int secret = 0;
+  VMSharedChannel* channel = VMRemoteWatchdog::Launch(helperPath, 30000, secret);
+  if (0 == channel)
+  {
+    return;
+  }
+
+  const unsigned int beats = 20000;
+  unsigned int heartBeat = 0;
+  channel->Send(heartBeat ^ secret);
+
+  double cpu = CPUSeconds();
+  double seconds = BestOf(1, [&]()
+  {
+    for (unsigned int i = 0; i < beats; ++i)
+    {
+      unsigned int beat = 0;
+      if ((false == channel->Receive(beat, 1000)) || (heartBeat + 1 != beat))
+      {
+        break;
+      }
+
+      heartBeat = beat;
+      channel->Send(heartBeat ^ secret);
+    }
+  });
+  cpu = CPUSeconds() - cpu;
+
+  if (beats == heartBeat)
+  {
+    Record("heartbeat_remote", "mode=handshake,side=owner", "ns/beat", seconds * 1e9 / beats, beats);
+    Record("heartbeat_remote", "mode=handshake,side=owner", "cpu_ns/beat", cpu * 1e9 / beats, beats);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BenchImage
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::BenchImage(const std::string& path)
+{
+  // Every run works on a fresh copy, the original is never opened for write.
+  std::string copy = path + ".bench";
+  std::string label = "image=" + path.substr(path.find_last_of("/\\") + 1);
+
+  std::vector<unsigned int> exportRVAs;
+  unsigned int fileSize = 0;
+  PortableExecutable::BackupFile(path, copy);
+  {
+    PortableExecutable pe;
+    if (false == pe.Attach(copy.c_str()))
+    {
+      remove(copy.c_str());
+      return;
+    }
+
+    fileSize = pe.GetStubFileSize();
+    for (const FunctionExport& entry : pe.Exports)
+    {
+      if (0 != entry.address)
+      {
+        exportRVAs.push_back(entry.address);
+      }
+    }
+  }
+  label += ",exports=" + std::to_string(exportRVAs.size());
+
+  const bool modes[] = { false, true };
+  for (bool mapFile : modes)
+  {
+    double seconds = BestOf(Repeats, [&]()
+    {
+      PortableExecutable pe;
+      pe.Attach(copy.c_str(), 0, mapFile);
+    });
+    Record("pe_attach", label + (true == mapFile ? ",mode=map" : ",mode=read"), "ms",
+           seconds * 1e3, Repeats);
+  }
+
+  // Only the export rewrite is timed, attaching is measured above.
+  double best = 0;
+  for (unsigned int repeat = 0; repeat < Repeats; ++repeat)
+  {
+    PortableExecutable::BackupFile(path, copy);
+    PortableExecutable pe;
+    if (false == pe.Attach(copy.c_str(), 0, true))
+    {
+      break;
+    }
+
+    double seconds = BestOf(1, [&]()
+    {
+      pe.DestroyExportFunctions(exportRVAs);
+    });
+    best = ((0 == repeat) || (seconds < best) ? seconds : best);
+  }
+  Record("pe_destroy_exports", label, "ms", best * 1e3, exportRVAs.size());
+
+  // Compacting after every other export is stripped, the table then holds
+  // both survivors and holes.
+  std::vector<unsigned int> halfRVAs;
+  for (unsigned int i = 0; i < exportRVAs.size(); i += 2)
+  {
+    halfRVAs.push_back(exportRVAs[i]);
+  }
+
+  best = 0;
+  for (unsigned int repeat = 0; repeat < Repeats; ++repeat)
+  {
+    PortableExecutable::BackupFile(path, copy);
+    PortableExecutable pe;
+    if (false == pe.Attach(copy.c_str(), 0, true))
+    {
+      break;
+    }
+
+    pe.DestroyExportFunctions(halfRVAs);
+    double seconds = BestOf(1, [&]()
+    {
+      pe.RebuildExportDirectory();
+    });
+    best = ((0 == repeat) || (seconds < best) ? seconds : best);
+  }
+  Record("pe_rebuild_exports", label + ",stripped=" + std::to_string(halfRVAs.size()),
+         "ms", best * 1e3, exportRVAs.size() - halfRVAs.size());
+
+  // Whole pack of every exported function, as the Build button does.
+  PackJob job;
+  job.path = copy;
+  job.uid = 0x12345678;
+  memset(job.ruid, 0, sizeof(job.ruid));
+  {
+    PortableExecutable pe;
+    if (true == pe.Attach(path.c_str()))
+    {
+      for (unsigned int rva : exportRVAs)
+      {
+        unsigned int offset = 0;
+        if (true == pe.RVAToOffset(rva, offset))
+        {
+          job.offsets.push_back(offset);
+        }
+      }
+    }
+  }
+
+  PackResult result;
+  best = 0;
+  for (unsigned int repeat = 0; repeat < Repeats; ++repeat)
+  {
+    PortableExecutable::BackupFile(path, copy);
+    if (false == VMPacker::PackFile(job, result))
+    {
+      break;
+    }
+
+    best = ((0 == repeat) || (result.seconds < best) ? result.seconds : best);
+    remove(result.output.c_str());
+  }
+  Record("pack_end_to_end", label, "ms", best * 1e3, job.offsets.size());
+  Record("pack_end_to_end", label, "MB/s", (0 == best ? 0 : fileSize / best / Megabyte),
+         job.offsets.size());
+
+  remove(copy.c_str());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CheckCipher
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMBench::CheckCipher()
+{
+  bool avx2 = false;
+  bool sse2 = false;
+  VMCipher::DetectFeatures(avx2, sse2);
+
+  struct CipherKernel
+  {
+    const char* name;
+    void (*apply)(unsigned char*, unsigned int, const unsigned char*);
+    bool supported;
+  };
+
+  const CipherKernel kernels[] =
+  {
+    { "scalar", &VMCipher::ApplyTail, true },
+    { "sse2", &VMCipher::ApplySSE2, sse2 },
+    { "avx2", &VMCipher::ApplyAVX2, avx2 },
+  };
+
+  // Every head misalignment and every length that ends in each of the
+  // vector, half vector and scalar tails, with guard bytes on either side
+  // that must come back untouched.
+  const unsigned int uids[] = { 0x12345678, 0xDEADBEEF, 0xFFFFFFFF, 0x80000001, 0 };
+  const unsigned int maxHead = 32;
+  const unsigned int maxLength = 129;
+  const unsigned int guard = 32;
+  std::vector<unsigned char> source(maxHead + maxLength + guard);
+  for (unsigned int i = 0; i < source.size(); ++i)
+  {
+    source[i] = static_cast<unsigned char>(i * 167 + 13);
+  }
+
+  std::vector<unsigned char> expected(source.size());
+  std::vector<unsigned char> actual(source.size());
+  bool passed = true;
+  for (unsigned int uid : uids)
+  {
+    unsigned char key[VM_KEY_LEN];
+    VMCipher::BuildKeyStream(uid, key);
+    for (unsigned int head = 0; head < maxHead; ++head)
+    {
+      for (unsigned int length = 0; length <= maxLength; ++length)
+      {
+        expected = source;
+        ReferenceXOR(expected.data() + head, length, uid);
+        for (const CipherKernel& kernel : kernels)
+        {
+          if (false == kernel.supported)
+          {
+            continue;
+          }
+
+          actual = source;
+          kernel.apply(actual.data() + head, length, key);
+          if (expected != actual)
+          {
+            printf("  %s: uid=%08X head=%u length=%u differs from the reference\n",
+                   kernel.name, uid, head, length);
+            passed = false;
+          }
+        }
+
+        // The dispatched entry point VMUtils goes through.
+        actual = source;
+        VMCipher::Apply(actual.data() + head, length, key);
+        if (expected != actual)
+        {
+          printf("  %s (dispatched): uid=%08X head=%u length=%u differs from the reference\n",
+                 VMCipher::KernelName(), uid, head, length);
+          passed = false;
+        }
+      }
+    }
+  }
+
+  return passed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CheckDecoder
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMBench::CheckDecoder()
+{
+  struct ExtentCase
+  {
+    const char* name;
+    unsigned char code[16];
+    unsigned int size;
+    unsigned int extent;
+  };
+
+  // Branches landing on the byte right after a ret keep the function going.
+  const ExtentCase cases[] =
+  {
+    { "frame", { 0x55, 0x89, 0xE5, 0x5D, 0xC3, 0xCC, 0xCC, 0xCC }, 8, 5 },
+    { "jcc_after_ret", { 0x85, 0xC0, 0x74, 0x01, 0xC3, 0x31, 0xC0, 0xC3, 0xCC, 0xCC }, 10, 8 },
+    { "jcc_over_ret", { 0x74, 0x03, 0x31, 0xC0, 0xC3, 0x40, 0xC3, 0xCC, 0xCC }, 9, 7 },
+    { "jcc_to_int3", { 0x74, 0x01, 0xC3, 0xCC, 0xC3, 0xCC, 0xCC }, 7, 5 },
+    { "leading_int3", { 0xCC, 0xC3 }, 2, 0 },
+  };
+
+  bool passed = true;
+  for (const ExtentCase& test : cases)
+  {
+    unsigned int extent = X86Decoder::FunctionExtent(test.code, test.size);
+    if (test.extent != extent)
+    {
+      printf("  %s: extent %u, expected %u\n", test.name, extent, test.extent);
+      passed = false;
+    }
+  }
+
+  return passed;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CheckHeartbeatAllocations
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMBench::CheckHeartbeatAllocations()
+{
+  // The real handshake: the watchdog runs HeartBeatTask while this thread is
+  // the application calling HeartBeatSlave, with epoch beats mixed in. Once
+  // warmed up, no beat may touch the heap on either side.
+  VMUtils::InitializeQueues();
+  for (unsigned int i = 0; i < 100; ++i)
+  {
+    VMUtils::HeartBeatSlave();
+  }
+
+  const unsigned int beats = 10000;
+  unsigned long long allocations = Allocations();
+  for (unsigned int i = 0; i < beats; ++i)
+  {
+    VMUtils::HeartBeatSlave();
+    VMUtils::HeartBeatEpoch();
+  }
+  allocations = Allocations() - allocations;
+
+#if defined(CLI_APP) && !defined(VM_COUNT_MALLOC)
+  printf("  malloc is not hooked in this build, only operator new is counted\n");
+#endif
+  if (0 != allocations)
+  {
+    printf("  %llu heap allocations over %u beats\n", allocations, beats);
+    return false;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Record
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::Record(const std::string& name,
+                     const std::string& params,
+                     const std::string& unit,
+                     double value,
+                     unsigned long long iterations)
+{
+  VMBenchResult result = { name, params, unit, value, iterations };
+  Results.push_back(result);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  WriteJson
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMBench::WriteJson(const char* path)
+{
+  FILE* output = (0 == path ? stdout : fopen(path, "w"));
+  if (0 == output)
+  {
+    return false;
+  }
+
+  // Only image names can carry characters that need escaping.
+  auto escape = [](const std::string& text)
+  {
+    std::string escaped;
+    for (char ch : text)
+    {
+      if (('"' == ch) || ('\\' == ch))
+      {
+        escaped += '\\';
+      }
+
+      escaped += ch;
+    }
+
+    return escaped;
+  };
+
+  fprintf(output, "{\n  \"crc32_engine\": \"%s\",\n  \"results\": [\n", CRC32::EngineName());
+  for (unsigned int i = 0; i < Results.size(); ++i)
+  {
+    const VMBenchResult& result = Results[i];
+    fprintf(output,
+            "    { \"name\": \"%s\", \"params\": \"%s\", \"unit\": \"%s\", "
+            "\"value\": %.6g, \"iterations\": %llu }%s\n",
+            escape(result.name).c_str(),
+            escape(result.params).c_str(),
+            escape(result.unit).c_str(),
+            result.value,
+            result.iterations,
+            (i + 1 < Results.size() ? "," : ""));
+  }
+  fprintf(output, "  ]\n}\n");
+
+  if (stdout != output)
+  {
+    fclose(output);
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FillCode
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::FillCode(unsigned char* code, unsigned int size)
+{
+  // A typical prologue / body / epilogue mix, repeated, then a single ret.
+  static const unsigned char body[] =
+  {
+    0x55,                         // push ebp
+    0x8B, 0xEC,                   // mov ebp, esp
+    0x8B, 0x45, 0x08,             // mov eax, [ebp+8]
+    0x05, 0x78, 0x56, 0x34, 0x12, // add eax, 0x12345678
+    0x83, 0xF8, 0x10,             // cmp eax, 16
+    0x74, 0x02,                   // je +2
+    0x33, 0xC0,                   // xor eax, eax
+    0x89, 0x45, 0xFC,             // mov [ebp-4], eax
+    0xE8, 0x00, 0x00, 0x00, 0x00, // call next
+    0x5D                          // pop ebp
+  };
+
+  unsigned int pos = 0;
+  while (pos + sizeof(body) < size)
+  {
+    memcpy(code + pos, body, sizeof(body));
+    pos += sizeof(body);
+  }
+
+  memset(code + pos, 0x90, size - pos - 1);
+  code[size - 1] = 0xC3;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  AllocatePages
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned char* VMBench::AllocatePages(unsigned int size)
+{
+#ifdef _WIN32
+  return reinterpret_cast<unsigned char*>
+         (VirtualAlloc(0, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+#else
+  void* pages = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (MAP_FAILED == pages ? 0 : reinterpret_cast<unsigned char*>(pages));
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FreePages
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMBench::FreePages(unsigned char* pages, unsigned int size)
+{
+#ifdef _WIN32
+  VirtualFree(pages, 0, MEM_RELEASE);
+#else
+  munmap(pages, size);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CPUSeconds
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+double VMBench::CPUSeconds()
+{
+  // User plus kernel time of every thread in the process.
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+
+  unsigned long long total = (static_cast<unsigned long long>(kernel.dwHighDateTime) << 32) +
+                             kernel.dwLowDateTime +
+                             (static_cast<unsigned long long>(user.dwHighDateTime) << 32) +
+                             user.dwLowDateTime;
+  return total / 1e7;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Allocations
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned long long VMBench::Allocations()
+{
+  // Heap allocations made so far, only counted in the CLI build.
+#ifdef CLI_APP
+#if defined(_WIN32) && defined(_DEBUG)
+  // Installed before the first count is taken, counts are only ever compared.
+  static const _CRT_ALLOC_HOOK previous = _CrtSetAllocHook(&CountAllocation);
+#endif
+  return HeapAllocations.load();
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+// External dependencies
+#include <string>
+#include <vector>
+
+// One measurement, written as a single JSON object.
+struct VMBenchResult
+{
+  std::string name;
+  std::string params;
+  std::string unit;
+  double value;
+  unsigned long long iterations;
+};
+
+// Class Definition
+// Measures the VMLock hot paths and writes the results as JSON so regressions
+// can be tracked across releases. Runs from the CLI build:
+//   VMLock --bench [-o results.json] [-r repeats] [-g max exports] [image ...]
+// Every image given, and a generated image per export count up to -g (default
+// 10000, 0 skips them), is attached, stripped of its exports and packed end to
+// end on a copy; the rest of the suite runs on synthetic data. Each timing is
+// the best of the repeats. Output:
+//   { "crc32_engine": "...", "results": [
+//     { "name": "...", "params": "...", "unit": "...", "value": 0.0, "iterations": 0 } ] }
+// VMLock --check runs the self checks instead, comparing the optimized paths
+// against the code they replaced, and exits with the number that failed.
+class VMBench
+{
+public:
+  static int Run(int argc, char* argv[]);
+  static int Check(int argc, char* argv[]);
+
+private:
+  // Primitives
+  static void BenchCRC32();
+  static void BenchCipher();
+  static void BenchDecoder();
+  static void BenchFunctionLookup();
+  static void BenchVirtualize();
+  static void BenchProtection();
+  static void BenchFaults();
+
+  // Queues and liveness
+  static void BenchQueues();
+  static void BenchMPMCScaling();
+  static void BenchHeartbeat();
+  static void BenchWatchdog();
+  static void BenchRemoteHeartbeat(const char* helperPath);
+
+  // File images
+  static void BenchImage(const std::string& path);
+
+  // Self checks
+  static bool CheckCipher();
+  static bool CheckDecoder();
+  static bool CheckHeartbeatAllocations();
+
+  static void Record(const std::string& name,
+                     const std::string& params,
+                     const std::string& unit,
+                     double value,
+                     unsigned long long iterations);
+  static bool WriteJson(const char* path);
+  static void FillCode(unsigned char* code, unsigned int size);
+  static unsigned char* AllocatePages(unsigned int size);
+  static void FreePages(unsigned char* pages, unsigned int size);
+  static double CPUSeconds();
+  static unsigned long long Allocations();
+
+  static std::vector<VMBenchResult> Results;
+  static unsigned int Repeats;
+};
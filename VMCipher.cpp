@@ -0,0 +1,203 @@
+#include "VMCipher.h"
+#include <string.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CIPHER_TARGET(isa)
+#else
+#include <cpuid.h>
+#define CIPHER_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BuildKeyStream
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMCipher::BuildKeyStream(unsigned int uid, unsigned char* key)
+{
+  // Byte i of the keystream is the identifier shifted by i nibbles, the last
+  // one only keeps the top nibble.
+  for (unsigned int i = 0; i < VM_KEY_LEN; ++i)
+  {
+    key[i] = static_cast<unsigned char>(uid >> (4 * i));
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Apply
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMCipher::Apply(void* buf, unsigned int size, const unsigned char* key)
+{
+  SelectKernel().apply(reinterpret_cast<unsigned char*>(buf), size, key);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ApplyScalar
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMCipher::ApplyScalar(void* buf, unsigned int size, const unsigned char* key)
+{
+  ApplyTail(reinterpret_cast<unsigned char*>(buf), size, key);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  KernelName
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const char* VMCipher::KernelName()
+{
+  return SelectKernel().name;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SelectKernel
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const VMCipher::Kernel& VMCipher::SelectKernel()
+{
+  static const Kernel kernel = []()
+  {
+    bool avx2 = false;
+    bool sse2 = false;
+    DetectFeatures(avx2, sse2);
+
+    Kernel selected = { &VMCipher::ApplyTail, "scalar" };
+    if (true == avx2)
+    {
+      selected.apply = &VMCipher::ApplyAVX2;
+      selected.name = "avx2";
+    }
+    else if (true == sse2)
+    {
+      selected.apply = &VMCipher::ApplySSE2;
+      selected.name = "sse2";
+    }
+
+    return selected;
+  }();
+
+  return kernel;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  DetectFeatures
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMCipher::DetectFeatures(bool& avx2, bool& sse2)
+{
+  unsigned int leaf1[4] = { 0 };
+  unsigned int leaf7[4] = { 0 };
+  unsigned int xcr0 = 0;
+#ifdef _MSC_VER
+  __cpuid(reinterpret_cast<int*>(leaf1), 1);
+  __cpuidex(reinterpret_cast<int*>(leaf7), 7, 0);
+  if (0 != (leaf1[2] & (1 << 27)))
+  {
+    xcr0 = static_cast<unsigned int>(_xgetbv(0));
+  }
+#else
+  __get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3]);
+  __get_cpuid_count(7, 0, &leaf7[0], &leaf7[1], &leaf7[2], &leaf7[3]);
+  if (0 != (leaf1[2] & (1 << 27)))
+  {
+    unsigned int edx = 0;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+  }
+#endif
+
+  // AVX2 needs both the instruction set and the OS saving YMM state.
+  avx2 = (0 != (leaf7[1] & (1 << 5))) && (6 == (xcr0 & 6));
+  sse2 = (0 != (leaf1[3] & (1 << 26)));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ApplySSE2
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+CIPHER_TARGET("sse2")
+void VMCipher::ApplySSE2(unsigned char* buf, unsigned int size, const unsigned char* key)
+{
+  // 16 is a multiple of the key length, so the key phase never changes
+  // between vectors.
+  __m128i k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(key));
+  k = _mm_unpacklo_epi64(k, k);
+
+  unsigned int i = 0;
+  for (; i + 64 <= size; i += 64)
+  {
+    __m128i* p = reinterpret_cast<__m128i*>(buf + i);
+    _mm_storeu_si128(p + 0, _mm_xor_si128(_mm_loadu_si128(p + 0), k));
+    _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), k));
+    _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), k));
+    _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), k));
+  }
+
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i* p = reinterpret_cast<__m128i*>(buf + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k));
+  }
+
+  ApplyTail(buf + i, size - i, key);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ApplyAVX2
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+CIPHER_TARGET("avx2")
+void VMCipher::ApplyAVX2(unsigned char* buf, unsigned int size, const unsigned char* key)
+{
+  __m128i half = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(key));
+  half = _mm_unpacklo_epi64(half, half);
+  __m256i k = _mm256_broadcastsi128_si256(half);
+
+  unsigned int i = 0;
+  for (; i + 128 <= size; i += 128)
+  {
+    __m256i* p = reinterpret_cast<__m256i*>(buf + i);
+    _mm256_storeu_si256(p + 0, _mm256_xor_si256(_mm256_loadu_si256(p + 0), k));
+    _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), k));
+    _mm256_storeu_si256(p + 2, _mm256_xor_si256(_mm256_loadu_si256(p + 2), k));
+    _mm256_storeu_si256(p + 3, _mm256_xor_si256(_mm256_loadu_si256(p + 3), k));
+  }
+
+  for (; i + 32 <= size; i += 32)
+  {
+    __m256i* p = reinterpret_cast<__m256i*>(buf + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+  }
+
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i* p = reinterpret_cast<__m128i*>(buf + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), half));
+  }
+
+  ApplyTail(buf + i, size - i, key);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ApplyTail
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMCipher::ApplyTail(unsigned char* buf, unsigned int size, const unsigned char* key)
+{
+  // Callers always start the tail on a multiple of the key length.
+  for (unsigned int i = 0; i < size; ++i)
+  {
+    buf[i] ^= key[i % VM_KEY_LEN];
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Keystream size in bytes, one key byte per (i % 8) position.
+#define VM_KEY_LEN 8
+
+// Class Definition
+// XOR keystream kernel shared by section and function virtualization. The
+// 8-byte keystream is derived once per identifier and applied with the widest
+// vector unit the CPU supports (AVX2, SSE2, scalar tail).
+class VMCipher
+{
+public:
+  static void BuildKeyStream(unsigned int uid, unsigned char* key);
+  static void Apply(void* buf, unsigned int size, const unsigned char* key);
+  static void ApplyScalar(void* buf, unsigned int size, const unsigned char* key);
+  static const char* KernelName();
+
+private:
+  // The self check runs every kernel the CPU supports, not just the fastest.
+  friend class VMBench;
+
+  typedef void (*ApplyFunc)(unsigned char*, unsigned int, const unsigned char*);
+
+  struct Kernel
+  {
+    ApplyFunc apply;
+    const char* name;
+  };
+
+  static const Kernel& SelectKernel();
+  static void DetectFeatures(bool& avx2, bool& sse2);
+  static void ApplySSE2(unsigned char* buf, unsigned int size, const unsigned char* key);
+  static void ApplyAVX2(unsigned char* buf, unsigned int size, const unsigned char* key);
+  static void ApplyTail(unsigned char* buf, unsigned int size, const unsigned char* key);
+};
@@ -0,0 +1,539 @@
+#include "VMFaultHandler.h"
+#include "VMArena.h"
+#include "VMCipher.h"
+#include <algorithm>
+#include <chrono>
+#include <limits.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <signal.h>
+#include <string.h>
+#endif
+
+#ifdef _WIN32
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  VectoredHandler
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static LONG CALLBACK VectoredHandler(EXCEPTION_POINTERS* info)
+{
+  // ExceptionInformation[1] holds the inaccessible address.
+  if ((EXCEPTION_ACCESS_VIOLATION == info->ExceptionRecord->ExceptionCode) &&
+      (true == VMFaultHandler::Instance().HandleFault
+               (reinterpret_cast<const void*>(info->ExceptionRecord->ExceptionInformation[1]))))
+  {
+    return EXCEPTION_CONTINUE_EXECUTION;
+  }
+
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+static struct sigaction PreviousAction;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SignalHandler
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+static void SignalHandler(int signal, siginfo_t* info, void* context)
+{
+  if (true == VMFaultHandler::Instance().HandleFault(info->si_addr))
+  {
+    return;
+  }
+
+  // Not ours, the faulting instruction runs again under the old disposition.
+  sigaction(SIGSEGV, &PreviousAction, 0);
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Instance
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMFaultHandler& VMFaultHandler::Instance()
+{
+  static VMFaultHandler handler;
+  return handler;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Enable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::Enable(const VMFunctionTable& table,
+                            bool (*unlock)(const void*),
+                            const unsigned char* key)
+{
+  std::vector<const void*> eagerFunctions;
+  {
+    std::lock_guard<std::mutex> guard(Lock);
+    if (true == Installed)
+    {
+      return true;
+    }
+
+    // Arena unlocks leave the image encrypted, a faulting thread would resume
+    // into ciphertext.
+    if (true == VMArena::Instance().Enabled())
+    {
+      return false;
+    }
+
+    std::vector<const VMFunctionEntry*> entries;
+    table.Collect(entries);
+
+    Ranges.clear();
+    for (const VMFunctionEntry* entry : entries)
+    {
+      if (0 == entry->function->size)
+      {
+        continue;
+      }
+
+      uintptr_t start = reinterpret_cast<uintptr_t>(entry->address);
+      VMFaultRange range = { start, start + entry->function->size, entry };
+      Ranges.push_back(range);
+    }
+
+    std::sort(Ranges.begin(), Ranges.end(),
+              [](const VMFaultRange& left, const VMFaultRange& right)
+              {
+                return left.start < right.start;
+              });
+
+    PageMask = ~static_cast<uintptr_t>(ProtectionManager::Instance().GetPageSize() - 1);
+    uintptr_t pageSize = ~PageMask + 1;
+
+    // A page is only guarded when everything on it besides protected functions
+    // is padding, since it is not executable while being decrypted. Functions
+    // touching any other page are unlocked now.
+    std::vector<bool> eager(Ranges.size(), false);
+    std::vector<uintptr_t> pages;
+    for (unsigned int i = 0; i < Ranges.size(); ++i)
+    {
+      for (uintptr_t page = Ranges[i].start & PageMask; page < Ranges[i].end; page += pageSize)
+      {
+        pages.push_back(page);
+      }
+    }
+
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    std::vector<uintptr_t> guardable;
+    for (uintptr_t page : pages)
+    {
+      // Functions do not overlap, so their ends are sorted as well.
+      std::vector<VMFaultRange>::iterator first =
+        std::lower_bound(Ranges.begin(), Ranges.end(), page,
+                         [](const VMFaultRange& entry, uintptr_t value)
+                         {
+                           return entry.end <= value;
+                         });
+
+      uintptr_t cursor = page;
+      bool clean = true;
+      std::vector<VMFaultRange>::iterator range = first;
+      for (; (Ranges.end() != range) && (range->start < page + pageSize); ++range)
+      {
+        clean = clean && (true == IsPadding(cursor, range->start));
+        cursor = (range->end > cursor ? range->end : cursor);
+      }
+
+      clean = clean && (true == IsPadding(cursor, page + pageSize));
+      if (true == clean)
+      {
+        guardable.push_back(page);
+        continue;
+      }
+
+      for (range = first; (Ranges.end() != range) && (range->start < page + pageSize); ++range)
+      {
+        eager[range - Ranges.begin()] = true;
+      }
+    }
+
+    // Pages whose every function was unlocked up front need no guard.
+    Pages.clear();
+    for (uintptr_t page : guardable)
+    {
+      std::vector<VMFaultRange>::iterator range =
+        std::lower_bound(Ranges.begin(), Ranges.end(), page,
+                         [](const VMFaultRange& entry, uintptr_t value)
+                         {
+                           return entry.end <= value;
+                         });
+      for (; (Ranges.end() != range) && (range->start < page + pageSize); ++range)
+      {
+        if (false == eager[range - Ranges.begin()])
+        {
+          GuardedPage guarded = { page, 0 };
+          Pages.push_back(guarded);
+          break;
+        }
+      }
+    }
+
+    for (unsigned int i = 0; i < Ranges.size(); ++i)
+    {
+      if (true == eager[i])
+      {
+        eagerFunctions.push_back(Ranges[i].entry->address);
+      }
+    }
+
+    BuildClosures(eager);
+    ClosureStates.reset(new std::atomic<int>[Closures.size()]);
+    for (unsigned int i = 0; i < Closures.size(); ++i)
+    {
+      ClosureStates[i].store(VM_FAULT_LOCKED);
+    }
+
+    // The cipher picks its kernel on first use, which must not happen in the
+    // handler.
+    Key = key;
+    VMCipher::KernelName();
+  }
+
+  for (const void* function : eagerFunctions)
+  {
+    unlock(function);
+  }
+
+  // The handler has to be in place before the first page goes away.
+  if (false == InstallHandler())
+  {
+    return false;
+  }
+
+  Installed.store(true, std::memory_order_release);
+  return ProtectionManager::Instance().Guard(Pages);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  HandleFault
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::HandleFault(const void* address)
+{
+  // Runs inside the signal or exception handler: no locks, no allocations.
+  unsigned int index = 0;
+  if ((false == Installed.load(std::memory_order_acquire)) ||
+      (false == FindPage(reinterpret_cast<uintptr_t>(address) & PageMask, index)))
+  {
+    return false;
+  }
+
+  // Last fault this thread retried without changing anything.
+  static thread_local const void* retried = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // Whoever claims the closure opens it, everyone else faulting on one of its
+  // pages waits until it is done.
+  unsigned int closure = PageClosures[index];
+  bool changed = false;
+  if (true == Claim(ClosureStates[closure]))
+  {
+    Open(Closures[closure]);
+    ClosureStates[closure].store(VM_FAULT_OPEN, std::memory_order_release);
+    changed = true;
+  }
+
+  WaitOpen(ClosureStates[closure]);
+
+  if (false == changed)
+  {
+    // Another thread resolved this page, retry once. Faulting again on the
+    // same address is a genuine access violation.
+    if (address == retried)
+    {
+      retried = 0;
+      return false;
+    }
+
+    retried = address;
+    return true;
+  }
+
+  retried = 0;
+  ++NumFaults;
+  FaultNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>
+                      (std::chrono::steady_clock::now() - start).count();
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Enabled
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::Enabled() const
+{
+  return Installed.load(std::memory_order_acquire);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Faults
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMFaultHandler::Faults() const
+{
+  return NumFaults.load();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  AverageLatency
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+double VMFaultHandler::AverageLatency() const
+{
+  // Microseconds spent in the handler per resolved fault.
+  unsigned int faults = NumFaults.load();
+  return (0 == faults ? 0 : (FaultNanoseconds.load() / 1000.0) / faults);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMFaultHandler::VMFaultHandler() :
+  Key(0),
+  PageMask(0),
+  Installed(false),
+  NumFaults(0),
+  FaultNanoseconds(0)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  InstallHandler
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::InstallHandler()
+{
+#ifdef _WIN32
+  // First in line, ahead of any handler the application adds.
+  return (0 != AddVectoredExceptionHandler(1, &VectoredHandler));
+#else
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = &SignalHandler;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+
+  return (0 == sigaction(SIGSEGV, &action, &PreviousAction));
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  IsPadding
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::IsPadding(uintptr_t start, uintptr_t end) const
+{
+  // int3 and nop fill between functions, zeros past the end of a section.
+  for (uintptr_t address = start; address < end; ++address)
+  {
+    unsigned char byte = *reinterpret_cast<const unsigned char*>(address);
+    if ((0xCC != byte) && (0x90 != byte) && (0x00 != byte))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FindPage
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::FindPage(uintptr_t page, unsigned int& index) const
+{
+  std::vector<GuardedPage>::const_iterator found =
+    std::lower_bound(Pages.begin(), Pages.end(), page,
+                     [](const GuardedPage& entry, uintptr_t value)
+                     {
+                       return entry.page < value;
+                     });
+  if ((Pages.end() == found) || (page != found->page))
+  {
+    return false;
+  }
+
+  index = static_cast<unsigned int>(found - Pages.begin());
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BuildClosures
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFaultHandler::BuildClosures(const std::vector<bool>& eager)
+{
+  // A function spilling onto another page pulls in that page's functions as
+  // well, otherwise the next page would fault in the middle of the call. The
+  // pages reached that way share one closure, whichever of them faults first.
+  uintptr_t pageSize = ~PageMask + 1;
+  std::vector<bool> functionMark(Ranges.size(), false);
+
+  PageClosures.assign(Pages.size(), UINT_MAX);
+  Closures.clear();
+  ClosurePages.clear();
+  ClosureFunctions.clear();
+  for (unsigned int i = 0; i < Pages.size(); ++i)
+  {
+    if (UINT_MAX != PageClosures[i])
+    {
+      continue;
+    }
+
+    unsigned int closureIndex = static_cast<unsigned int>(Closures.size());
+    VMFaultClosure closure = { static_cast<unsigned int>(ClosurePages.size()), 0,
+                               static_cast<unsigned int>(ClosureFunctions.size()), 0 };
+    std::vector<unsigned int> pending(1, i);
+    PageClosures[i] = closureIndex;
+    while (false == pending.empty())
+    {
+      unsigned int current = pending.back();
+      pending.pop_back();
+      ClosurePages.push_back(current);
+
+      uintptr_t page = Pages[current].page;
+      std::vector<VMFaultRange>::iterator range =
+        std::lower_bound(Ranges.begin(), Ranges.end(), page,
+                         [](const VMFaultRange& entry, uintptr_t value)
+                         {
+                           return entry.end <= value;
+                         });
+      for (; (Ranges.end() != range) && (range->start < page + pageSize); ++range)
+      {
+        unsigned int function = static_cast<unsigned int>(range - Ranges.begin());
+        if ((true == eager[function]) || (true == functionMark[function]))
+        {
+          continue;
+        }
+
+        functionMark[function] = true;
+        ClosureFunctions.push_back(function);
+        for (uintptr_t spill = range->start & PageMask; spill < range->end; spill += pageSize)
+        {
+          unsigned int spillIndex = 0;
+          if ((true == FindPage(spill, spillIndex)) && (UINT_MAX == PageClosures[spillIndex]))
+          {
+            PageClosures[spillIndex] = closureIndex;
+            pending.push_back(spillIndex);
+          }
+        }
+      }
+    }
+
+    closure.numPages = static_cast<unsigned int>(ClosurePages.size()) - closure.firstPage;
+    closure.numFunctions = static_cast<unsigned int>(ClosureFunctions.size()) - closure.firstFunction;
+    Closures.push_back(closure);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Open
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFaultHandler::Open(const VMFaultClosure& closure)
+{
+  // The pages stay non-executable until every function on them is plain
+  // code, so no thread can run ciphertext. One that tries faults and waits.
+  for (unsigned int i = 0; i < closure.numPages; ++i)
+  {
+    ProtectionManager::Instance().Expose(Pages[ClosurePages[closure.firstPage + i]]);
+  }
+
+  for (unsigned int i = 0; i < closure.numFunctions; ++i)
+  {
+    Decrypt(Ranges[ClosureFunctions[closure.firstFunction + i]].entry);
+  }
+
+  for (unsigned int i = 0; i < closure.numPages; ++i)
+  {
+    ProtectionManager::Instance().Unguard(Pages[ClosurePages[closure.firstPage + i]]);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Decrypt
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFaultHandler::Decrypt(const VMFunctionEntry* entry)
+{
+  // The state protocol of AcquireFunction, minus the cache and the arena. The
+  // hold taken here is never released: the page is executable from now on
+  // and must not be encrypted under a caller.
+  while (true)
+  {
+    int state = entry->state->load(std::memory_order_acquire);
+    if (state > VM_STATE_LOCKED)
+    {
+      if (true == entry->state->compare_exchange_weak(state, state + 1,
+                                                      std::memory_order_acquire))
+      {
+        return;
+      }
+    }
+    else if (VM_STATE_LOCKED == state)
+    {
+      if (true == entry->state->compare_exchange_weak(state, VM_STATE_BUSY,
+                                                      std::memory_order_acquire))
+      {
+        VMCipher::Apply(entry->address, entry->function->size, Key);
+        entry->code->store(entry->address, std::memory_order_release);
+        entry->state->store(1, std::memory_order_release);
+        return;
+      }
+    }
+    else
+    {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Claim
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFaultHandler::Claim(std::atomic<int>& state)
+{
+  int expected = VM_FAULT_LOCKED;
+  return state.compare_exchange_strong(expected, VM_FAULT_OPENING);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  WaitOpen
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFaultHandler::WaitOpen(const std::atomic<int>& state)
+{
+  while (VM_FAULT_OPEN != state.load(std::memory_order_acquire))
+  {
+    std::this_thread::yield();
+  }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+// Internal dependencies
+#include "ProtectionManager.h"
+#include "VMFunctionTable.h"
+
+// External dependencies
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A protected function as seen by the fault handler, sorted by start address.
+struct VMFaultRange
+{
+  uintptr_t start;
+  uintptr_t end;
+  const VMFunctionEntry* entry;
+};
+
+// A group of guarded pages tied together by functions spanning them, opened
+// as one by the first fault on any of them: the pages at [firstPage,
+// firstPage + numPages) and the functions at [firstFunction, firstFunction +
+// numFunctions) of the closure tables.
+struct VMFaultClosure
+{
+  unsigned int firstPage;
+  unsigned int numPages;
+  unsigned int firstFunction;
+  unsigned int numFunctions;
+};
+
+// Class Definition
+// Decrypt-on-first-execute. Enable leaves every page holding a protected
+// function inaccessible; the first access to such a page faults, the handler
+// makes it (and any page its functions spill onto) writable but not
+// executable, decrypts every protected function there in place, restores the
+// original protection and resumes. Nothing can run from a page until it holds
+// plain code. Later calls run at full speed, and each decrypted function keeps
+// one hold for good so a VLOCK elsewhere never encrypts it again.
+// Pages that also hold code which is not protected (the runtime itself) are
+// never guarded; functions touching them are unlocked by Enable up front
+// through the unlock callback. Everything the handler needs is worked out by
+// Enable, so a fault only makes protection calls, runs the cipher with the
+// given key and updates atomics: no locks, no allocations. Decrypting in place
+// does not combine with the arena: Enable refuses while it is enabled, and the
+// arena stays off once the handler is in. The handler is a vectored exception
+// handler on Windows and a SIGSEGV handler elsewhere.
+class VMFaultHandler
+{
+public:
+  static VMFaultHandler& Instance();
+
+  bool Enable(const VMFunctionTable& table,
+              bool (*unlock)(const void*),
+              const unsigned char* key);
+  bool HandleFault(const void* address);
+  bool Enabled() const;
+  unsigned int Faults() const;
+  double AverageLatency() const;
+
+private:
+  // Closure states
+  enum
+  {
+    VM_FAULT_LOCKED,
+    VM_FAULT_OPENING,
+    VM_FAULT_OPEN
+  };
+
+  VMFaultHandler();
+  bool InstallHandler();
+  bool IsPadding(uintptr_t start, uintptr_t end) const;
+  bool FindPage(uintptr_t page, unsigned int& index) const;
+  void BuildClosures(const std::vector<bool>& eager);
+  void Open(const VMFaultClosure& closure);
+  void Decrypt(const VMFunctionEntry* entry);
+  static bool Claim(std::atomic<int>& state);
+  static void WaitOpen(const std::atomic<int>& state);
+
+  std::vector<VMFaultRange> Ranges;
+  std::vector<GuardedPage> Pages;             // Every page guarded by Enable, sorted
+  std::vector<unsigned int> PageClosures;     // Closure of each page
+  std::vector<VMFaultClosure> Closures;
+  std::vector<unsigned int> ClosurePages;     // Indices into Pages
+  std::vector<unsigned int> ClosureFunctions; // Indices into Ranges
+  std::unique_ptr<std::atomic<int>[]> ClosureStates;
+  const unsigned char* Key;
+  uintptr_t PageMask;
+  std::atomic<bool> Installed;
+  std::mutex Lock; // Serializes Enable, never taken by the handler
+
+  std::atomic<unsigned int> NumFaults;
+  std::atomic<unsigned long long> FaultNanoseconds;
+};
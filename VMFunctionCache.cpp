@@ -0,0 +1,281 @@
+#include "VMFunctionCache.h"
+#include "VMUtils.h"
+#include <algorithm>
+#include <chrono>
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Instance
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMFunctionCache& VMFunctionCache::Instance()
+{
+  static VMFunctionCache cache;
+  return cache;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Start
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFunctionCache::Start(unsigned int byteBudget, unsigned int idleTimeout)
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  if (true == Running)
+  {
+    return;
+  }
+
+  ByteBudget = byteBudget;
+  IdleTimeout = idleTimeout;
+  Running = true;
+  Worker = std::thread(&VMFunctionCache::RelockThread, this);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Stop
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFunctionCache::Stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(Lock);
+    Running = false;
+  }
+
+  Wake.notify_all();
+  if (true == Worker.joinable())
+  {
+    Worker.join();
+  }
+
+  // Nothing stays decrypted on behalf of the cache once it is stopped.
+  Relock(true);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Enabled
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFunctionCache::Enabled() const
+{
+  return Running.load(std::memory_order_relaxed);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Retain
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMFunctionCache::Retain(const VMFunctionEntry* entry)
+{
+  // Called once per decryption, the caller adds the cache's reference when
+  // this returns true.
+  if (false == Enabled())
+  {
+    return false;
+  }
+
+  ++NumMisses;
+  entry->lastUse->store(Now(), std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> guard(Lock);
+  Cached.push_back(entry);
+  TotalBytes += entry->function->size;
+  if (TotalBytes > ByteBudget)
+  {
+    Wake.notify_one();
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Touch
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFunctionCache::Touch(const VMFunctionEntry* entry)
+{
+  if (true == Enabled())
+  {
+    ++NumHits;
+    entry->lastUse->store(Now(), std::memory_order_relaxed);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Relock
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFunctionCache::Relock(bool all)
+{
+  std::vector<const VMFunctionEntry*> victims;
+  {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Snapshot the idle times, callers keep touching entries meanwhile. An
+    // entry touched after now was sampled counts as just used rather than
+    // wrapping around to the longest idle.
+    unsigned int now = Now();
+    std::vector<std::pair<unsigned int, const VMFunctionEntry*>> byIdle;
+    for (const VMFunctionEntry* entry : Cached)
+    {
+      unsigned int lastUse = entry->lastUse->load(std::memory_order_relaxed);
+      byIdle.push_back(std::make_pair((lastUse > now ? 0 : now - lastUse), entry));
+    }
+
+    // Longest idle first, so budget pressure evicts the least recently used.
+    std::sort(byIdle.begin(), byIdle.end(),
+              [](const std::pair<unsigned int, const VMFunctionEntry*>& left,
+                 const std::pair<unsigned int, const VMFunctionEntry*>& right)
+              {
+                return left.first > right.first;
+              });
+
+    std::vector<const VMFunctionEntry*> keep;
+    for (const std::pair<unsigned int, const VMFunctionEntry*>& item : byIdle)
+    {
+      if ((true == all) || (item.first >= IdleTimeout) || (TotalBytes > ByteBudget))
+      {
+        victims.push_back(item.second);
+        TotalBytes -= item.second->function->size;
+      }
+      else
+      {
+        keep.push_back(item.second);
+      }
+    }
+
+    Cached.swap(keep);
+  }
+
+  // Dropping the cache's reference only re-encrypts when no caller is still
+  // running the function.
+  for (const VMFunctionEntry* entry : victims)
+  {
+    if (true == VMUtils::ReleaseFunction(entry->address))
+    {
+      ++NumRelocks;
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Hits
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMFunctionCache::Hits() const
+{
+  return NumHits.load();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Misses
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMFunctionCache::Misses() const
+{
+  return NumMisses.load();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Relocks
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMFunctionCache::Relocks() const
+{
+  return NumRelocks.load();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  CachedBytes
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMFunctionCache::CachedBytes()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return TotalBytes;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Now
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMFunctionCache::Now()
+{
+  // Millisecond tick, wraps harmlessly since only differences are used.
+  return static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::milliseconds>
+         (std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMFunctionCache::VMFunctionCache() :
+  Running(false),
+  ByteBudget(0),
+  IdleTimeout(0),
+  TotalBytes(0),
+  NumHits(0),
+  NumMisses(0),
+  NumRelocks(0)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Destructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMFunctionCache::~VMFunctionCache()
+{
+  // Only stop the thread, the process is going away.
+  {
+    std::lock_guard<std::mutex> guard(Lock);
+    Running = false;
+  }
+
+  Wake.notify_all();
+  if (true == Worker.joinable())
+  {
+    Worker.join();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RelockThread
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMFunctionCache::RelockThread()
+{
+  // Scan twice per idle period so nothing stays decrypted much longer than
+  // the timeout.
+  std::chrono::milliseconds period((IdleTimeout > 1 ? IdleTimeout / 2 : 1));
+
+  std::unique_lock<std::mutex> guard(Lock);
+  while (true == Running)
+  {
+    Wake.wait_for(guard, period);
+    if (false == Running)
+    {
+      break;
+    }
+
+    guard.unlock();
+    Relock();
+    guard.lock();
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+// Internal dependencies
+#include "VMFunctionTable.h"
+
+// External dependencies
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Class Definition
+// Keeps recently unlocked functions decrypted so hot callers skip the XOR
+// passes. The cache holds one reference on every function it keeps; a
+// background pass drops it once the function has been idle for IdleTimeout
+// milliseconds, or least recently used first while over ByteBudget.
+// Disabled until Start is called.
+class VMFunctionCache
+{
+public:
+  static VMFunctionCache& Instance();
+
+  void Start(unsigned int byteBudget, unsigned int idleTimeout);
+  void Stop();
+  bool Enabled() const;
+  bool Retain(const VMFunctionEntry* entry);
+  void Touch(const VMFunctionEntry* entry);
+  void Relock(bool all = false);
+
+  unsigned int Hits() const;
+  unsigned int Misses() const;
+  unsigned int Relocks() const;
+  unsigned int CachedBytes();
+
+  static unsigned int Now();
+
+private:
+  VMFunctionCache();
+  ~VMFunctionCache();
+  void RelockThread();
+
+  std::atomic<bool> Running;
+  unsigned int ByteBudget;
+  unsigned int IdleTimeout;
+  unsigned int TotalBytes;
+  std::vector<const VMFunctionEntry*> Cached;
+  std::mutex Lock;
+  std::condition_variable Wake;
+  std::thread Worker;
+
+  std::atomic<unsigned int> NumHits;
+  std::atomic<unsigned int> NumMisses;
+  std::atomic<unsigned int> NumRelocks;
+};
@@ -0,0 +1,143 @@
+#include "VMFunctionTable.h"
+
+/****************************************************************************************
+/
+/
+****************************************************************************************/
+VMFunctionTable::VMFunctionTable() :
+  Mask(0),
+  Shift(0),
+  NumFunctions(0)
+{
+}
+
+/****************************************************************************************
+/
+/
+****************************************************************************************/
+void VMFunctionTable::Build(const VMLayout* layout,
+                            void* (*translate)(unsigned int))
+{
+  Entries.clear();
+  NumFunctions = 0;
+  Mask = 0;
+  Shift = 0;
+
+  if (0 == layout)
+  {
+    return;
+  }
+
+  // Keep the load factor at or below one half so probes stay short.
+  unsigned int capacity = 2;
+  Shift = 31;
+  while (capacity < (layout->header.numFunctions * 2))
+  {
+    capacity <<= 1;
+    --Shift;
+  }
+
+  VMFunctionEntry empty = { 0, 0, 0, 0, 0 };
+  Entries.assign(capacity, empty);
+  Mask = capacity - 1;
+
+  // Every packed function starts out encrypted.
+  States.reset(new std::atomic<int>[layout->header.numFunctions]);
+  LastUse.reset(new std::atomic<unsigned int>[layout->header.numFunctions]);
+  Code.reset(new std::atomic<unsigned char*>[layout->header.numFunctions]);
+  for (unsigned int i = 0; i < layout->header.numFunctions; ++i)
+  {
+    States[i].store(VM_STATE_LOCKED);
+    LastUse[i].store(0);
+    Code[i].store(0);
+  }
+
+  for (unsigned int i = 0; i < layout->header.numFunctions; ++i)
+  {
+    unsigned char* address = reinterpret_cast<unsigned char*>
+                             (translate(layout->functions[i].offset));
+    if (0 == address)
+    {
+      continue;
+    }
+
+    // The first entry for an address wins, duplicates are ignored.
+    unsigned int slot = Slot(address);
+    while ((0 != Entries[slot].function) && (address != Entries[slot].address))
+    {
+      slot = (slot + 1) & Mask;
+    }
+
+    if (0 == Entries[slot].function)
+    {
+      Entries[slot].address = address;
+      Entries[slot].function = &layout->functions[i];
+      Entries[slot].state = &States[i];
+      Entries[slot].lastUse = &LastUse[i];
+      Entries[slot].code = &Code[i];
+      ++NumFunctions;
+    }
+  }
+}
+
+/****************************************************************************************
+/
+/
+****************************************************************************************/
+const VMFunctionEntry* VMFunctionTable::Find(const void* address) const
+{
+  if (true == Entries.empty())
+  {
+    return 0;
+  }
+
+  for (unsigned int slot = Slot(address); ; slot = (slot + 1) & Mask)
+  {
+    const VMFunctionEntry& entry = Entries[slot];
+    if (0 == entry.function)
+    {
+      return 0;
+    }
+
+    if (address == entry.address)
+    {
+      return &entry;
+    }
+  }
+}
+
+/****************************************************************************************
+/
+/
+****************************************************************************************/
+unsigned int VMFunctionTable::Count() const
+{
+  return NumFunctions;
+}
+
+/****************************************************************************************
+/
+/
+****************************************************************************************/
+void VMFunctionTable::Collect(std::vector<const VMFunctionEntry*>& entries) const
+{
+  for (const VMFunctionEntry& entry : Entries)
+  {
+    if (0 != entry.function)
+    {
+      entries.push_back(&entry);
+    }
+  }
+}
+
+/****************************************************************************************
+/
+/
+****************************************************************************************/
+unsigned int VMFunctionTable::Slot(const void* address) const
+{
+  // Fibonacci hashing takes the high bits of the product, code addresses are
+  // aligned so their low bits are poor.
+  unsigned int key = reinterpret_cast<unsigned int>(address);
+  return (key * 0x9E3779B1u) >> Shift;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+// Internal dependencies
+#include "VMDefines.h"
+
+// External dependencies
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Values of VMFunctionEntry::state besides the holder count.
+#define VM_STATE_LOCKED 0  // Encrypted, nobody is running it
+#define VM_STATE_BUSY   -1 // Being encrypted or decrypted
+
+// One slot of the function table, keyed by the runtime address of the function.
+// state is the number of holders while the function is decrypted, lastUse the
+// millisecond tick of the latest unlock (maintained by VMFunctionCache) and
+// code where the decrypted function runs from (its address, or an arena slot).
+struct VMFunctionEntry
+{
+  unsigned char* address;
+  const VMFunction* function;
+  std::atomic<int>* state;
+  std::atomic<unsigned int>* lastUse;
+  std::atomic<unsigned char*>* code;
+};
+
+// Class Definition
+// Open addressing (linear probing) table from function address to VMFunction.
+// Built once from the decoded layout, read-only afterwards.
+class VMFunctionTable
+{
+public:
+  VMFunctionTable();
+  void Build(const VMLayout* layout, void* (*translate)(unsigned int));
+  const VMFunctionEntry* Find(const void* address) const;
+  unsigned int Count() const;
+  void Collect(std::vector<const VMFunctionEntry*>& entries) const;
+
+private:
+  unsigned int Slot(const void* address) const;
+
+  std::vector<VMFunctionEntry> Entries;
+  std::unique_ptr<std::atomic<int>[]> States;
+  std::unique_ptr<std::atomic<unsigned int>[]> LastUse;
+  std::unique_ptr<std::atomic<unsigned char*>[]> Code;
+  unsigned int Mask;
+  unsigned int Shift;
+  unsigned int NumFunctions;
+};
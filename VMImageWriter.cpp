@@ -0,0 +1,316 @@
+#include "VMImageWriter.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+//
+// Static declarations
+//
+VMSyncMode VMImageWriter::SyncMode = VM_SYNC_NONE;
+std::mutex VMImageWriter::PendingLock;
+std::vector<VMFileHandle> VMImageWriter::Pending;
+bool VMImageWriter::PendingFailed = false;
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMImageWriter::VMImageWriter() :
+  TotalSize(0)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Add
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMImageWriter::Add(const void* data, unsigned int size)
+{
+  if (0 == size)
+  {
+    return;
+  }
+
+  // The ranges are referenced, not copied, so they must outlive Write.
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+  if ((false == Ranges.empty()) &&
+      (Ranges.back().data + Ranges.back().size == bytes))
+  {
+    Ranges.back().size += size;
+  }
+  else
+  {
+    VMWriteRange range = { bytes, size };
+    Ranges.push_back(range);
+  }
+
+  TotalSize += size;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Size
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMImageWriter::Size() const
+{
+  return TotalSize;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Write
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMImageWriter::Write(const std::string& path) const
+{
+  // A fresh file already has the right length once the ranges are out.
+#ifdef _WIN32
+  VMFileHandle handle = CreateFileA(path.c_str(),
+                                    GENERIC_WRITE,
+                                    FILE_SHARE_READ,
+                                    0,
+                                    CREATE_ALWAYS,
+                                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                                    0);
+  if (INVALID_HANDLE_VALUE == handle)
+  {
+    return false;
+  }
+#else
+  VMFileHandle handle = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (handle < 0)
+  {
+    return false;
+  }
+#endif
+
+  bool written = Emit(handle);
+  return ((true == Sync(handle, true)) && (true == written));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Write
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMImageWriter::Write(VMFileHandle handle) const
+{
+  // Overwrites an open file from the start. The caller owns the handle and
+  // trims the file afterwards if it was longer than the image.
+#ifdef _WIN32
+  SetFilePointer(handle, 0, 0, FILE_BEGIN);
+#else
+  lseek(handle, 0, SEEK_SET);
+#endif
+
+  bool written = Emit(handle);
+  return ((true == Sync(handle, false)) && (true == written));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SetSyncMode
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMImageWriter::SetSyncMode(VMSyncMode mode)
+{
+  SyncMode = mode;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  GetSyncMode
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMSyncMode VMImageWriter::GetSyncMode()
+{
+  return SyncMode;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  SyncPending
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMImageWriter::SyncPending()
+{
+  std::vector<VMFileHandle> pending;
+  bool failed = false;
+  {
+    std::lock_guard<std::mutex> guard(PendingLock);
+    pending.swap(Pending);
+    failed = PendingFailed;
+    PendingFailed = false;
+  }
+
+  return ((true == Flush(pending)) && (false == failed));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Emit
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMImageWriter::Emit(VMFileHandle handle) const
+{
+#ifdef _WIN32
+  // WriteFileGather wants page aligned, unbuffered I/O, which the ranges are
+  // not. Consecutive writes at the current position are the next best thing.
+  for (const VMWriteRange& range : Ranges)
+  {
+    unsigned long written = 0;
+    if ((FALSE == WriteFile(handle, range.data, range.size, &written, 0)) ||
+        (range.size != written))
+    {
+      return false;
+    }
+  }
+
+  return true;
+#else
+  std::vector<struct iovec> vectors(Ranges.size());
+  for (unsigned int i = 0; i < Ranges.size(); ++i)
+  {
+    vectors[i].iov_base = const_cast<unsigned char*>(Ranges[i].data);
+    vectors[i].iov_len = Ranges[i].size;
+  }
+
+  // writev may stop short, resume from wherever it left off.
+  unsigned int first = 0;
+  while (first < vectors.size())
+  {
+    unsigned int count = vectors.size() - first;
+    ssize_t written = writev(handle, &vectors[first], (count < IOV_MAX ? count : IOV_MAX));
+    if (written < 0)
+    {
+      return false;
+    }
+
+    while ((first < vectors.size()) &&
+           (static_cast<size_t>(written) >= vectors[first].iov_len))
+    {
+      written -= vectors[first].iov_len;
+      ++first;
+    }
+
+    if (0 < written)
+    {
+      vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + written;
+      vectors[first].iov_len -= written;
+    }
+  }
+
+  return true;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Sync
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMImageWriter::Sync(VMFileHandle handle, bool owned)
+{
+  // Owned handles are closed here or handed to the pending list. Borrowed
+  // ones are duplicated before being deferred since the caller closes them.
+  bool synced = true;
+  if (VM_SYNC_EACH == SyncMode)
+  {
+#ifdef _WIN32
+    synced = (FALSE != FlushFileBuffers(handle));
+#else
+    synced = (0 == fsync(handle));
+#endif
+  }
+  else if (VM_SYNC_BATCHED == SyncMode)
+  {
+    VMFileHandle deferred = handle;
+    if (false == owned)
+    {
+#ifdef _WIN32
+      if (FALSE == DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(), &deferred,
+                                   0, FALSE, DUPLICATE_SAME_ACCESS))
+      {
+        return false;
+      }
+#else
+      deferred = dup(handle);
+      if (deferred < 0)
+      {
+        return false;
+      }
+#endif
+    }
+
+    std::vector<VMFileHandle> group;
+    {
+      std::lock_guard<std::mutex> guard(PendingLock);
+      Pending.push_back(deferred);
+      if (MaxPending <= Pending.size())
+      {
+        group.swap(Pending);
+      }
+    }
+
+    // The group holds other writers' files too, so a failure is theirs as
+    // much as ours and is left for SyncPending to report.
+    if ((false == group.empty()) && (false == Flush(group)))
+    {
+      std::lock_guard<std::mutex> guard(PendingLock);
+      PendingFailed = true;
+    }
+
+    return true;
+  }
+
+  if (true == owned)
+  {
+    Close(handle);
+  }
+
+  return synced;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Flush
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMImageWriter::Flush(const std::vector<VMFileHandle>& handles)
+{
+  bool synced = true;
+  for (VMFileHandle handle : handles)
+  {
+#ifdef _WIN32
+    synced = (FALSE != FlushFileBuffers(handle)) && (true == synced);
+#else
+    synced = (0 == fsync(handle)) && (true == synced);
+#endif
+    Close(handle);
+  }
+
+  return synced;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Close
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMImageWriter::Close(VMFileHandle handle)
+{
+#ifdef _WIN32
+  CloseHandle(handle);
+#else
+  close(handle);
+#endif
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// External dependencies
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+typedef void* VMFileHandle;
+#else
+typedef int VMFileHandle;
+#endif
+
+struct VMWriteRange
+{
+  const unsigned char* data;
+  unsigned int size;
+};
+
+// Durability of written images. Batched defers the flush, so a batch of files
+// costs a round of flushes per group of MaxPending files instead of one stall
+// per file. The writer that fills a group flushes it, SyncPending flushes the
+// rest and reports any failure since the last call.
+enum VMSyncMode
+{
+  VM_SYNC_NONE,
+  VM_SYNC_EACH,
+  VM_SYNC_BATCHED
+};
+
+// Class Definition
+// Assembles an output image as an ordered list of byte ranges (headers,
+// section data, the appended section) without copying them, and emits them
+// in a single sequential pass from offset 0: one writev on POSIX, back to back
+// WriteFile calls on Windows. Ranges adjacent in memory are merged as they
+// are added.
+class VMImageWriter
+{
+public:
+  VMImageWriter();
+
+  void Add(const void* data, unsigned int size);
+  unsigned int Size() const;
+  bool Write(const std::string& path) const;
+  bool Write(VMFileHandle handle) const;
+
+  static void SetSyncMode(VMSyncMode mode);
+  static VMSyncMode GetSyncMode();
+  static bool SyncPending();
+
+private:
+  bool Emit(VMFileHandle handle) const;
+  static bool Sync(VMFileHandle handle, bool owned);
+  static bool Flush(const std::vector<VMFileHandle>& handles);
+  static void Close(VMFileHandle handle);
+
+  std::vector<VMWriteRange> Ranges;
+  unsigned int TotalSize;
+
+  static VMSyncMode SyncMode;
+  static std::mutex PendingLock;
+  static std::vector<VMFileHandle> Pending;
+  static bool PendingFailed;
+
+  // Bounds the handles held open at once, well under any descriptor limit.
+  static const unsigned int MaxPending = 64;
+};
@@ -1,4 +1,5 @@
 #include "VMLock.h"
+#include "VMPacker.h"
 #include "VMUtils.h"
 #include <QMessageBox>
 #include <QTreeWidget>
@@ -35,12 +36,9 @@ void VMLock::OnBuildClicked()
 {
   if (0 != PE)
   {
-    // Retrieve function count
+    // Retrieve function list
     QStringList strAddresses = ui.FunctionsEdit->toPlainText().split("\n");
 
-    // Create the new section
-    PE->InitializeNewSection(ui.SectionEdit->text().toStdString().c_str());
-
     // Retrieve local data
     unsigned int uid = strtoul(ui.UIDEdit->text().toStdString().c_str(), 0, 16);
 
@@ -51,16 +49,7 @@ void VMLock::OnBuildClicked()
       ruid[i / 2] = strtoul(ch.c_str(), 0, 16);
     }
 
-    // Before virtualizing anything, we need to set the uid information
-    VMUtils::SetUniqueIdentifier(uid, ruid);
-
-    // Virtualize all listed functions
-    std::vector<unsigned int> offsets(strAddresses.size(), 0);
-    std::vector<unsigned int> lengths(offsets.size(), 0);
-
-    // Base address should be the pointer to the file buffer.
-    unsigned int deleteCount = 0;
-    unsigned int bufAddress = reinterpret_cast<unsigned int>(PE->GetBaseAddress());
+    std::vector<unsigned int> offsets;
     for (unsigned int i = 0; i < strAddresses.size(); ++i)
     {
       if (0 == strAddresses[i].length())
@@ -68,34 +57,35 @@ void VMLock::OnBuildClicked()
         continue;
       }
 
-      offsets[i] = strtoul(strAddresses[i].toStdString().c_str(), 0, 16);
-      lengths[i] = VMUtils::VirtualizeFunction
-                   (reinterpret_cast<void*>(bufAddress + offsets[i]));
-
-      // Destroy the export entry
-      unsigned int offset = reinterpret_cast<unsigned int>
-                            (VMUtils::GetRVAFuncOffset(offsets[i]));
-      
-      if (true == PE->DestroyExportFunction(offset, deleteCount))
-      {
-        ++deleteCount;
-      }
+      offsets.push_back(strtoul(strAddresses[i].toStdString().c_str(), 0, 16));
     }
 
-    // Build a buffer containing our uid information and function data.
-    std::vector<unsigned char> buffer;
-    VMUtils::BuildVMBuffer(uid, ruid, offsets, lengths, buffer);
-
-    // Write buffer data to file.
-    PE->InsertIntoNewSection(buffer.data(), buffer.size(), 0);
-
-    // Encrypt the new section
-    VMUtils::XORvSection(PE->PtrToLastSectionBuf(0), buffer.size());
+    // The new section is sized by the function count, which is only known
+    // now. Attach again with room for it, nothing has been written yet.
+    delete PE;
+    PE = new PortableExecutable();
+    if (false == PE->Attach(PackedFile.c_str(), VMPacker::ReserveSize(offsets.size()), true))
+    {
+      QMessageBox::warning(this, "Error", "Failed loading file");
+      delete PE;
+      PE = 0;
+      return;
+    }
 
-    // Finalize section and close file.
-    PE->FinalizeNewSection(buffer.size());
+    // Virtualize all listed functions, write the new section and close file.
+    if (true == VMPacker::Build(PE,
+                                ui.SectionEdit->text().toStdString().c_str(),
+                                uid,
+                                ruid,
+                                offsets))
+    {
+      QMessageBox::information(this, "VMLock", "Done");
+    }
+    else
+    {
+      QMessageBox::warning(this, "Error", "Failed writing file");
+    }
 
-    QMessageBox::information(this, "VMLock", "Done");
     delete PE;
     PE = 0;
   }
@@ -116,14 +106,13 @@ void VMLock::ProcessFile(std::string path)
   }
 
   // Backup the file
-  std::string packedFile = path.substr(0, path.length() - 4); // Remove ".exe"
-  packedFile += "-VP.exe";
+  PackedFile = VMPacker::PackedFileName(path);
+  PortableExecutable::BackupFile(path, PackedFile);
 
-  PortableExecutable::BackupFile(path, packedFile);
-
-  // Open file
+  // Open file, only to list its contents. OnBuildClicked attaches again with
+  // room for the new section.
   PE = new PortableExecutable();
-  if (false == PE->Attach(packedFile.c_str(), 1024))
+  if (false == PE->Attach(PackedFile.c_str(), 0, true))
   {
     QMessageBox::warning(this, "Error", "Failed loading file");
     return;
@@ -183,32 +172,14 @@ void VMLock::ProcessFile(std::string path)
   item->setText(0, "Export Address Table");
   ui.PETree->addTopLevelItem(item);
 
-  for (unsigned int i = 0; i < PE->ExportDirectory->NumberOfFunctions; ++i)
+  for (unsigned int i = 0; i < PE->Exports.size(); ++i)
   {
-    unsigned int addressOfNames = PE->ExportDirectory->AddressOfNames;
-    PE->SetExportRVA(addressOfNames);
-
-    unsigned int funcNameAddress = reinterpret_cast<unsigned int*>
-      (reinterpret_cast<char*>(PE->GetBaseAddress()) + addressOfNames)[i];
-    PE->SetExportRVA(funcNameAddress);
-
-    unsigned int addressOfOrdinals = PE->ExportDirectory->AddressOfNameOrdinals;
-    PE->SetExportRVA(addressOfOrdinals);
-
-    unsigned int addressOfFunctions = PE->ExportDirectory->AddressOfFunctions;
-    PE->SetExportRVA(addressOfFunctions);
-
-    char* functionName = reinterpret_cast<char*>
-      (reinterpret_cast<char*>(PE->GetBaseAddress()) + funcNameAddress);
-    unsigned short functionOrd = reinterpret_cast<unsigned short*>
-      (reinterpret_cast<char*>(PE->GetBaseAddress()) + addressOfOrdinals)[i];
-    unsigned int functionAddr = reinterpret_cast<unsigned int*>
-      (reinterpret_cast<char*>(PE->GetBaseAddress()) + addressOfFunctions)[i];
-    unsigned int funcOffset = reinterpret_cast<unsigned int>
-      (VMUtils::GetFuncOffsetRVA(functionAddr));
+    const FunctionExport& entry = PE->Exports[i];
+    unsigned int funcOffset = 0;
+    PE->RVAToOffset(entry.address, funcOffset);
 
     subItem = new QTreeWidgetItem(item);
-    subItem->setText(0, functionName);
+    subItem->setText(0, entry.name.c_str());
     subItem = new QTreeWidgetItem(subItem);
     subItem->setText(0, QString::number(funcOffset, 16));
   }
@@ -23,4 +23,5 @@ private:
 
   Ui::VMLockClass ui;
   PortableExecutable* PE;
+  std::string PackedFile;
 };
@@ -1,18 +1,32 @@
 #include "CRC32.h"
 #include "VMUtils.h"
+#include "VMWatchdog.h"
+#include "X86Decoder.h"
 
 /////////////////////////////////////////////////////////////////////////////////////////
 //
 // VM Functions - Consider adding this to another file!
 //
-VMLayout* VLock = 0;
+const VMLayout* VLock = 0;
 const char* VSectionName = ".vml";
 
+// Periodic checks run by the watchdog, periods and jitter in milliseconds,
+// time budgets in microseconds of wall clock run time.
+static const unsigned int UIDCheckPeriod = 5000;
+static const unsigned int UIDCheckBudget = 1000;
+static const unsigned int CRCCheckPeriod = 10000;
+static const unsigned int CRCCheckBudget = 2000;
+static unsigned int UIDCheckTask = 0;
+static unsigned int CRCCheckTask = 0;
+
+void ValidateUIDCallback();
+void VMLCRC32Callback();
+
 #ifndef _DEBUG
 void InitializeVM()
 {
-  PortableExecutable pe;
-  if (true == pe.Attach())
+  const VMImage& image = VMUtils::GetImage();
+  if (0 != image.vmlSection)
   {
     VCPU_START();
     VMUtils::GenerateUniqueIdentifier();
@@ -20,40 +34,46 @@ void InitializeVM()
 
     // Verify our section exists.
     std::string section_name(strlen(VSectionName), 0);
-    VMUtils::GetSectionName(pe.LastSectionHeader, 
-                            &section_name[0], 
-                            section_name.size());
+    memcpy(&section_name[0], image.vmlName, section_name.size());
     if (0 != section_name.compare(VSectionName))
     {
       VTERMINATE();
     }
 
-    // Add check for last section here
-    VMUtils::XORvSection(pe.PointerToLastSection(0),
-                         pe.LastSectionHeader->SizeOfRawData);
+    // Decode the virtual layout once, the section stays encrypted in memory.
+    VLock = VMUtils::GetLayout();
 
     // Exit if this is an unauthorized use.
-    if (false == VMUtils::ValidateUniqueId(pe.PointerToLastSection(0)))
+    if (false == VMUtils::ValidateUniqueId(VLock))
     {
       VTERMINATE();
     }
 
-    // Allocate memory for VirtualLock and copy the section data over
-    VLock = reinterpret_cast<VMLayout*>(malloc(sizeof(VMHeader)));
-    memcpy(VLock, pe.PointerToLastSection(0), sizeof(VMHeader));
-
-    // We now have the virtual layout, reallocate memory and copy
-    unsigned int vmSize = sizeof(VMHeader) +
-      (VLock->header.numFunctions * sizeof(VMFunction));
-    free(VLock); // Free old mem
-
-    VLock = reinterpret_cast<VMLayout*>(malloc(vmSize));
-    memcpy(VLock, pe.PointerToLastSection(0), vmSize);
+    // Index the protected functions for VUNLOCK.
+    VMUtils::GetFunctionTable();
   }
 
   VCPU_START();
   VMUtils::InitializeQueues();
   VCPU_VALIDATE();
+
+  // The application may still call the callbacks itself, the watchdog makes
+  // sure they run even if it does not.
+  UIDCheckTask = VMWatchdog::Instance().Schedule(&ValidateUIDCallback,
+                                                 UIDCheckPeriod,
+                                                 UIDCheckPeriod / 4,
+                                                 UIDCheckBudget);
+  CRCCheckTask = VMWatchdog::Instance().Schedule(&VMLCRC32Callback,
+                                                 CRCCheckPeriod,
+                                                 CRCCheckPeriod / 4,
+                                                 CRCCheckBudget);
+}
+
+VML_EXPORT void VMLCheckFrequency(unsigned int uidPeriod, unsigned int crcPeriod)
+{
+  // A period of 0 leaves the check to the application.
+  VMWatchdog::Instance().Configure(UIDCheckTask, uidPeriod, uidPeriod / 4, UIDCheckBudget);
+  VMWatchdog::Instance().Configure(CRCCheckTask, crcPeriod, crcPeriod / 4, CRCCheckBudget);
 }
 
 VML_EXPORT void ValidateUID()
@@ -76,11 +96,24 @@ void ValidateUIDCallback()
 
 VML_EXPORT void VMLCRC32()
 {
-  unsigned int vCallbackCRC = 0;
   VCPU_START();
-  CRC32::CalculateCRC32(reinterpret_cast<unsigned char*>(&ValidateUIDCallback), 
-                        8, // Limit CRC check 
-                        vCallbackCRC);
+  if (0 == VLock)
+  {
+    VTERMINATE();
+  }
+
+  // Cover the whole callback rather than its first few bytes.
+  unsigned char* callback = reinterpret_cast<unsigned char*>(&ValidateUIDCallback);
+  static const unsigned int callbackSize = X86Decoder::FunctionExtent
+    (callback,
+     VMUtils::GetImage().pe.RVAExtent(reinterpret_cast<unsigned int>(callback) -
+                                      reinterpret_cast<unsigned int>(VMUtils::GetImage().base)));
+
+  CRC32 crc;
+  crc.Update(callback, callbackSize);
+  crc.Update(VLock,
+             sizeof(VMHeader) + (VLock->header.numFunctions * sizeof(VMFunction)));
+  unsigned int vCallbackCRC = crc.Final();
   if (0 == VMLCRC_VAL)
   {
     VMLCRC_VAL = vCallbackCRC;
@@ -108,11 +141,26 @@ void VMLHBCallback()
   VMUtils::HeartBeatSlave();
 }
 
+void VMLHBEpochCallback()
+{
+  VMUtils::HeartBeatEpoch();
+}
+
+VML_EXPORT bool VMLRemoteWatchdog(const char* helperPath)
+{
+  // helperPath is the CLI build of VMLock, started as --watchdog <channel> <pipe>.
+  return VMUtils::InitializeRemoteHeart(helperPath);
+}
+
 #else
 void InitializeVM()
 {
 }
 
+void VMLCheckFrequency(unsigned int uidPeriod, unsigned int crcPeriod)
+{
+}
+
 void ValidateUIDCallback()
 {
 }
@@ -125,4 +173,13 @@ void VMLHBCallback()
 {
 
 }
+
+void VMLHBEpochCallback()
+{
+}
+
+bool VMLRemoteWatchdog(const char* helperPath)
+{
+  return true;
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,354 @@
+#include "VMPacker.h"
+#include "VMImageWriter.h"
+#include "VMParallel.h"
+#include "VMUtils.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <thread>
+
+//
+// Static declarations
+//
+const char* VMPacker::SectionName = ".vml";
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Build
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMPacker::Build(PortableExecutable* pe,
+                     const char* sectionName,
+                     unsigned int uid,
+                     unsigned char* ruid,
+                     const std::vector<unsigned int>& offsets)
+{
+  // Create the new section
+  pe->InitializeNewSection(sectionName);
+
+  // Virtualize all listed functions straight in the file image, bounded by
+  // the raw data of the section holding each one. The key is passed
+  // explicitly so that several jobs can be packed concurrently with
+  // different identifiers.
+  std::vector<unsigned int> limits(offsets.size(), 0);
+  std::vector<unsigned int> exportOffsets(offsets.size(), 0);
+  for (unsigned int i = 0; i < offsets.size(); ++i)
+  {
+    limits[i] = pe->OffsetExtent(offsets[i]);
+    pe->OffsetToRVA(offsets[i], exportOffsets[i]);
+  }
+
+  std::vector<unsigned int> lengths;
+  VMUtils::VirtualizeBuffer(reinterpret_cast<unsigned char*>(pe->GetBaseAddress()),
+                            pe->GetStubFileSize(),
+                            offsets,
+                            limits,
+                            uid,
+                            lengths);
+
+  // Destroy the export entries in one pass over the export index, then
+  // compact what is left so lookups by name stay sorted.
+  pe->DestroyExportFunctions(exportOffsets);
+  pe->RebuildExportDirectory();
+
+  // Build a buffer containing our uid information and function data.
+  std::vector<unsigned char> buffer;
+  VMUtils::BuildVMBuffer(uid, ruid, offsets, lengths, buffer);
+
+  // Write buffer data to file.
+  pe->InsertIntoNewSection(buffer.data(), buffer.size(), 0);
+
+  // Encrypt the new section
+  VMUtils::XORvSection(pe->PtrToLastSectionBuf(0), buffer.size(), uid);
+
+  // Finalize section and close file.
+  return pe->FinalizeNewSection(buffer.size());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PackedFileName
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+std::string VMPacker::PackedFileName(std::string path)
+{
+  std::string packedFile = path.substr(0, path.length() - 4); // Remove ".exe"
+  packedFile += "-VP.exe";
+
+  return packedFile;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ReserveSize
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMPacker::ReserveSize(unsigned int numFunctions)
+{
+  // Room Attach must reserve for Build: the section data plus worst case file
+  // alignment padding on either side of it (FileAlignment is at most 64K).
+  return sizeof(VMHeader) + (sizeof(VMFunction) * numFunctions) + (2 * 0x10000);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  PackFile
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMPacker::PackFile(const PackJob& job, PackResult& result)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  result.output = PackedFileName(job.path);
+  result.success = false;
+  result.fileSize = 0;
+  result.numFunctions = job.offsets.size();
+  result.seconds = 0;
+
+  // The original is only read, the packed image is written to its own file
+  // in one pass when the section is finalized.
+  PortableExecutable pe;
+  pe.SetOutputPath(result.output);
+  if (true == pe.Attach(job.path.c_str(), ReserveSize(job.offsets.size()), true))
+  {
+    result.fileSize = pe.GetStubFileSize();
+
+    unsigned char ruid[FILE_SYS_LEN] = { 0 };
+    memcpy(ruid, job.ruid, FILE_SYS_LEN);
+    result.success = Build(&pe, SectionName, job.uid, ruid, job.offsets);
+  }
+
+  result.seconds = std::chrono::duration<double>
+                   (std::chrono::steady_clock::now() - start).count();
+  return result.success;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ParseManifest
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMPacker::ParseManifest(const char* path, std::vector<PackJob>& jobs)
+{
+  std::ifstream manifest(path);
+  if (false == manifest.is_open())
+  {
+    return false;
+  }
+
+  std::string line;
+  unsigned int lineNumber = 0;
+  while (true == static_cast<bool>(std::getline(manifest, line)))
+  {
+    ++lineNumber;
+
+    // Skip blank lines and comments
+    size_t first = line.find_first_not_of(" \t\r");
+    if ((std::string::npos == first) || ('#' == line[first]))
+    {
+      continue;
+    }
+
+    PackJob job;
+    if (false == ParseJob(line.substr(first), job))
+    {
+      printf("%s(%u): malformed job\n", path, lineNumber);
+      return false;
+    }
+
+    jobs.push_back(job);
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ParseJob
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMPacker::ParseJob(const std::string& line, PackJob& job)
+{
+  std::string remainder = line;
+
+  // The executable path may be quoted.
+  if ('"' == remainder[0])
+  {
+    size_t end = remainder.find('"', 1);
+    if (std::string::npos == end)
+    {
+      return false;
+    }
+
+    job.path = remainder.substr(1, end - 1);
+    remainder = remainder.substr(end + 1);
+  }
+  else
+  {
+    size_t end = remainder.find_first_of(" \t");
+    if (std::string::npos == end)
+    {
+      return false;
+    }
+
+    job.path = remainder.substr(0, end);
+    remainder = remainder.substr(end);
+  }
+
+  std::istringstream tokens(remainder);
+  std::string uid;
+  std::string ruid;
+  if ((false == static_cast<bool>(tokens >> uid >> ruid)) ||
+      ((FILE_SYS_LEN * 2) != ruid.length()))
+  {
+    return false;
+  }
+
+  job.uid = strtoul(uid.c_str(), 0, 16);
+  for (unsigned int i = 0; i < ruid.length(); i += 2)
+  {
+    job.ruid[i / 2] = static_cast<unsigned char>
+                      (strtoul(ruid.substr(i, 2).c_str(), 0, 16));
+  }
+
+  std::string offset;
+  while (true == static_cast<bool>(tokens >> offset))
+  {
+    job.offsets.push_back(strtoul(offset.c_str(), 0, 16));
+  }
+
+  return (false == job.offsets.empty());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RunBatch
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMPacker::RunBatch(const std::vector<PackJob>& jobs,
+                        unsigned int numThreads,
+                        std::vector<PackResult>& results)
+{
+  results.resize(jobs.size());
+
+  // Jobs are whole files, so each one may get a thread of its own.
+  VMParallel::For(static_cast<unsigned int>(jobs.size()), numThreads, [&](unsigned int i)
+  {
+    PackFile(jobs[i], results[i]);
+  }, 1);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RunBatchCommand
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+int VMPacker::RunBatchCommand(int argc, char* argv[])
+{
+  const char* manifestPath = 0;
+  unsigned int numThreads = std::thread::hardware_concurrency();
+  for (int i = 1; i < argc; ++i)
+  {
+    if ((0 == strcmp(argv[i], "-j")) && (i + 1 < argc))
+    {
+      numThreads = strtoul(argv[++i], 0, 10);
+    }
+    else if ((0 == strcmp(argv[i], "-s")) && (i + 1 < argc))
+    {
+      // none: leave it to the OS, each: flush every file, batch: flush once
+      // every file is written.
+      ++i;
+      if (0 == strcmp(argv[i], "none"))
+      {
+        VMImageWriter::SetSyncMode(VM_SYNC_NONE);
+      }
+      else if (0 == strcmp(argv[i], "each"))
+      {
+        VMImageWriter::SetSyncMode(VM_SYNC_EACH);
+      }
+      else if (0 == strcmp(argv[i], "batch"))
+      {
+        VMImageWriter::SetSyncMode(VM_SYNC_BATCHED);
+      }
+      else
+      {
+        printf("Usage: %s <manifest> [-j threads] [-s none|each|batch]\n", argv[0]);
+        return 1;
+      }
+    }
+    else
+    {
+      manifestPath = argv[i];
+    }
+  }
+
+  if (0 == manifestPath)
+  {
+    printf("Usage: %s <manifest> [-j threads] [-s none|each|batch]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<PackJob> jobs;
+  if (false == ParseManifest(manifestPath, jobs))
+  {
+    printf("Failed loading manifest %s\n", manifestPath);
+    return 1;
+  }
+
+  if (0 == numThreads)
+  {
+    numThreads = 1;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<PackResult> results;
+  RunBatch(jobs, numThreads, results);
+  bool synced = VMImageWriter::SyncPending();
+  double elapsed = std::chrono::duration<double>
+                   (std::chrono::steady_clock::now() - start).count();
+
+  // Per file throughput
+  unsigned int failures = 0;
+  double totalBytes = 0;
+  unsigned int totalFunctions = 0;
+  for (const PackResult& result : results)
+  {
+    double megabytes = result.fileSize / (1024.0 * 1024.0);
+    if (false == result.success)
+    {
+      ++failures;
+      printf("[FAIL] %s\n", result.output.c_str());
+      continue;
+    }
+
+    totalBytes += result.fileSize;
+    totalFunctions += result.numFunctions;
+    printf("[ OK ] %s  %.2f MB  %u functions  %.1f ms  %.1f MB/s\n",
+           result.output.c_str(),
+           megabytes,
+           result.numFunctions,
+           result.seconds * 1000.0,
+           (0 < result.seconds ? megabytes / result.seconds : 0));
+  }
+
+  // Aggregate throughput
+  double totalMegabytes = totalBytes / (1024.0 * 1024.0);
+  printf("\n%u files (%u failed), %u functions, %.2f MB in %.3f s on %u threads\n",
+         static_cast<unsigned int>(results.size()),
+         failures,
+         totalFunctions,
+         totalMegabytes,
+         elapsed,
+         numThreads);
+  printf("%.1f MB/s, %.1f files/s\n",
+         (0 < elapsed ? totalMegabytes / elapsed : 0),
+         (0 < elapsed ? results.size() / elapsed : 0));
+
+  if (false == synced)
+  {
+    printf("Flushing the written files failed\n");
+  }
+
+  return (((0 == failures) && (true == synced)) ? 0 : 2);
+}
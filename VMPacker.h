@@ -0,0 +1,56 @@
+#pragma once
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// VMPacker holds the packing logic shared by the VMLock window and the headless
+// batch packer (CLI_APP build). It has no Qt dependencies.
+//
+// Manifest format (one job per line, '#' starts a comment):
+//   <executable> <uid> <ruid> <offset> [offset ...]
+// uid is 8 hex digits, ruid is 16 hex digits and offsets are hex file offsets.
+// Paths containing spaces must be quoted.
+//
+/////////////////////////////////////////////////////////////////////////////////////////
+#include <string>
+#include <vector>
+#include "PortableExecutable.h"
+#include "VMDefines.h"
+
+struct PackJob
+{
+  std::string path;
+  unsigned int uid;
+  unsigned char ruid[FILE_SYS_LEN];
+  std::vector<unsigned int> offsets;
+};
+
+struct PackResult
+{
+  std::string output;
+  bool success;
+  unsigned int fileSize;
+  unsigned int numFunctions;
+  double seconds;
+};
+
+class VMPacker
+{
+public:
+  static bool Build(PortableExecutable* pe,
+                    const char* sectionName,
+                    unsigned int uid,
+                    unsigned char* ruid,
+                    const std::vector<unsigned int>& offsets);
+  static std::string PackedFileName(std::string path);
+  static unsigned int ReserveSize(unsigned int numFunctions);
+  static bool PackFile(const PackJob& job, PackResult& result);
+  static bool ParseManifest(const char* path, std::vector<PackJob>& jobs);
+  static void RunBatch(const std::vector<PackJob>& jobs,
+                       unsigned int numThreads,
+                       std::vector<PackResult>& results);
+  static int RunBatchCommand(int argc, char* argv[]);
+
+  static const char* SectionName;
+
+private:
+  static bool ParseJob(const std::string& line, PackJob& job);
+};
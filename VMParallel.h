@@ -0,0 +1,92 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Class Definition
+// Runs a body over the indices [0, count) on short lived threads that claim
+// indices from a shared counter, so uneven items balance themselves. The
+// calling thread takes part. A thread count of 0 means one per core, and
+// small batches get fewer threads since starting one costs more than a few
+// dozen cheap items. Callers with expensive items pass a smaller
+// itemsPerThread, down to 1 for one thread per item. Never more threads than
+// items.
+class VMParallel
+{
+public:
+  static const unsigned int ItemsPerThread = 64;
+
+  template <typename F>
+  static void For(unsigned int count,
+                  unsigned int numThreads,
+                  F body,
+                  unsigned int itemsPerThread = ItemsPerThread);
+  static unsigned int ThreadCount(unsigned int count,
+                                  unsigned int numThreads,
+                                  unsigned int itemsPerThread = ItemsPerThread);
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  For
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+template <typename F>
+void VMParallel::For(unsigned int count,
+                     unsigned int numThreads,
+                     F body,
+                     unsigned int itemsPerThread)
+{
+  numThreads = ThreadCount(count, numThreads, itemsPerThread);
+
+  std::atomic<unsigned int> next(0);
+  auto worker = [&]()
+  {
+    for (unsigned int i = next++; i < count; i = next++)
+    {
+      body(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int i = 1; i < numThreads; ++i)
+  {
+    threads.push_back(std::thread(worker));
+  }
+
+  worker();
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ThreadCount
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+inline unsigned int VMParallel::ThreadCount(unsigned int count,
+                                           unsigned int numThreads,
+                                           unsigned int itemsPerThread)
+{
+  if (0 == numThreads)
+  {
+    numThreads = std::thread::hardware_concurrency();
+  }
+
+  unsigned int maxThreads = (count / itemsPerThread) + 1;
+  if ((maxThreads > count) && (0 != count))
+  {
+    maxThreads = count;
+  }
+
+  if ((0 == numThreads) || (numThreads > maxThreads))
+  {
+    numThreads = (0 == numThreads ? 1 : maxThreads);
+  }
+
+  return numThreads;
+}
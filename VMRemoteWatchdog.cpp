@@ -0,0 +1,381 @@
+#include "VMRemoteWatchdog.h"
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Launch
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMSharedChannel* VMRemoteWatchdog::Launch(const char* helperPath,
+                                          unsigned int timeout,
+                                          unsigned int& secret)
+{
+  VMRemoteSession session;
+  do
+  {
+    session.secret = Random();
+  } while (0 == session.secret);
+#ifdef _WIN32
+  session.owner = GetCurrentProcessId();
+#else
+  session.owner = static_cast<unsigned int>(getpid());
+#endif
+  session.timeout = timeout;
+
+  // Nothing in the name ties it to this process or its unique id.
+  char name[64];
+  sprintf(name, "VMLock_%08X%08X%08X%08X", Random(), Random(), Random(), Random());
+
+  VMSharedChannel* channel = VMSharedChannel::Create(name);
+  if (0 == channel)
+  {
+    return 0;
+  }
+
+  if (false == Spawn(helperPath, name, session))
+  {
+    channel->Unlink();
+    delete channel;
+    return 0;
+  }
+
+  secret = session.secret;
+  return channel;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  RunHelper
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+int VMRemoteWatchdog::RunHelper(const char* name, const char* pipe)
+{
+  // The session is read once, nothing the loop acts on comes from the mapping.
+  VMRemoteSession session;
+  if (false == ReadSession(pipe, session))
+  {
+    return 1;
+  }
+
+  VMSharedChannel* channel = VMSharedChannel::Open(name);
+  if (0 == channel)
+  {
+    return 1;
+  }
+
+  unsigned int heartBeat = 0;
+  while (true)
+  {
+    // Same protocol as the in-process master: the owner sends
+    // heartBeat ^ secret and waits for the next count.
+    unsigned int beat = 0;
+    if (false == channel->Receive(beat, session.timeout))
+    {
+      if (true == OwnerAlive(session.owner))
+      {
+        KillOwner(session.owner);
+      }
+
+      break;
+    }
+
+    if ((heartBeat != (beat ^ session.secret)) || (true == OwnerDebugged(session.owner)))
+    {
+      KillOwner(session.owner);
+      break;
+    }
+
+    ++heartBeat;
+    channel->Send(heartBeat);
+  }
+
+  delete channel;
+  return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Spawn
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMRemoteWatchdog::Spawn(const char* helperPath,
+                             const std::string& name,
+                             const VMRemoteSession& session)
+{
+  // The session is written before the helper starts, the pipe buffers it and
+  // the write can never hit a reader that already went away.
+#ifdef _WIN32
+  SECURITY_ATTRIBUTES security = { sizeof(security), 0, TRUE };
+  HANDLE reader = 0;
+  HANDLE writer = 0;
+  if (0 == CreatePipe(&reader, &writer, &security, sizeof(session)))
+  {
+    return false;
+  }
+
+  DWORD written = 0;
+  bool spawned = ((0 != WriteFile(writer, &session, sizeof(session), &written, 0)) &&
+                  (sizeof(session) == written));
+  CloseHandle(writer);
+
+  // The read end is the only handle the helper inherits.
+  SIZE_T size = 0;
+  InitializeProcThreadAttributeList(0, 1, 0, &size);
+  std::vector<char> attributes(size);
+
+  STARTUPINFOEXA startup;
+  memset(&startup, 0, sizeof(startup));
+  startup.StartupInfo.cb = sizeof(startup);
+  startup.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(&attributes[0]);
+  bool listed = ((true == spawned) &&
+                 (0 != InitializeProcThreadAttributeList(startup.lpAttributeList, 1, 0, &size)));
+  spawned = ((true == listed) &&
+             (0 != UpdateProcThreadAttribute(startup.lpAttributeList, 0,
+                                             PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+                                             &reader, sizeof(reader), 0, 0)));
+
+  char pipe[16];
+  sprintf(pipe, "%lu", static_cast<unsigned long>(reinterpret_cast<uintptr_t>(reader)));
+  std::string command = std::string("\"") + helperPath + "\" --watchdog " + name + " " + pipe;
+
+  PROCESS_INFORMATION process;
+  spawned = ((true == spawned) &&
+             (0 != CreateProcessA(0, &command[0], 0, 0, TRUE,
+                                  CREATE_NO_WINDOW | EXTENDED_STARTUPINFO_PRESENT,
+                                  0, 0, &startup.StartupInfo, &process)));
+  if (true == listed)
+  {
+    DeleteProcThreadAttributeList(startup.lpAttributeList);
+  }
+
+  CloseHandle(reader);
+  if (false == spawned)
+  {
+    return false;
+  }
+
+  CloseHandle(process.hThread);
+  CloseHandle(process.hProcess);
+  return true;
+#else
+  // A second, close-on-exec pipe reports whether exec went through: it sees
+  // an errno if it failed and end of file once the helper is running.
+  int fds[2];
+  int status[2];
+  if (0 != ::pipe(fds))
+  {
+    return false;
+  }
+
+  if (0 != pipe2(status, O_CLOEXEC))
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  pid_t child = -1;
+  if (static_cast<ssize_t>(sizeof(session)) == write(fds[1], &session, sizeof(session)))
+  {
+    char pipe[16];
+    sprintf(pipe, "%d", fds[0]);
+
+    child = fork();
+    if (0 == child)
+    {
+      close(fds[1]);
+      close(status[0]);
+      execl(helperPath, helperPath, "--watchdog", name.c_str(), pipe, static_cast<char*>(0));
+
+      int error = errno;
+      write(status[1], &error, sizeof(error));
+      _exit(127);
+    }
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  close(status[1]);
+
+  int error = 0;
+  ssize_t count = -1;
+  while (0 < child)
+  {
+    count = read(status[0], &error, sizeof(error));
+    if ((count >= 0) || (EINTR != errno))
+    {
+      break;
+    }
+  }
+
+  close(status[0]);
+  if ((0 < child) && (0 != count))
+  {
+    // Reap the child that never became the helper.
+    waitpid(child, 0, 0);
+    return false;
+  }
+
+  return (0 < child);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ReadSession
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMRemoteWatchdog::ReadSession(const char* pipe, VMRemoteSession& session)
+{
+  unsigned char* bytes = reinterpret_cast<unsigned char*>(&session);
+  unsigned int total = 0;
+#ifdef _WIN32
+  HANDLE reader = reinterpret_cast<HANDLE>(static_cast<uintptr_t>(strtoul(pipe, 0, 10)));
+  while (total < sizeof(session))
+  {
+    DWORD count = 0;
+    if ((0 == ReadFile(reader, bytes + total, sizeof(session) - total, &count, 0)) || (0 == count))
+    {
+      break;
+    }
+
+    total += count;
+  }
+
+  CloseHandle(reader);
+#else
+  int reader = atoi(pipe);
+  while (total < sizeof(session))
+  {
+    ssize_t count = read(reader, bytes + total, sizeof(session) - total);
+    if ((count < 0) && (EINTR == errno))
+    {
+      continue;
+    }
+
+    if (count <= 0)
+    {
+      break;
+    }
+
+    total += static_cast<unsigned int>(count);
+  }
+
+  close(reader);
+#endif
+
+  return (sizeof(session) == total);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Random
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMRemoteWatchdog::Random()
+{
+  // Drawn from the OS generator (rand_s on Windows, /dev/urandom or the CPU
+  // on Linux), not from the seeded engines.
+  std::random_device device;
+  return device();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  OwnerAlive
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMRemoteWatchdog::OwnerAlive(unsigned int owner)
+{
+#ifdef _WIN32
+  HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, owner);
+  if (0 == process)
+  {
+    return false;
+  }
+
+  bool alive = (WAIT_TIMEOUT == WaitForSingleObject(process, 0));
+  CloseHandle(process);
+  return alive;
+#else
+  // The helper is the owner's child, it is re-parented once the owner exits.
+  return (static_cast<pid_t>(owner) == getppid());
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  OwnerDebugged
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMRemoteWatchdog::OwnerDebugged(unsigned int owner)
+{
+#ifdef _WIN32
+  HANDLE process = OpenProcess(PROCESS_QUERY_INFORMATION, FALSE, owner);
+  if (0 == process)
+  {
+    return false;
+  }
+
+  BOOL debugged = FALSE;
+  CheckRemoteDebuggerPresent(process, &debugged);
+  CloseHandle(process);
+  return (FALSE != debugged);
+#else
+  char path[64];
+  sprintf(path, "/proc/%u/status", owner);
+
+  FILE* status = fopen(path, "r");
+  if (0 == status)
+  {
+    return false;
+  }
+
+  unsigned int tracer = 0;
+  char line[256];
+  while (0 != fgets(line, sizeof(line), status))
+  {
+    if (1 == sscanf(line, "TracerPid: %u", &tracer))
+    {
+      break;
+    }
+  }
+
+  fclose(status);
+  return (0 != tracer);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  KillOwner
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMRemoteWatchdog::KillOwner(unsigned int owner)
+{
+#ifdef _WIN32
+  HANDLE process = OpenProcess(PROCESS_TERMINATE, FALSE, owner);
+  if (0 != process)
+  {
+    TerminateProcess(process, 0);
+    CloseHandle(process);
+  }
+#else
+  kill(static_cast<pid_t>(owner), SIGKILL);
+#endif
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Internal dependencies
+#include "VMSharedChannel.h"
+
+// External dependencies
+#include <string>
+
+// Handed to the helper through an inherited pipe, never through the command
+// line or the shared mapping.
+struct VMRemoteSession
+{
+  unsigned int secret;  // Beats are sent as count ^ secret
+  unsigned int owner;   // Protected process id
+  unsigned int timeout; // Milliseconds without a beat before the owner is killed
+};
+
+// Class Definition
+// Runs the heartbeat master in a separate helper process. Launch is called by
+// the protected process: it creates the shared channel under a random name,
+// starts the helper (the CLI build with --watchdog <channel> <pipe>) and
+// writes the session to the pipe. The secret is fresh per session and unrelated
+// to the unique id. RunHelper is the helper side: it answers beats, watches the
+// owner for a debugger, and kills the owner when a beat is wrong or overdue.
+// The helper exits with its owner.
+class VMRemoteWatchdog
+{
+public:
+  static VMSharedChannel* Launch(const char* helperPath, unsigned int timeout, unsigned int& secret);
+  static int RunHelper(const char* name, const char* pipe);
+
+private:
+  static bool Spawn(const char* helperPath, const std::string& name, const VMRemoteSession& session);
+  static bool ReadSession(const char* pipe, VMRemoteSession& session);
+  static unsigned int Random();
+  static bool OwnerAlive(unsigned int owner);
+  static bool OwnerDebugged(unsigned int owner);
+  static void KillOwner(unsigned int owner);
+};
@@ -0,0 +1,344 @@
+#include "VMSharedChannel.h"
+#include <chrono>
+#include <new>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Sddl.h>
+#else
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Create
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMSharedChannel* VMSharedChannel::Create(const std::string& name)
+{
+  VMSharedChannel* channel = new VMSharedChannel();
+  if (false == channel->Map(name, true))
+  {
+    delete channel;
+    return 0;
+  }
+
+  // Fresh mappings are zeroed, the rings only need constructing.
+  VMSharedHeart* shared = channel->Shared;
+  for (unsigned int i = 0; i < 2; ++i)
+  {
+    new (&shared->rings[i].head) std::atomic<unsigned int>(0);
+    new (&shared->rings[i].tail) std::atomic<unsigned int>(0);
+    new (&shared->rings[i].sleepers) std::atomic<unsigned int>(0);
+  }
+
+  std::atomic_thread_fence(std::memory_order_release);
+  shared->magic = Magic;
+
+  channel->Outbound = 0;
+  return channel;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Open
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMSharedChannel* VMSharedChannel::Open(const std::string& name)
+{
+  VMSharedChannel* channel = new VMSharedChannel();
+  if ((false == channel->Map(name, false)) || (Magic != channel->Shared->magic))
+  {
+    delete channel;
+    return 0;
+  }
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  channel->Outbound = 1;
+  return channel;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Destructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMSharedChannel::~VMSharedChannel()
+{
+#ifdef _WIN32
+  if (0 != Shared)
+  {
+    UnmapViewOfFile(Shared);
+  }
+
+  for (unsigned int i = 0; i < 2; ++i)
+  {
+    if (0 != Events[i])
+    {
+      CloseHandle(Events[i]);
+    }
+  }
+
+  if (0 != Mapping)
+  {
+    CloseHandle(Mapping);
+  }
+#else
+  if (0 != Shared)
+  {
+    munmap(Shared, sizeof(VMSharedHeart));
+  }
+
+  if (0 <= Descriptor)
+  {
+    close(Descriptor);
+  }
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Send
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMSharedChannel::Send(unsigned int beat)
+{
+  VMSharedRing& ring = Shared->rings[Outbound];
+  unsigned int tail = ring.tail.load(std::memory_order_relaxed);
+  if (VM_SHARED_RING_SIZE == tail - ring.head.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+
+  ring.slots[tail % VM_SHARED_RING_SIZE] = beat;
+  ring.tail.store(tail + 1);
+
+  if (0 != ring.sleepers.load())
+  {
+    Wake(ring);
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Receive
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMSharedChannel::Receive(unsigned int& beat, int timeout)
+{
+  // timeout is in milliseconds, negative waits forever.
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout < 0 ? 0 : timeout);
+
+  VMSharedRing& ring = Shared->rings[1 - Outbound];
+  while (false == TryReceive(beat))
+  {
+    unsigned int remaining = ~0u;
+    if (0 <= timeout)
+    {
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (now >= deadline)
+      {
+        return false;
+      }
+
+      remaining = static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::milliseconds>
+                                            (deadline - now).count()) + 1;
+    }
+
+    // The sender reads sleepers after publishing its tail, so either it sees
+    // us or we see its beat here.
+    ++ring.sleepers;
+    unsigned int tail = ring.tail.load();
+    if (tail == ring.head.load(std::memory_order_relaxed))
+    {
+      Wait(ring, tail, remaining);
+    }
+    --ring.sleepers;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Unlink
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMSharedChannel::Unlink()
+{
+  // Named kernel objects go with their last handle on Windows, a shm name
+  // outlives every process unless someone removes it.
+#ifndef _WIN32
+  if (false == Name.empty())
+  {
+    shm_unlink(Name.c_str());
+    Name.clear();
+  }
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMSharedChannel::VMSharedChannel() :
+  Shared(0),
+  Outbound(0)
+{
+#ifdef _WIN32
+  Mapping = 0;
+  Events[0] = 0;
+  Events[1] = 0;
+#else
+  Descriptor = -1;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Map
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMSharedChannel::Map(const std::string& name, bool create)
+{
+#ifdef _WIN32
+  // Full access for the object's owner, nobody else.
+  SECURITY_ATTRIBUTES security;
+  security.nLength = sizeof(security);
+  security.bInheritHandle = FALSE;
+  security.lpSecurityDescriptor = 0;
+  if ((true == create) &&
+      (0 == ConvertStringSecurityDescriptorToSecurityDescriptorA("D:P(A;;GA;;;OW)", SDDL_REVISION_1,
+                                                                 &security.lpSecurityDescriptor, 0)))
+  {
+    return false;
+  }
+
+  std::string mappingName = "Local\\" + name;
+  Mapping = (true == create ?
+             CreateFileMappingA(INVALID_HANDLE_VALUE, &security, PAGE_READWRITE | SEC_COMMIT,
+                                0, sizeof(VMSharedHeart), mappingName.c_str()) :
+             OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, mappingName.c_str()));
+
+  // Like O_EXCL, a create must not pick up an existing mapping of that name.
+  if ((0 != Mapping) && ((false == create) || (ERROR_ALREADY_EXISTS != GetLastError())))
+  {
+    Shared = reinterpret_cast<VMSharedHeart*>
+             (MapViewOfFile(Mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(VMSharedHeart)));
+  }
+
+  // One auto-reset event per ring, signalled when its consumer is asleep.
+  for (unsigned int i = 0; (0 != Shared) && (i < 2); ++i)
+  {
+    std::string eventName = mappingName + "_" + static_cast<char>('0' + i);
+    Events[i] = (true == create ?
+                 CreateEventA(&security, FALSE, FALSE, eventName.c_str()) :
+                 OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, eventName.c_str()));
+    if (0 == Events[i])
+    {
+      break;
+    }
+  }
+
+  LocalFree(security.lpSecurityDescriptor);
+  return ((0 != Shared) && (0 != Events[0]) && (0 != Events[1]));
+#else
+  // Owner read/write only. shm_open applies the umask, which can only narrow it.
+  Name = "/" + name;
+  Descriptor = shm_open(Name.c_str(), (true == create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR), 0600);
+  if (Descriptor < 0)
+  {
+    Name.clear();
+    return false;
+  }
+
+  if ((true == create) && (0 != ftruncate(Descriptor, sizeof(VMSharedHeart))))
+  {
+    Unlink();
+    return false;
+  }
+
+  void* view = mmap(0, sizeof(VMSharedHeart), PROT_READ | PROT_WRITE, MAP_SHARED, Descriptor, 0);
+  if (MAP_FAILED == view)
+  {
+    if (true == create)
+    {
+      Unlink();
+    }
+
+    return false;
+  }
+
+  // Both sides hold the mapping once the helper is in, nothing needs the name.
+  if (false == create)
+  {
+    Unlink();
+  }
+
+  Shared = reinterpret_cast<VMSharedHeart*>(view);
+  return true;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  TryReceive
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMSharedChannel::TryReceive(unsigned int& beat)
+{
+  VMSharedRing& ring = Shared->rings[1 - Outbound];
+  unsigned int head = ring.head.load(std::memory_order_relaxed);
+  if (head == ring.tail.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+
+  beat = ring.slots[head % VM_SHARED_RING_SIZE];
+  ring.head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wait
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMSharedChannel::Wait(VMSharedRing& ring, unsigned int tail, unsigned int timeout)
+{
+  // Returns on a wake, a timeout or a spurious wakeup, the caller re-checks.
+#ifdef _WIN32
+  WaitForSingleObject(Events[&ring - Shared->rings], (~0u == timeout ? INFINITE : timeout));
+#else
+  struct timespec span = { static_cast<time_t>(timeout / 1000),
+                           static_cast<long>(timeout % 1000) * 1000000 };
+
+  // Sleeps only while tail still holds the value we saw empty.
+  syscall(SYS_futex, reinterpret_cast<unsigned int*>(&ring.tail), FUTEX_WAIT, tail,
+          (~0u == timeout ? 0 : &span), 0, 0);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wake
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMSharedChannel::Wake(VMSharedRing& ring)
+{
+#ifdef _WIN32
+  SetEvent(Events[&ring - Shared->rings]);
+#else
+  syscall(SYS_futex, reinterpret_cast<unsigned int*>(&ring.tail), FUTEX_WAKE, 1, 0, 0, 0);
+#endif
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <string>
+
+#ifndef VM_CACHE_LINE
+#define VM_CACHE_LINE 64
+#endif
+
+#define VM_SHARED_RING_SIZE 16
+
+// One direction of the channel. Lives in shared memory, so it holds nothing
+// but plain words and lock-free atomics.
+struct VMSharedRing
+{
+  std::atomic<unsigned int> head;
+  char headPad[VM_CACHE_LINE - sizeof(std::atomic<unsigned int>)];
+  std::atomic<unsigned int> tail;     // Futex word on Linux
+  std::atomic<unsigned int> sleepers; // Consumers blocked on tail
+  char tailPad[VM_CACHE_LINE - 2 * sizeof(std::atomic<unsigned int>)];
+  unsigned int slots[VM_SHARED_RING_SIZE];
+};
+
+// Layout of the shared mapping. It holds no secrets, the session parameters
+// are handed to the helper over a pipe.
+struct VMSharedHeart
+{
+  unsigned int magic;
+  char pad[VM_CACHE_LINE - sizeof(unsigned int)];
+  VMSharedRing rings[2]; // [0] owner to helper, [1] helper to owner
+};
+
+// Class Definition
+// Heartbeat channel between the protected process and its watchdog helper:
+// two single producer / single consumer rings of beats in a named shared
+// mapping (POSIX shm on Linux, a file mapping on Windows), accessible to the
+// owning user only. A blocked receiver sleeps on a futex (Linux) or a named
+// event (Windows), and senders only make the wake call when someone is
+// actually asleep.
+class VMSharedChannel
+{
+public:
+  static VMSharedChannel* Create(const std::string& name);
+  static VMSharedChannel* Open(const std::string& name);
+  ~VMSharedChannel();
+
+  bool Send(unsigned int beat);
+  bool Receive(unsigned int& beat, int timeout);
+  void Unlink();
+
+  static const unsigned int Magic = 0x4B4C4D56; // 'VMLK'
+
+private:
+  VMSharedChannel();
+  bool Map(const std::string& name, bool create);
+  bool TryReceive(unsigned int& beat);
+  void Wait(VMSharedRing& ring, unsigned int tail, unsigned int timeout);
+  void Wake(VMSharedRing& ring);
+
+  VMSharedHeart* Shared;
+  unsigned int Outbound; // Ring this side sends on
+#ifdef _WIN32
+  void* Mapping;
+  void* Events[2];
+#else
+  int Descriptor;
+  std::string Name; // Until unlinked
+#endif
+};
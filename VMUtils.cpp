@@ -1,15 +1,30 @@
 #include "VMUtils.h"
+#include "ProtectionManager.h"
+#include "VMArena.h"
+#include "VMFunctionCache.h"
+#include "VMParallel.h"
+#include "VMRemoteWatchdog.h"
+#include "VMWatchdog.h"
+#include "X86Decoder.h"
+#include <algorithm>
+#include <atomic>
 #include <windows.h>
 
 //
 // Static declarations
 //
-BQueue* VMUtils::HeartInQ = 0;
-BQueue* VMUtils::HeartOutQ = 0;
+HeartQueue* VMUtils::HeartInQ = 0;
+HeartQueue* VMUtils::HeartOutQ = 0;
 unsigned int VMUtils::UniqueId = 0;
 unsigned char VMUtils::FileSysName[8] = { 0 };
+unsigned char VMUtils::KeyStream[VM_KEY_LEN] = { 0 };
 unsigned int VMUtils::HeartBeat = 0;
-std::future<void> VMUtils::HeartInHandle;
+unsigned int VMUtils::HeartTask = 0;
+std::chrono::steady_clock::time_point VMUtils::LastBeat;
+VMEpoch VMUtils::HeartEpoch;
+VMSharedChannel* VMUtils::HeartChannel = 0;
+unsigned int VMUtils::HeartSecret = 0;
+unsigned int VMUtils::LastEpoch = 0;
 
 /////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -47,6 +62,9 @@ void VMUtils::GenerateUniqueIdentifier()
     FileSysName[i % FILE_SYS_LEN] ^= static_cast<unsigned char>
                                      (UniqueId >> (4 * (i % sizeof(unsigned int))));
   }
+
+  // Derive the keystream once for every later encrypt/decrypt.
+  VMCipher::BuildKeyStream(UniqueId, KeyStream);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -58,6 +76,7 @@ void VMUtils::SetUniqueIdentifier(unsigned int uid, unsigned char* ruid)
 {
   UniqueId = uid;
   memcpy(FileSysName, ruid, FILE_SYS_LEN);
+  VMCipher::BuildKeyStream(UniqueId, KeyStream);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -158,103 +177,183 @@ void VMUtils::BuildVMBuffer(unsigned int uid,
 /////////////////////////////////////////////////////////////////////////////////////////
 void VMUtils::XORvSection(void* section, unsigned int size)
 {
-  unsigned char* ptr = reinterpret_cast<unsigned char*>(section);
-  for (unsigned int i = 0; i < size; ++i)
+  VMCipher::Apply(section, size, KeyStream);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  XORvSection
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMUtils::XORvSection(void* section, unsigned int size, unsigned int uid)
+{
+  unsigned char key[VM_KEY_LEN];
+  VMCipher::BuildKeyStream(uid, key);
+  VMCipher::Apply(section, size, key);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  VirtualizeFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMUtils::VirtualizeFunction(void* func)
+{
+  // Never decode past the end of the section holding the function.
+  const VMImage& image = GetImage();
+  unsigned int maxLen = image.pe.RVAExtent(reinterpret_cast<unsigned int>(func) -
+                                           reinterpret_cast<unsigned int>(image.base));
+
+  return VirtualizeFunction(func, UniqueId, maxLen);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  VirtualizeFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMUtils::VirtualizeFunction(void* func, unsigned int uid, unsigned int maxLen)
+{
+  // Walk instruction boundaries to find the real end of the function, then
+  // only unprotect and encrypt what was decoded.
+  unsigned int size = X86Decoder::FunctionExtent(reinterpret_cast<unsigned char*>(func),
+                                                 maxLen);
+  if (0 == size)
+  {
+    return 0;
+  }
+
+  // Code pages are only writable while they are being transformed.
+  if (false == ProtectionManager::Instance().Acquire(func, size))
   {
-    unsigned char key = 0;
-    switch (i % 8)
+    return 0;
+  }
+
+  if (UniqueId == uid)
+  {
+    VMCipher::Apply(func, size, KeyStream);
+  }
+  else
+  {
+    XORvSection(func, size, uid);
+  }
+
+  ProtectionManager::Instance().Release(func, size);
+  return size;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  VirtualizeBuffer
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMUtils::VirtualizeBuffer(unsigned char* buffer,
+                                       unsigned int size,
+                                       const std::vector<unsigned int>& offsets,
+                                       const std::vector<unsigned int>& limits,
+                                       unsigned int uid,
+                                       std::vector<unsigned int>& lengths,
+                                       unsigned int numThreads)
+{
+  // Offline counterpart of VirtualizeFunction for a file image held in memory.
+  // The buffer is plain writable memory, so no page protection is touched.
+  std::vector<unsigned int> bounds(offsets.size(), 0);
+  for (unsigned int i = 0; i < offsets.size(); ++i)
+  {
+    if (offsets[i] < size)
     {
-    case 0:
-      key = UniqueId & 0x000000FF;
-      break;
-    case 1:
-      key = (UniqueId & 0x00000FF0) >> 4;
-      break;
-    case 2:
-      key = (UniqueId & 0x0000FF00) >> 8;
-      break;
-    case 3:
-      key = (UniqueId & 0x000FF000) >> 12;
-      break;
-    case 4:
-      key = (UniqueId & 0x00FF0000) >> 16;
-      break;
-    case 5:
-      key = (UniqueId & 0x0FF00000) >> 20;
-      break;
-    case 6:
-      key = (UniqueId & 0xFF000000) >> 24;
-      break;
-    case 7:
-      key = (UniqueId & 0xF0000000) >> 28;
-      break;
+      unsigned int available = size - offsets[i];
+      bounds[i] = (limits[i] < available ? limits[i] : available);
     }
+  }
+
+  // Every function has to be decoded before any of them is encrypted.
+  X86Decoder::FunctionExtents(buffer, offsets, bounds, lengths, numThreads);
+  RejectOverlaps(offsets, lengths);
 
-    ptr[i] ^= key;
+  unsigned char key[VM_KEY_LEN];
+  VMCipher::BuildKeyStream(uid, key);
+
+  VMParallel::For(static_cast<unsigned int>(offsets.size()), numThreads, [&](unsigned int i)
+  {
+    VMCipher::Apply(buffer + offsets[i], lengths[i], key);
+  });
+
+  unsigned int total = 0;
+  for (unsigned int length : lengths)
+  {
+    total += length;
   }
+
+  return total;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
 //
-// Function:  VirtualizeFunction
+// Function:  RejectOverlaps
 // 
 /////////////////////////////////////////////////////////////////////////////////////////
-unsigned int VMUtils::VirtualizeFunction(void* func)
+void VMUtils::RejectOverlaps(const std::vector<unsigned int>& offsets,
+                             std::vector<unsigned int>& lengths)
 {
-  bool exit = false;
-  unsigned int size = 0;
+  // Shared bytes would be XORed once per function, by two threads at once.
+  // A function listed twice keeps its first entry, the way the runtime table
+  // does. Functions whose extents overlap each other are all left in plain
+  // text, since no single one of them can be unlocked on its own.
+  std::vector<unsigned int> order(offsets.size());
+  for (unsigned int i = 0; i < order.size(); ++i)
+  {
+    order[i] = i;
+  }
 
-  unsigned long oldProtect;
-  VirtualProtect(func, 1024, PAGE_EXECUTE_READWRITE, &oldProtect);
+  std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b)
+  {
+    return offsets[a] < offsets[b];
+  });
 
-  unsigned char* ptr = reinterpret_cast<unsigned char*>(func);
-  while (false == exit)
+  for (unsigned int i = 1; i < order.size(); ++i)
   {
-    unsigned char byte = ptr[size];
-    if ((byte == 0xC3) || (byte == 0xCC)) // ret or int3
+    if (offsets[order[i]] == offsets[order[i - 1]])
     {
-      break;
+      lengths[order[i]] = 0;
     }
+  }
 
-    if ((0 != size) && (byte == 0xE9)) // Accomodate jump table.
+  std::vector<unsigned int> group;
+  unsigned int end = 0;
+  for (unsigned int i = 0; i <= order.size(); ++i)
+  {
+    if ((i < order.size()) && (0 == lengths[order[i]]))
     {
-      break;
+      continue;
     }
 
-    unsigned char key = 0;
-    switch (size % 8)
+    if ((i < order.size()) && (offsets[order[i]] < end))
     {
-    case 0:
-      key = UniqueId & 0x000000FF;
-      break;
-    case 1:
-      key = (UniqueId & 0x00000FF0) >> 4;
-      break;
-    case 2:
-      key = (UniqueId & 0x0000FF00) >> 8;
-      break;
-    case 3:
-      key = (UniqueId & 0x000FF000) >> 12;
-      break;
-    case 4:
-      key = (UniqueId & 0x00FF0000) >> 16;
-      break;
-    case 5:
-      key = (UniqueId & 0x0FF00000) >> 20;
-      break;
-    case 6:
-      key = (UniqueId & 0xFF000000) >> 24;
-      break;
-    case 7:
-      key = (UniqueId & 0xF0000000) >> 28;
-      break;
+      group.push_back(order[i]);
+    }
+    else
+    {
+      if (1 < group.size())
+      {
+        for (unsigned int index : group)
+        {
+          lengths[index] = 0;
+        }
+      }
+
+      group.clear();
+      if (i < order.size())
+      {
+        group.push_back(order[i]);
+      }
     }
 
-    ptr[size] ^= key;
-    ++size;
+    if ((i < order.size()) && (offsets[order[i]] + lengths[order[i]] > end))
+    {
+      end = offsets[order[i]] + lengths[order[i]];
+    }
   }
-
-  return size;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -264,44 +363,13 @@ unsigned int VMUtils::VirtualizeFunction(void* func)
 /////////////////////////////////////////////////////////////////////////////////////////
 void VMUtils::RemoveVirtualization(void* func, unsigned int size)
 {
-  unsigned char* ptr = reinterpret_cast<unsigned char*>(func);
-
-  unsigned long oldProtect;
-  VirtualProtect(func, size, PAGE_EXECUTE_READWRITE, &oldProtect);
-
-  for (unsigned int i = 0; i < size; ++i)
+  if (false == ProtectionManager::Instance().Acquire(func, size))
   {
-    unsigned char key = 0;
-    switch (i % 8)
-    {
-    case 0:
-      key = UniqueId & 0x000000FF;
-      break;
-    case 1:
-      key = (UniqueId & 0x00000FF0) >> 4;
-      break;
-    case 2:
-      key = (UniqueId & 0x0000FF00) >> 8;
-      break;
-    case 3:
-      key = (UniqueId & 0x000FF000) >> 12;
-      break;
-    case 4:
-      key = (UniqueId & 0x00FF0000) >> 16;
-      break;
-    case 5:
-      key = (UniqueId & 0x0FF00000) >> 20;
-      break;
-    case 6:
-      key = (UniqueId & 0xFF000000) >> 24;
-      break;
-    case 7:
-      key = (UniqueId & 0xF0000000) >> 28;
-      break;
-    }
-
-    ptr[i] ^= key;
+    return;
   }
+
+  VMCipher::Apply(func, size, KeyStream);
+  ProtectionManager::Instance().Release(func, size);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -311,17 +379,14 @@ void VMUtils::RemoveVirtualization(void* func, unsigned int size)
 /////////////////////////////////////////////////////////////////////////////////////////
 void* VMUtils::GetFuncRVAToImage(void* function)
 {
-  unsigned long address = 0;
+  unsigned int address = 0;
 
-  // Static function RVA is based on address - Virtual Address - PointerToRawData
-  PortableExecutable pe;
-  if (true == pe.Attach())
-  {
-    address = reinterpret_cast<unsigned int>(function) -
-      reinterpret_cast<unsigned int>(pe.GetBaseAddress()) -
-      (pe.FirstSectionHeader->VirtualAddress -
-        pe.FirstSectionHeader->PointerToRawData);
-  }
+  // Static function offset is the file offset of its RVA in whichever
+  // section contains it.
+  const VMImage& image = GetImage();
+  image.pe.RVAToOffset(reinterpret_cast<unsigned int>(function) -
+                       reinterpret_cast<unsigned int>(image.base),
+                       address);
 
   return reinterpret_cast<void*>(address);
 }
@@ -333,15 +398,14 @@ void* VMUtils::GetFuncRVAToImage(void* function)
 /////////////////////////////////////////////////////////////////////////////////////////
 void* VMUtils::GetFuncImageToRVA(unsigned int offset)
 {
-  unsigned long address = 0;
+  unsigned int address = 0;
 
-  // Static function RVA is based on address - Virtual Address - PointerToRawData
-  PortableExecutable pe;
-  if (true == pe.Attach())
+  // Static function address is the image base plus the RVA of its file offset.
+  const VMImage& image = GetImage();
+  unsigned int rva = 0;
+  if (true == image.pe.OffsetToRVA(offset, rva))
   {
-    address = offset + reinterpret_cast<unsigned int>(pe.GetBaseAddress()) +
-      (pe.FirstSectionHeader->VirtualAddress -
-        pe.FirstSectionHeader->PointerToRawData);
+    address = reinterpret_cast<unsigned int>(image.base) + rva;
   }
 
   return reinterpret_cast<void*>(address);
@@ -354,16 +418,10 @@ void* VMUtils::GetFuncImageToRVA(unsigned int offset)
 /////////////////////////////////////////////////////////////////////////////////////////
 void* VMUtils::GetFuncOffsetRVA(unsigned int offset)
 {
-  unsigned long address = 0;
+  unsigned int address = 0;
 
-  // Static function RVA is based on address - Virtual Address - PointerToRawData
-  PortableExecutable pe;
-  if (true == pe.Attach())
-  {
-    address = offset - 
-             (pe.FirstSectionHeader->VirtualAddress -
-              pe.FirstSectionHeader->PointerToRawData);
-  }
+  // Translate an RVA into its file offset.
+  GetImage().pe.RVAToOffset(offset, address);
 
   return reinterpret_cast<void*>(address);
 }
@@ -375,16 +433,10 @@ void* VMUtils::GetFuncOffsetRVA(unsigned int offset)
 /////////////////////////////////////////////////////////////////////////////////////////
 void* VMUtils::GetRVAFuncOffset(unsigned int offset)
 {
-  unsigned long address = 0;
+  unsigned int address = 0;
 
-  // Static function RVA is based on address - Virtual Address - PointerToRawData
-  PortableExecutable pe;
-  if (true == pe.Attach())
-  {
-    address = offset +
-      (pe.FirstSectionHeader->VirtualAddress -
-        pe.FirstSectionHeader->PointerToRawData);
-  }
+  // Translate a file offset into its RVA.
+  GetImage().pe.OffsetToRVA(offset, address);
 
   return reinterpret_cast<void*>(address);
 }
@@ -394,11 +446,12 @@ void* VMUtils::GetRVAFuncOffset(unsigned int offset)
 // Function:  ValidateUniqueId
 // 
 /////////////////////////////////////////////////////////////////////////////////////////
-bool VMUtils::ValidateUniqueId(void* section)
+bool VMUtils::ValidateUniqueId(const void* section)
 {
-  VMHeader* header = reinterpret_cast<VMHeader*>(section);
-  if ((UniqueId == header->uid) &&
-    (0 == memcmp(FileSysName, header->ruid, FILE_SYS_LEN)))
+  const VMHeader* header = reinterpret_cast<const VMHeader*>(section);
+  if ((0 != header) &&
+      (UniqueId == header->uid) &&
+      (0 == memcmp(FileSysName, header->ruid, FILE_SYS_LEN)))
   {
     return true;
   }
@@ -406,6 +459,258 @@ bool VMUtils::ValidateUniqueId(void* section)
   return false;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  GetImage
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const VMImage& VMUtils::GetImage()
+{
+  // Function local statics are initialized exactly once, even across threads,
+  // so the running module is only ever parsed on first use.
+  static const VMImage* image = LoadImage();
+  return *image;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  GetLayout
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const VMLayout* VMUtils::GetLayout()
+{
+  static const VMLayout* layout = DecodeLayout();
+  return layout;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  GetFunctionTable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const VMFunctionTable& VMUtils::GetFunctionTable()
+{
+  static const VMFunctionTable* table = BuildFunctionTable();
+  return *table;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FindFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+const VMFunctionEntry* VMUtils::FindFunction(const void* func)
+{
+  return GetFunctionTable().Find(func);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  AcquireFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMUtils::AcquireFunction(const void* func)
+{
+  const VMFunctionEntry* entry = FindFunction(func);
+  if (0 == entry)
+  {
+    return false;
+  }
+
+  // Holders after the first only bump the count. The 0 -> 1 transition goes
+  // through BUSY so nobody runs the function before it is fully decrypted.
+  while (true)
+  {
+    int state = entry->state->load(std::memory_order_acquire);
+    if (state > VM_STATE_LOCKED)
+    {
+      if (true == entry->state->compare_exchange_weak(state, state + 1,
+                                                      std::memory_order_acquire))
+      {
+        VMFunctionCache::Instance().Touch(entry);
+        return true;
+      }
+    }
+    else if (VM_STATE_LOCKED == state)
+    {
+      if (true == entry->state->compare_exchange_weak(state, VM_STATE_BUSY,
+                                                      std::memory_order_acquire))
+      {
+        // Decrypt into the arena when enabled so the image stays untouched,
+        // in place otherwise or when the function cannot be moved.
+        unsigned char* code = 0;
+        if (true == VMArena::Instance().Enabled())
+        {
+          code = VMArena::Instance().Place(entry->address, entry->function->size, KeyStream);
+        }
+
+        if (0 == code)
+        {
+          RemoveVirtualization(entry->address, entry->function->size);
+          code = entry->address;
+        }
+
+        entry->code->store(code, std::memory_order_release);
+
+        // The cache keeps a reference of its own on what it retains.
+        entry->state->store((true == VMFunctionCache::Instance().Retain(entry) ? 2 : 1),
+                            std::memory_order_release);
+        return true;
+      }
+    }
+    else
+    {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ReleaseFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMUtils::ReleaseFunction(const void* func)
+{
+  const VMFunctionEntry* entry = FindFunction(func);
+  if (0 == entry)
+  {
+    return false;
+  }
+
+  // Only the last holder re-encrypts. Releasing a locked function is ignored
+  // rather than encrypting it a second time.
+  while (true)
+  {
+    int state = entry->state->load(std::memory_order_acquire);
+    if (state > 1)
+    {
+      if (true == entry->state->compare_exchange_weak(state, state - 1,
+                                                      std::memory_order_release))
+      {
+        return false;
+      }
+    }
+    else if (1 == state)
+    {
+      if (true == entry->state->compare_exchange_weak(state, VM_STATE_BUSY,
+                                                      std::memory_order_acquire))
+      {
+        unsigned char* code = entry->code->exchange(0, std::memory_order_acquire);
+        if ((0 != code) && (entry->address != code))
+        {
+          VMArena::Instance().Free(code, entry->function->size);
+        }
+        else
+        {
+          RemoveVirtualization(entry->address, entry->function->size);
+        }
+
+        entry->state->store(VM_STATE_LOCKED, std::memory_order_release);
+        return true;
+      }
+    }
+    else if (VM_STATE_LOCKED == state)
+    {
+      return false;
+    }
+    else
+    {
+      std::this_thread::yield();
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ResolveFunction
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void* VMUtils::ResolveFunction(const void* func)
+{
+  // Where an unlocked function runs from. Anything unknown or locked runs
+  // from where it is. Arena placements are sealed on their way out.
+  const VMFunctionEntry* entry = FindFunction(func);
+  unsigned char* code = (0 == entry ? 0 : entry->code->load(std::memory_order_acquire));
+  if ((0 != code) && (entry->address != code))
+  {
+    VMArena::Instance().Commit();
+  }
+
+  return (0 == code ? const_cast<void*>(func) : code);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  LoadImage
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMImage* VMUtils::LoadImage()
+{
+  // The descriptor lives for the rest of the process and is never freed.
+  VMImage* image = new VMImage();
+  if (true == image->pe.Attach())
+  {
+    IMAGE_SECTION_HEADER* last = image->pe.LastSectionHeader;
+
+    image->base = reinterpret_cast<unsigned char*>(image->pe.GetBaseAddress());
+    image->vmlSection = reinterpret_cast<unsigned char*>
+                        (image->pe.PointerToLastSection(0));
+    image->vmlSize = last->SizeOfRawData;
+    memcpy(image->vmlName, last->Name, IMAGE_SIZEOF_SHORT_NAME);
+  }
+
+  return image;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  DecodeLayout
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMLayout* VMUtils::DecodeLayout()
+{
+  const VMImage& image = GetImage();
+  if ((0 == image.vmlSection) || (sizeof(VMHeader) > image.vmlSize))
+  {
+    return 0;
+  }
+
+  // Decode the header on its own first to learn the function count, and never
+  // trust it beyond what the section can actually hold.
+  VMHeader header;
+  memcpy(&header, image.vmlSection, sizeof(VMHeader));
+  XORvSection(&header, sizeof(VMHeader));
+
+  unsigned int maxFunctions = (image.vmlSize - sizeof(VMHeader)) / sizeof(VMFunction);
+  unsigned int numFunctions = (header.numFunctions < maxFunctions ?
+                               header.numFunctions : maxFunctions);
+
+  // Decode a private copy, the section in the image stays encrypted.
+  unsigned int vmSize = sizeof(VMHeader) + (numFunctions * sizeof(VMFunction));
+  VMLayout* layout = reinterpret_cast<VMLayout*>(malloc(vmSize));
+  memcpy(layout, image.vmlSection, vmSize);
+  XORvSection(layout, vmSize);
+  layout->header.numFunctions = numFunctions;
+
+  return layout;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  BuildFunctionTable
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMFunctionTable* VMUtils::BuildFunctionTable()
+{
+  // Resolve every protected function to its runtime address once, so an
+  // unlock is a single hash probe on the function pointer.
+  VMFunctionTable* table = new VMFunctionTable();
+  table->Build(GetLayout(), &VMUtils::GetFuncImageToRVA);
+
+  return table;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////
 //
 // Function:  InitializeQueues
@@ -414,11 +719,20 @@ bool VMUtils::ValidateUniqueId(void* section)
 void VMUtils::InitializeQueues()
 {
   GenerateUniqueIdentifier();
-  HeartInQ = new BQueue(UniqueId);
-  HeartOutQ = new BQueue(UniqueId + 1);
-
-  // Launch the HeartBeat thread
-  HeartInHandle = std::async(std::launch::async, &VMUtils::HeartBeatThread);
+  HeartInQ = new HeartQueue();
+  HeartOutQ = new HeartQueue();
+
+  // The application has HeartTimeout to send its first beat. Beats are
+  // answered as soon as they arrive, the period only bounds how late a
+  // missing beat is noticed.
+  LastBeat = std::chrono::steady_clock::now();
+  LastEpoch = 0;
+  HeartEpoch.value.store(LastEpoch ^ UniqueId);
+  HeartTask = VMWatchdog::Instance().Schedule(&VMUtils::HeartBeatTask,
+                                              HeartPeriod,
+                                              HeartPeriod / 4,
+                                              HeartBudget);
+  VMWatchdog::Instance().Start();
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////
@@ -467,73 +781,83 @@ void __declspec(naked) TerminateFunc2()
 
 /////////////////////////////////////////////////////////////////////////////////////////
 //
-// Function:  HeartBeatThread
+// Function:  HeartBeatTask
 // 
 /////////////////////////////////////////////////////////////////////////////////////////
-void VMUtils::HeartBeatThread()
+void VMUtils::HeartBeatTask()
 {
-  void* obj = 0;
+  unsigned int beat = 0;
 
-  while (true)
+  // Assembly code with junk, but also checks for preset debugger..
+  __asm
   {
-    // Assembly code with junk, but also checks for preset debugger..
-    __asm
-    {
-      junk:
-      pushad
-      mov eax, dword ptr[UniqueId]
-      shl eax, 3
-      mov edx, eax
-      xor eax, edx
-      xor edx, eax
-      shr eax, 17
-      popad
-
-      dbg_check:
-      mov ecx, IsDebuggerPresent
-      call ecx
-      test eax, eax
-      jnz bad_call
-      jmp __exit
-
-      bad_call:
-      mov eax, dword ptr[UniqueId]
-      call eax
-
-      __exit :
-      push eax
-      push ebx
-      mov eax, dword ptr[UniqueId]
-      shl eax, 3
-      mov ebx, eax
-      xor eax, ebx
-      xor ebx, eax
-      shr eax, 17
-      pop ebx
-      pop eax
-    }
+    junk:
+    pushad
+    mov eax, dword ptr[UniqueId]
+    shl eax, 3
+    mov edx, eax
+    xor eax, edx
+    xor edx, eax
+    shr eax, 17
+    popad
+
+    dbg_check:
+    mov ecx, IsDebuggerPresent
+    call ecx
+    test eax, eax
+    jnz bad_call
+    jmp __exit
+
+    bad_call:
+    mov eax, dword ptr[UniqueId]
+    call eax
+
+    __exit :
+    push eax
+    push ebx
+    mov eax, dword ptr[UniqueId]
+    shl eax, 3
+    mov ebx, eax
+    xor eax, ebx
+    xor ebx, eax
+    shr eax, 17
+    pop ebx
+    pop eax
+  }
 
-    obj = HeartInQ->Pop(3000);
-    if (0 == obj) // We didn't recieve a response...
-    {
-      TerminateFunc();
-    }
-    
+  // Answer every beat the application sent since the last run. Runs with
+  // nothing to answer only check that the application is still beating,
+  // through either protocol.
+  bool received = false;
+  while (true == HeartInQ->TryPop(beat))
+  {
     // Verify we have a matching counter
-    if (HeartBeat != (*reinterpret_cast<unsigned int*>(obj) ^ UniqueId))
+    if (HeartBeat != (beat ^ UniqueId))
     {
       TerminateFunc();
     }
 
-    // Free the object, send a query
-    free(obj);
-    obj = malloc(sizeof(unsigned int));
-
+    // Send a query
     ++HeartBeat;
-    *reinterpret_cast<unsigned int*>(obj) = HeartBeat;
-    HeartOutQ->Push(obj);
+    HeartOutQ->Push(HeartBeat);
+    received = true;
+  }
+
+  unsigned int epoch = HeartEpoch.value.load(std::memory_order_acquire) ^ UniqueId;
+  if (LastEpoch != epoch)
+  {
+    LastEpoch = epoch;
+    received = true;
+  }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (true == received)
+  {
+    LastBeat = now;
+  }
+  else if (now - LastBeat > std::chrono::milliseconds(HeartTimeout)) // We didn't recieve a response...
+  {
+    TerminateFunc();
   }
 }
 
@@ -544,33 +868,100 @@ void VMUtils::HeartBeatThread()
 /////////////////////////////////////////////////////////////////////////////////////////
 void VMUtils::HeartBeatSlave()
 {
-  void* obj = 0;
+  if (0 != HeartChannel)
+  {
+    HeartBeatRemote();
+    return;
+  }
+
+  unsigned int beat = 0;
 
   // Start off the heart beat master by sending in the first beat
   static bool firstCall = false;
   if (false == firstCall)
   {
     firstCall = true;
-    obj = malloc(sizeof(unsigned int));
-    *reinterpret_cast<unsigned int*>(obj) = HeartBeat ^ UniqueId;
-    HeartInQ->Push(obj);
+    HeartInQ->Push(HeartBeat ^ UniqueId);
+    VMWatchdog::Instance().Trigger(HeartTask);
   }
 
   // Otherwise we wait for a query and respond accordingly
-  obj = HeartOutQ->Pop(3000);
-  if (0 == obj) // We didn't recieve a response...
+  if (false == HeartOutQ->Pop(beat, HeartTimeout)) // We didn't recieve a response...
   {
     TerminateFunc();
   }
 
-  unsigned int beat = *reinterpret_cast<unsigned int*>(obj);
   if (HeartBeat != beat)
   {
     TerminateFunc();
   }
 
-  free(obj);
-  obj = malloc(sizeof(unsigned int));
-  *reinterpret_cast<unsigned int*>(obj) = (HeartBeat ^ UniqueId);
-  HeartInQ->Push(obj);
+  HeartInQ->Push(HeartBeat ^ UniqueId);
+  VMWatchdog::Instance().Trigger(HeartTask);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  HeartBeatEpoch
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMUtils::HeartBeatEpoch()
+{
+  // Alternative to HeartBeatSlave for hot loops: no handshake and no blocking,
+  // just a load and a store. Concurrent callers may lose an increment, the
+  // watchdog only needs the epoch to keep moving within HeartTimeout.
+  unsigned int epoch = HeartEpoch.value.load(std::memory_order_relaxed) ^ UniqueId;
+  HeartEpoch.value.store((epoch + 1) ^ UniqueId, std::memory_order_release);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  InitializeRemoteHeart
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMUtils::InitializeRemoteHeart(const char* helperPath)
+{
+  // Must run after InitializeQueues and before the first HeartBeatSlave.
+  HeartChannel = VMRemoteWatchdog::Launch(helperPath, HeartTimeout, HeartSecret);
+  if (0 == HeartChannel)
+  {
+    return false;
+  }
+
+  // The helper is the master now, the in-process task stops checking. Epoch
+  // beats are not seen by the helper, so they are no use in this mode.
+  VMWatchdog::Instance().Configure(HeartTask, 0, 0, HeartBudget);
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  HeartBeatRemote
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMUtils::HeartBeatRemote()
+{
+  // The helper keeps its own count, ours only advances when its answer is
+  // the next one.
+  unsigned int beat = 0;
+
+  static bool firstCall = false;
+  if (false == firstCall)
+  {
+    firstCall = true;
+    HeartChannel->Send(HeartBeat ^ HeartSecret);
+  }
+
+  if (false == HeartChannel->Receive(beat, HeartTimeout)) // We didn't recieve a response...
+  {
+    TerminateFunc();
+  }
+
+  if (HeartBeat + 1 != beat)
+  {
+    TerminateFunc();
+  }
+
+  HeartBeat = beat;
+  HeartChannel->Send(HeartBeat ^ HeartSecret);
 }
\ No newline at end of file
@@ -8,33 +8,60 @@
 // To invoke virtualized functions, perform the following:
 // VUNLOCK(func);
 // func();
-// VUNLOCK(func);
+// VLOCK(func);
+// or hold a scoped guard for as long as the function may run:
+// {
+//   VScopedUnlock unlock(&func);
+//   func();
+// }
+// Unlocks are reference counted per function. Only the first holder decrypts
+// and only the last one re-encrypts, so recursive, nested and concurrent
+// callers are safe.
+//
+// Hot functions can be kept decrypted between calls with
+// VMFunctionCache::Instance().Start(byteBudget, idleTimeoutMs);
+// A background thread re-locks them once idle or when over budget.
+//
+// With VMArena::Instance().Enable(true) unlocked functions are decrypted into
+// an executable arena instead of in place, leaving the image pages clean. The
+// function must then be called through VCALL(func)(args...) while unlocked,
+// which also makes freshly placed functions executable.
+// The fault handler below decrypts in place and does not combine with it:
+// each refuses to enable while the other is on.
+//
+// Alternatively, call sites can be left unwrapped entirely:
+// VMFaultHandler::Instance().Enable(VMUtils::GetFunctionTable(),
+//                                   &VMUtils::AcquireFunction,
+//                                   VMUtils::KeyStream);
+// leaves the pages of protected functions inaccessible and decrypts each
+// function on its first execution.
 // NOTE: The above requires that VMLock virtualized this function.
 //
 // To perform UID validation, do the following:
-// PortableExecutable pe;
-// if (true == pe.Attach())
+// VMUtils::GenerateUniqueIdentifier();
+// if (false == VMUtils::ValidateUniqueId(VMUtils::GetLayout()))
 // {
-//   VMUtils::GenerateUniqueIdentifier();
-//   VMUtils::XORvSection(pe.PointerToLastSection(0),
-//                        pe.LastSectionHeader->SizeOfRawData);
-//   if (false == VMUtils::ValidateUniqueId(pe.PointerToLastSection(0)))
-//   {
-//     printf("You are not authorized to use this.");
-//     TerminateProcess(GetCurrentProcess(), 0);
-//   }
+//   printf("You are not authorized to use this.");
+//   TerminateProcess(GetCurrentProcess(), 0);
 // }
-// For added security, copy the contents of PointerToLastSection
-// to the structure VMLayout* and invoke XORvSection on PointerToLastSection.
+// GetLayout() decodes a private copy of the last section the first time it is
+// called, so it must not be called before the unique identifier is known. The
+// section itself stays encrypted in the image.
 //
 /////////////////////////////////////////////////////////////////////////////////////////
-#include <future>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <thread>
 #include <vector>
-#include "BQueue.h"
 #include "PortableExecutable.h"
+#include "SPSCRing.h"
+#include "VMCipher.h"
 #include "VMDefines.h"
+#include "VMFaultHandler.h"
+#include "VMFunctionCache.h"
+#include "VMFunctionTable.h"
+#include "VMSharedChannel.h"
 
 // Externs
 extern void TerminateFunc();
@@ -61,30 +88,14 @@ extern void TerminateFunc2();
 // The following macros should only be called from the application that
 // has been virtualized.
 #define VLOCK(func) \
-{ \
-  void* addr = VMUtils::GetFuncImageToRVA(reinterpret_cast<unsigned int>(&func)); \
-  VMUtils::VirtualizeFunction(&func); \
-}
+  VMUtils::ReleaseFunction(&func);
 
 #define VUNLOCK(func) \
-{ \
-  PortableExecutable pe; \
-  pe.Attach(); \
-  VMLayout* header = reinterpret_cast<VMLayout*>(pe.PointerToLastSection(0)); \
-  if (0 != header) \
-  { \
-    for (unsigned int i = 0; i < header->header.numFunctions; ++i) \
-    { \
-      if (header->functions[i].offset == \
-          reinterpret_cast<unsigned int>(VMUtils::GetFuncRVAToImage(&func))) \
-      { \
-        void* addr = VMUtils::GetFuncImageToRVA(header->functions[i].offset); \
-        VMUtils::RemoveVirtualization(addr, header->functions[i].size); \
-        break; \
-      } \
-    } \
-  } \
-}
+  VMUtils::AcquireFunction(&func);
+
+// Calls a function unlocked with VUNLOCK or VScopedUnlock wherever it runs from.
+#define VCALL(func) \
+  (reinterpret_cast<decltype(&func)>(VMUtils::ResolveFunction(&func)))
 
 #define VTERMINATE() \
 { \
@@ -104,6 +115,28 @@ extern void TerminateFunc2();
   } 
 // END //////////////////////////////////////////////////////////////////////////////////
 
+// Process-wide description of the running module, parsed once.
+struct VMImage
+{
+  unsigned char* base;
+  unsigned char* vmlSection; // Last (.vml) section as mapped in memory
+  unsigned int vmlSize;
+  char vmlName[IMAGE_SIZEOF_SHORT_NAME];
+  PortableExecutable pe;     // Section table used for translations
+};
+
+// Heartbeat channel, one producer and one consumer per direction. Beats are
+// passed by value so the steady state never touches the heap.
+typedef SPSCRing<unsigned int, 16> HeartQueue;
+
+// Liveness epoch published by the application, alone on its cache line so
+// publishing never contends with anything else. Holds count ^ UniqueId.
+struct alignas(VM_CACHE_LINE) VMEpoch
+{
+  std::atomic<unsigned int> value;
+  char pad[VM_CACHE_LINE - sizeof(std::atomic<unsigned int>)];
+};
+
 // Class definition
 class VMUtils
 {
@@ -121,26 +154,83 @@ public:
                             std::vector<unsigned int> lengths,
                             std::vector<unsigned char>& buffer);
   static void XORvSection(void* section, unsigned int size);
+  static void XORvSection(void* section, unsigned int size, unsigned int uid);
   static unsigned int VirtualizeFunction(void* func);
+  static unsigned int VirtualizeFunction(void* func, unsigned int uid, unsigned int maxLen);
+  static unsigned int VirtualizeBuffer(unsigned char* buffer,
+                                       unsigned int size,
+                                       const std::vector<unsigned int>& offsets,
+                                       const std::vector<unsigned int>& limits,
+                                       unsigned int uid,
+                                       std::vector<unsigned int>& lengths,
+                                       unsigned int numThreads = 0);
   static void RemoveVirtualization(void* func, unsigned int size);
   static void* GetFuncRVAToImage(void* function);
   static void* GetFuncImageToRVA(unsigned int offset);
   static void* GetFuncOffsetRVA(unsigned int offset);
   static void* GetRVAFuncOffset(unsigned int offset);
-  static bool ValidateUniqueId(void* section);
+  static bool ValidateUniqueId(const void* section);
+  static const VMImage& GetImage();
+  static const VMLayout* GetLayout();
+  static const VMFunctionTable& GetFunctionTable();
+  static const VMFunctionEntry* FindFunction(const void* func);
+  static bool AcquireFunction(const void* func);
+  static bool ReleaseFunction(const void* func);
+  static void* ResolveFunction(const void* func);
   static void InitializeQueues();
-  static void HeartBeatThread();
+  static void HeartBeatTask();
   static void HeartBeatSlave();
+  static void HeartBeatEpoch();
+  static bool InitializeRemoteHeart(const char* helperPath);
 
-  static BQueue* HeartInQ;
-  static BQueue* HeartOutQ;
+  static HeartQueue* HeartInQ;
+  static HeartQueue* HeartOutQ;
   static unsigned int UniqueId;
   static unsigned char FileSysName[FILE_SYS_LEN];
+  static unsigned char KeyStream[VM_KEY_LEN];
   static unsigned int HeartBeat;
-  static std::future<void> HeartInHandle;
+  static unsigned int HeartTask;
+  static std::chrono::steady_clock::time_point LastBeat;
+  static VMEpoch HeartEpoch;
+  static VMSharedChannel* HeartChannel;
+  static unsigned int HeartSecret; // Remote beats are sent as HeartBeat ^ HeartSecret
+  static unsigned int LastEpoch;
 
   static const unsigned int CPUCycleLimit = 0x17FFFFD;
+  static const unsigned int HeartTimeout = 3000; // Milliseconds
+  static const unsigned int HeartPeriod = 1000;  // Milliseconds
+  static const unsigned int HeartBudget = 500;   // Microseconds
 private:
-
+  static void RejectOverlaps(const std::vector<unsigned int>& offsets,
+                             std::vector<unsigned int>& lengths);
+  static VMImage* LoadImage();
+  static VMLayout* DecodeLayout();
+  static VMFunctionTable* BuildFunctionTable();
+  static void HeartBeatRemote();
 };
 
+// Keeps a virtualized function decrypted for the lifetime of the guard.
+class VScopedUnlock
+{
+public:
+  explicit VScopedUnlock(const void* func) :
+    Func(func),
+    Held(VMUtils::AcquireFunction(func))
+  {
+  }
+
+  ~VScopedUnlock()
+  {
+    if (true == Held)
+    {
+      VMUtils::ReleaseFunction(Func);
+    }
+  }
+
+private:
+  VScopedUnlock(const VScopedUnlock&);
+  VScopedUnlock& operator=(const VScopedUnlock&);
+
+  const void* Func;
+  bool Held;
+};
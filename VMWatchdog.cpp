@@ -0,0 +1,334 @@
+#include "VMWatchdog.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Instance
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMWatchdog& VMWatchdog::Instance()
+{
+  static VMWatchdog watchdog;
+  return watchdog;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Schedule
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMWatchdog::Schedule(void (*callback)(),
+                                  unsigned int period,
+                                  unsigned int jitter,
+                                  unsigned int timeBudget)
+{
+  std::lock_guard<std::mutex> guard(Lock);
+
+  VMWatchdogTask task = { callback, period, jitter, timeBudget, false, false, false,
+                          VMDeadline(), 0, 0 };
+  Tasks.push_back(task);
+
+  unsigned int id = static_cast<unsigned int>(Tasks.size() - 1);
+  if (0 != period)
+  {
+    Arm(id, std::chrono::steady_clock::now() + std::chrono::milliseconds(NextDelay(task, 0)));
+  }
+
+  return id;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Configure
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMWatchdog::Configure(unsigned int task,
+                           unsigned int period,
+                           unsigned int jitter,
+                           unsigned int timeBudget)
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  if (task >= Tasks.size())
+  {
+    return false;
+  }
+
+  VMWatchdogTask& entry = Tasks[task];
+  entry.period = period;
+  entry.jitter = jitter;
+  entry.timeBudget = timeBudget;
+
+  // A running task picks up the new period when it finishes.
+  if (false == entry.running)
+  {
+    Disarm(task);
+    if (0 != period)
+    {
+      Arm(task, std::chrono::steady_clock::now() + std::chrono::milliseconds(NextDelay(entry, 0)));
+    }
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Trigger
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMWatchdog::Trigger(unsigned int task)
+{
+  // Only a flag and a wakeup, the heartbeat triggers on every beat. A running
+  // task goes again as soon as it finishes.
+  std::lock_guard<std::mutex> guard(Lock);
+  if (task >= Tasks.size())
+  {
+    return;
+  }
+
+  Tasks[task].triggered = true;
+  if (false == Tasks[task].running)
+  {
+    Wake.notify_one();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Start
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMWatchdog::Start()
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  if (true == Running)
+  {
+    return;
+  }
+
+  Running = true;
+  Worker = std::thread(&VMWatchdog::WatchdogThread, this);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Stop
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMWatchdog::Stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(Lock);
+    Running = false;
+  }
+
+  Wake.notify_all();
+  if (true == Worker.joinable())
+  {
+    Worker.join();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Wakeups
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMWatchdog::Wakeups() const
+{
+  return NumWakeups.load();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Runs
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMWatchdog::Runs(unsigned int task)
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return (task < Tasks.size() ? Tasks[task].runs : 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Overruns
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMWatchdog::Overruns(unsigned int task)
+{
+  std::lock_guard<std::mutex> guard(Lock);
+  return (task < Tasks.size() ? Tasks[task].overruns : 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Constructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMWatchdog::VMWatchdog() :
+  LastRun(0),
+  Random(static_cast<unsigned int>(std::chrono::steady_clock::now().time_since_epoch().count())),
+  Running(false),
+  NumWakeups(0)
+{
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Destructor
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+VMWatchdog::~VMWatchdog()
+{
+  Stop();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Arm
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMWatchdog::Arm(unsigned int task, VMDeadline deadline)
+{
+  // Only wake the thread when the new deadline is now the earliest one.
+  bool earliest = true;
+  for (const VMWatchdogTask& other : Tasks)
+  {
+    if ((true == other.scheduled) && (other.deadline <= deadline))
+    {
+      earliest = false;
+      break;
+    }
+  }
+
+  Tasks[task].deadline = deadline;
+  Tasks[task].scheduled = true;
+  if (true == earliest)
+  {
+    Wake.notify_one();
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Disarm
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMWatchdog::Disarm(unsigned int task)
+{
+  Tasks[task].scheduled = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  NextTask
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool VMWatchdog::NextTask(VMDeadline now, unsigned int& task, VMDeadline& earliest) const
+{
+  // A handful of tasks, so a scan beats keeping the deadlines sorted. The scan
+  // starts after the last task run so a busy task cannot starve the others.
+  // Without a ready task, earliest is the next deadline, or max if none.
+  earliest = VMDeadline::max();
+  for (unsigned int i = 1; i <= Tasks.size(); ++i)
+  {
+    unsigned int index = static_cast<unsigned int>((LastRun + i) % Tasks.size());
+    const VMWatchdogTask& candidate = Tasks[index];
+    if (true == candidate.running)
+    {
+      continue;
+    }
+
+    if ((true == candidate.triggered) ||
+        ((true == candidate.scheduled) && (candidate.deadline <= now)))
+    {
+      task = index;
+      return true;
+    }
+
+    if ((true == candidate.scheduled) && (candidate.deadline < earliest))
+    {
+      earliest = candidate.deadline;
+    }
+  }
+
+  return false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  NextDelay
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int VMWatchdog::NextDelay(const VMWatchdogTask& task, unsigned long long elapsed)
+{
+  // elapsed is the last run time in microseconds.
+  unsigned long long periods = 1;
+  if ((0 != task.timeBudget) && (elapsed > task.timeBudget))
+  {
+    periods = elapsed / task.timeBudget;
+    periods = (periods > MaxBackoff ? MaxBackoff : periods);
+  }
+
+  unsigned int jitter = (0 == task.jitter ? 0 : Random() % (task.jitter + 1));
+  return static_cast<unsigned int>(task.period * periods) + jitter;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  WatchdogThread
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void VMWatchdog::WatchdogThread()
+{
+  std::unique_lock<std::mutex> guard(Lock);
+  while (true == Running)
+  {
+    VMDeadline now = std::chrono::steady_clock::now();
+    unsigned int id = 0;
+    VMDeadline earliest;
+    if (false == NextTask(now, id, earliest))
+    {
+      if (VMDeadline::max() == earliest)
+      {
+        Wake.wait(guard);
+      }
+      else
+      {
+        Wake.wait_until(guard, earliest);
+      }
+
+      ++NumWakeups;
+      continue;
+    }
+
+    VMWatchdogTask& task = Tasks[id];
+    void (*callback)() = task.callback;
+    task.scheduled = false;
+    task.running = true;
+    task.triggered = false;
+    LastRun = id;
+
+    // Tasks may be added while the callback runs, so it is looked up again.
+    guard.unlock();
+    callback();
+    VMDeadline finished = std::chrono::steady_clock::now();
+    guard.lock();
+
+    unsigned long long elapsed = std::chrono::duration_cast<std::chrono::microseconds>
+                                 (finished - now).count();
+    VMWatchdogTask& done = Tasks[id];
+    done.running = false;
+    ++done.runs;
+    if ((0 != done.timeBudget) && (elapsed > done.timeBudget))
+    {
+      ++done.overruns;
+    }
+
+    // A trigger that arrived meanwhile is picked up by the next scan.
+    if (0 != done.period)
+    {
+      Arm(id, finished + std::chrono::milliseconds(NextDelay(done, elapsed)));
+    }
+  }
+}
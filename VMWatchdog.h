@@ -0,0 +1,80 @@
+#pragma once
+
+// External dependencies
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock::time_point VMDeadline;
+
+// A periodic protection check. Periods and jitter are in milliseconds, the
+// time budget in microseconds of wall clock run time per call, which includes
+// any time the callback spends blocked or preempted (0 for no limit). Each
+// task is its own timer slot, so arming and triggering never allocate.
+struct VMWatchdogTask
+{
+  void (*callback)();
+  unsigned int period;  // 0 runs only when triggered
+  unsigned int jitter;
+  unsigned int timeBudget;
+  bool running;
+  bool triggered;
+  bool scheduled;
+  VMDeadline deadline;
+  unsigned int runs;
+  unsigned int overruns;
+};
+
+// Class Definition
+// Single thread running every periodic protection check (heartbeat, CRC, UID).
+// The thread sleeps until the earliest deadline, or until a task is
+// triggered, instead of polling; ready tasks are taken round robin. Each run
+// is pushed back by a random jitter, and a task exceeding its time budget is
+// pushed back in proportion to the overrun so its share of the thread stays
+// near timeBudget / period.
+class VMWatchdog
+{
+public:
+  static VMWatchdog& Instance();
+
+  unsigned int Schedule(void (*callback)(),
+                        unsigned int period,
+                        unsigned int jitter = 0,
+                        unsigned int timeBudget = 0);
+  bool Configure(unsigned int task,
+                 unsigned int period,
+                 unsigned int jitter,
+                 unsigned int timeBudget);
+  void Trigger(unsigned int task);
+  void Start();
+  void Stop();
+
+  unsigned int Wakeups() const;
+  unsigned int Runs(unsigned int task);
+  unsigned int Overruns(unsigned int task);
+
+  static const unsigned int MaxBackoff = 8; // Periods an overrunning task can be pushed back
+
+private:
+  VMWatchdog();
+  ~VMWatchdog();
+  void Arm(unsigned int task, VMDeadline deadline);
+  void Disarm(unsigned int task);
+  bool NextTask(VMDeadline now, unsigned int& task, VMDeadline& earliest) const;
+  unsigned int NextDelay(const VMWatchdogTask& task, unsigned long long elapsed);
+  void WatchdogThread();
+
+  std::vector<VMWatchdogTask> Tasks;
+  unsigned int LastRun;
+  std::minstd_rand Random;
+  bool Running;
+  std::mutex Lock;
+  std::condition_variable Wake;
+  std::thread Worker;
+
+  std::atomic<unsigned int> NumWakeups;
+};
@@ -0,0 +1,485 @@
+#include "X86Decoder.h"
+#include "VMParallel.h"
+
+// Opcode map flags
+#define M   0x01 // ModRM follows
+#define I8  0x02 // 8-bit immediate
+#define I16 0x04 // 16-bit immediate
+#define IZ  0x08 // 16 or 32-bit immediate depending on the operand size
+#define P   0x20 // Prefix
+#define S   0x40 // Decoded by hand
+#define X   0x80 // Invalid in 32-bit mode
+
+const unsigned char X86Decoder::OneByteMap[256] =
+{
+  /*        0       1       2       3       4       5       6       7  */
+  /*        8       9       A       B       C       D       E       F  */
+  /* 00 */  M,      M,      M,      M,      I8,     IZ,     0,      0,
+            M,      M,      M,      M,      I8,     IZ,     0,      S,
+  /* 10 */  M,      M,      M,      M,      I8,     IZ,     0,      0,
+            M,      M,      M,      M,      I8,     IZ,     0,      0,
+  /* 20 */  M,      M,      M,      M,      I8,     IZ,     P,      0,
+            M,      M,      M,      M,      I8,     IZ,     P,      0,
+  /* 30 */  M,      M,      M,      M,      I8,     IZ,     P,      0,
+            M,      M,      M,      M,      I8,     IZ,     P,      0,
+  /* 40 */  0,      0,      0,      0,      0,      0,      0,      0,
+            0,      0,      0,      0,      0,      0,      0,      0,
+  /* 50 */  0,      0,      0,      0,      0,      0,      0,      0,
+            0,      0,      0,      0,      0,      0,      0,      0,
+  /* 60 */  0,      0,      S,      M,      P,      P,      P,      P,
+            IZ,     M | IZ, I8,     M | I8, 0,      0,      0,      0,
+  /* 70 */  I8,     I8,     I8,     I8,     I8,     I8,     I8,     I8,
+            I8,     I8,     I8,     I8,     I8,     I8,     I8,     I8,
+  /* 80 */  M | I8, M | IZ, M | I8, M | I8, M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* 90 */  0,      0,      0,      0,      0,      0,      0,      0,
+            0,      0,      S,      0,      0,      0,      0,      0,
+  /* A0 */  S,      S,      S,      S,      0,      0,      0,      0,
+            I8,     IZ,     0,      0,      0,      0,      0,      0,
+  /* B0 */  I8,     I8,     I8,     I8,     I8,     I8,     I8,     I8,
+            IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,
+  /* C0 */  M | I8, M | I8, I16,    0,      S,      S,      M | I8, M | IZ,
+            I16|I8, 0,      I16,    0,      0,      I8,     0,      0,
+  /* D0 */  M,      M,      M,      M,      I8,     I8,     0,      0,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* E0 */  I8,     I8,     I8,     I8,     I8,     I8,     I8,     I8,
+            IZ,     IZ,     S,      I8,     0,      0,      0,      0,
+  /* F0 */  P,      0,      P,      P,      0,      0,      S,      S,
+            0,      0,      0,      0,      0,      0,      M,      M
+};
+
+const unsigned char X86Decoder::TwoByteMap[256] =
+{
+  /*        0       1       2       3       4       5       6       7  */
+  /*        8       9       A       B       C       D       E       F  */
+  /* 00 */  M,      M,      M,      M,      X,      0,      0,      0,
+            0,      0,      X,      0,      X,      M,      0,      M | I8,
+  /* 10 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* 20 */  M,      M,      M,      M,      X,      X,      X,      X,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* 30 */  0,      0,      0,      0,      0,      0,      X,      0,
+            S,      X,      S,      X,      X,      X,      X,      X,
+  /* 40 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* 50 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* 60 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* 70 */  M | I8, M | I8, M | I8, M | I8, M,      M,      M,      0,
+            M,      M,      X,      X,      M,      M,      M,      M,
+  /* 80 */  IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,
+            IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,     IZ,
+  /* 90 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* A0 */  0,      0,      0,      M,      M | I8, M,      X,      X,
+            0,      0,      0,      M,      M | I8, M,      M,      M,
+  /* B0 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M | I8, M,      M,      M,      M,      M,
+  /* C0 */  M,      M,      M | I8, M,      M | I8, M | I8, M | I8, M,
+            0,      0,      0,      0,      0,      0,      0,      0,
+  /* D0 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* E0 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M,
+  /* F0 */  M,      M,      M,      M,      M,      M,      M,      M,
+            M,      M,      M,      M,      M,      M,      M,      M
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  Decode
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+bool X86Decoder::Decode(const unsigned char* code, unsigned int avail, X86Instruction& insn)
+{
+  insn.length = 0;
+  insn.flow = X86_FLOW_NONE;
+  insn.relOffset = 0;
+  insn.relSize = 0;
+  insn.relTarget = 0;
+
+  if (avail > MaxInstructionLength)
+  {
+    avail = MaxInstructionLength;
+  }
+
+  // Legacy prefixes
+  bool opsize16 = false;
+  bool addr16 = false;
+  unsigned int pos = 0;
+  while ((pos < avail) && (0 != (OneByteMap[code[pos]] & P)))
+  {
+    opsize16 |= (0x66 == code[pos]);
+    addr16 |= (0x67 == code[pos]);
+    ++pos;
+  }
+
+  if (pos >= avail)
+  {
+    return false;
+  }
+
+  unsigned int immZ = (true == opsize16 ? 2 : 4);
+  unsigned int immSize = 0;
+  unsigned char opcode = code[pos++];
+  unsigned char flags = OneByteMap[opcode];
+
+  if (0x0F == opcode)
+  {
+    if (pos >= avail)
+    {
+      return false;
+    }
+
+    opcode = code[pos++];
+    flags = TwoByteMap[opcode];
+    if (0x38 == opcode)      // Three byte map, never an immediate
+    {
+      ++pos;
+      flags = M;
+    }
+    else if (0x3A == opcode) // Three byte map, always an 8-bit immediate
+    {
+      ++pos;
+      flags = M | I8;
+    }
+    else if ((opcode >= 0x80) && (opcode <= 0x8F))
+    {
+      insn.flow = X86_FLOW_JCC | X86_FLOW_RELATIVE;
+    }
+    else if (0x0B == opcode) // ud2
+    {
+      insn.flow = X86_FLOW_TRAP;
+    }
+
+    if (0 != (flags & X))
+    {
+      return false;
+    }
+  }
+  else if (0 != (flags & S))
+  {
+    switch (opcode)
+    {
+    case 0x62: // EVEX when the next byte has mod == 11, BOUND otherwise
+    case 0xC4: // 3-byte VEX, LES otherwise
+    case 0xC5: // 2-byte VEX, LDS otherwise
+      if (pos >= avail)
+      {
+        return false;
+      }
+
+      flags = M;
+      if (0xC0 == (code[pos] & 0xC0))
+      {
+        unsigned int map = 1;
+        if (0xC5 == opcode)
+        {
+          pos += 1;
+        }
+        else if (0xC4 == opcode)
+        {
+          map = code[pos] & 0x1F;
+          pos += 2;
+        }
+        else
+        {
+          map = code[pos] & 0x03;
+          pos += 3;
+        }
+
+        if (pos >= avail)
+        {
+          return false;
+        }
+
+        // The opcode byte follows the payload, map 1 mirrors the 0F map.
+        opcode = code[pos++];
+        if (1 == map)
+        {
+          flags = (0x77 == opcode ? 0 : M | (TwoByteMap[opcode] & I8));
+        }
+        else if (3 == map)
+        {
+          flags = M | I8;
+        }
+      }
+      break;
+
+    case 0x9A: // call far ptr16:32
+    case 0xEA: // jmp far ptr16:32
+      flags = 0;
+      immSize = immZ + 2;
+      insn.flow = (0x9A == opcode ? X86_FLOW_CALL : X86_FLOW_JMP);
+      break;
+
+    case 0xA0: // mov al/eax, moffs and back
+    case 0xA1:
+    case 0xA2:
+    case 0xA3:
+      flags = 0;
+      immSize = (true == addr16 ? 2 : 4);
+      break;
+
+    case 0xF6: // Group 3, only test has an immediate
+    case 0xF7:
+      if (pos >= avail)
+      {
+        return false;
+      }
+
+      flags = M;
+      if (((code[pos] >> 3) & 7) < 2)
+      {
+        flags |= (0xF6 == opcode ? I8 : IZ);
+      }
+      break;
+    }
+  }
+  else
+  {
+    // Control flow of the one byte map
+    if ((0xC2 == opcode) || (0xC3 == opcode) || (0xCA == opcode) ||
+        (0xCB == opcode) || (0xCF == opcode))
+    {
+      insn.flow = X86_FLOW_RET;
+    }
+    else if ((0xE9 == opcode) || (0xEB == opcode))
+    {
+      insn.flow = X86_FLOW_JMP | X86_FLOW_RELATIVE;
+    }
+    else if (0xE8 == opcode)
+    {
+      insn.flow = X86_FLOW_CALL | X86_FLOW_RELATIVE;
+    }
+    else if (((opcode >= 0x70) && (opcode <= 0x7F)) ||
+             ((opcode >= 0xE0) && (opcode <= 0xE3)))
+    {
+      insn.flow = X86_FLOW_JCC | X86_FLOW_RELATIVE;
+    }
+    else if (0xCC == opcode)
+    {
+      insn.flow = X86_FLOW_INT3;
+    }
+    else if (0xF4 == opcode) // hlt
+    {
+      insn.flow = X86_FLOW_TRAP;
+    }
+    else if (0xFF == opcode)
+    {
+      if (pos >= avail)
+      {
+        return false;
+      }
+
+      unsigned int reg = (code[pos] >> 3) & 7;
+      if ((2 == reg) || (3 == reg))
+      {
+        insn.flow = X86_FLOW_CALL;
+      }
+      else if ((4 == reg) || (5 == reg))
+      {
+        insn.flow = X86_FLOW_JMP;
+      }
+    }
+  }
+
+  if (0 != (flags & M))
+  {
+    if (pos >= avail)
+    {
+      return false;
+    }
+
+    unsigned int modrmLen = ModRMLength(code + pos, avail - pos, addr16);
+    if (0 == modrmLen)
+    {
+      return false;
+    }
+
+    pos += modrmLen;
+  }
+
+  immSize += (0 != (flags & I8) ? 1 : 0) +
+             (0 != (flags & I16) ? 2 : 0) +
+             (0 != (flags & IZ) ? immZ : 0);
+
+  // Relative branches carry nothing but their displacement as immediate.
+  if (0 != (insn.flow & X86_FLOW_RELATIVE))
+  {
+    insn.relOffset = pos;
+    insn.relSize = immSize;
+  }
+
+  pos += immSize;
+  if (pos > avail)
+  {
+    return false;
+  }
+
+  insn.length = pos;
+  if (0 != insn.relSize)
+  {
+    const unsigned char* rel = code + insn.relOffset;
+    int displacement = 0;
+    if (1 == insn.relSize)
+    {
+      displacement = static_cast<signed char>(rel[0]);
+    }
+    else if (2 == insn.relSize)
+    {
+      displacement = static_cast<short>(rel[0] | (rel[1] << 8));
+    }
+    else
+    {
+      displacement = static_cast<int>(rel[0] | (rel[1] << 8) |
+                                      (rel[2] << 16) |
+                                      (static_cast<unsigned int>(rel[3]) << 24));
+    }
+
+    insn.relTarget = static_cast<int>(insn.length) + displacement;
+  }
+
+  return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FunctionExtent
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int X86Decoder::FunctionExtent(const unsigned char* code, unsigned int maxLen)
+{
+  // Walk instruction boundaries while tracking the furthest forward branch
+  // target seen so far. A ret or unconditional jump only ends the function
+  // when nothing jumps to or past the next byte; int3 padding at such a point
+  // ends it too.
+  unsigned int pos = 0;
+  unsigned int furthest = 0;
+  X86Instruction insn;
+
+  while (pos < maxLen)
+  {
+    if (false == Decode(code + pos, maxLen - pos, insn))
+    {
+      break;
+    }
+
+    // A branch landing exactly on pos makes it live code. Branch targets are
+    // never 0, so a leading int3 is padding.
+    if ((0 != (insn.flow & X86_FLOW_INT3)) && ((0 == pos) || (pos > furthest)))
+    {
+      break;
+    }
+
+    unsigned int next = pos + insn.length;
+
+    // Conditional branches and short jumps stay inside the function. Near
+    // jumps may be tail calls, so they never extend it.
+    if ((0 != (insn.flow & X86_FLOW_RELATIVE)) &&
+        ((0 != (insn.flow & X86_FLOW_JCC)) || (1 == insn.relSize)) &&
+        (insn.relTarget > 0))
+    {
+      unsigned int target = pos + insn.relTarget;
+      if ((target > furthest) && (target <= maxLen))
+      {
+        furthest = target;
+      }
+    }
+
+    pos = next;
+    if ((0 != (insn.flow & (X86_FLOW_RET | X86_FLOW_JMP | X86_FLOW_TRAP))) &&
+        (pos > furthest))
+    {
+      break;
+    }
+  }
+
+  return pos;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  FunctionExtents
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+void X86Decoder::FunctionExtents(const unsigned char* image,
+                                 const std::vector<unsigned int>& offsets,
+                                 const std::vector<unsigned int>& limits,
+                                 std::vector<unsigned int>& lengths,
+                                 unsigned int numThreads)
+{
+  lengths.assign(offsets.size(), 0);
+
+  // Decoding only reads the image, so functions can be claimed in any order.
+  VMParallel::For(static_cast<unsigned int>(offsets.size()), numThreads, [&](unsigned int i)
+  {
+    lengths[i] = FunctionExtent(image + offsets[i], limits[i]);
+  });
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+//
+// Function:  ModRMLength
+// 
+/////////////////////////////////////////////////////////////////////////////////////////
+unsigned int X86Decoder::ModRMLength(const unsigned char* modrm,
+                                     unsigned int avail,
+                                     bool addr16)
+{
+  unsigned int mod = modrm[0] >> 6;
+  unsigned int rm = modrm[0] & 7;
+  unsigned int length = 1;
+
+  if (3 == mod)
+  {
+    return length;
+  }
+
+  if (true == addr16)
+  {
+    // 16-bit addressing has no SIB byte.
+    if (((0 == mod) && (6 == rm)) || (2 == mod))
+    {
+      length += 2;
+    }
+    else if (1 == mod)
+    {
+      length += 1;
+    }
+
+    return (length <= avail ? length : 0);
+  }
+
+  if (4 == rm)
+  {
+    if (avail < 2)
+    {
+      return 0;
+    }
+
+    // SIB with no base register takes a 32-bit displacement.
+    if ((0 == mod) && (5 == (modrm[1] & 7)))
+    {
+      length += 4;
+    }
+
+    ++length;
+  }
+  else if ((0 == mod) && (5 == rm))
+  {
+    length += 4;
+  }
+
+  if (1 == mod)
+  {
+    length += 1;
+  }
+  else if (2 == mod)
+  {
+    length += 4;
+  }
+
+  return (length <= avail ? length : 0);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+// External dependencies
+#include <vector>
+
+// Control flow classification of a decoded instruction.
+#define X86_FLOW_NONE     0x00
+#define X86_FLOW_RET      0x01 // ret, retf, iret
+#define X86_FLOW_JMP      0x02 // Unconditional jump (direct, indirect or far)
+#define X86_FLOW_JCC      0x04 // Conditional branch, loop, jcxz
+#define X86_FLOW_CALL     0x08 // Direct or indirect call
+#define X86_FLOW_INT3     0x10 // int3 / padding
+#define X86_FLOW_TRAP     0x20 // ud2, hlt - nothing falls through
+#define X86_FLOW_RELATIVE 0x40 // Branch target is encoded relative to the next insn
+
+struct X86Instruction
+{
+  unsigned int length;
+  unsigned int flow;
+  unsigned int relOffset; // Offset of the relative displacement in the insn
+  unsigned int relSize;   // Size of the relative displacement (1, 2 or 4)
+  int relTarget;          // Branch target relative to the start of the insn
+};
+
+// Class Definition
+// Table driven IA-32 (32-bit mode) instruction length decoder, used to find
+// where functions really end instead of scanning for ret/int3/jmp bytes that
+// may just as well be part of an immediate or displacement.
+class X86Decoder
+{
+public:
+  static bool Decode(const unsigned char* code, unsigned int avail, X86Instruction& insn);
+  static unsigned int FunctionExtent(const unsigned char* code, unsigned int maxLen);
+  static void FunctionExtents(const unsigned char* image,
+                              const std::vector<unsigned int>& offsets,
+                              const std::vector<unsigned int>& limits,
+                              std::vector<unsigned int>& lengths,
+                              unsigned int numThreads = 0);
+
+  static const unsigned int MaxInstructionLength = 15;
+
+private:
+  static unsigned int ModRMLength(const unsigned char* modrm,
+                                  unsigned int avail,
+                                  bool addr16);
+
+  static const unsigned char OneByteMap[256];
+  static const unsigned char TwoByteMap[256];
+};
@@ -1,5 +1,13 @@
+#ifdef CLI_APP
+#include "PEGenerator.h"
+#include "VMBench.h"
+#include "VMPacker.h"
+#include "VMRemoteWatchdog.h"
+#include <string.h>
+#else
 #include "VMLock.h"
 #include <QtWidgets/QApplication>
+#endif
 
 #ifdef STUB_APP
 #include "PortableExecutable.h"
@@ -21,7 +29,33 @@ void funcTest3()
 
 int main(int argc, char *argv[])
 {
-#ifndef STUB_APP
+#if defined(CLI_APP)
+  // Started by a protected process to host its heartbeat master.
+  if ((4 == argc) && (0 == strcmp(argv[1], "--watchdog")))
+  {
+    return VMRemoteWatchdog::RunHelper(argv[2], argv[3]);
+  }
+
+  // Measures the hot paths and prints the results as JSON.
+  if ((2 <= argc) && (0 == strcmp(argv[1], "--bench")))
+  {
+    return VMBench::Run(argc, argv);
+  }
+
+  // Verifies the optimized paths against their reference implementations.
+  if ((2 <= argc) && (0 == strcmp(argv[1], "--check")))
+  {
+    return VMBench::Check(argc, argv);
+  }
+
+  // Writes a synthetic executable for scale testing.
+  if ((2 <= argc) && (0 == strcmp(argv[1], "--generate")))
+  {
+    return PEGenerator::Run(argc, argv);
+  }
+
+  return VMPacker::RunBatchCommand(argc, argv);
+#elif !defined(STUB_APP)
   QApplication a(argc, argv);
   VMLock w;
   w.show();
@@ -33,19 +67,13 @@ int main(int argc, char *argv[])
   LOC_FUNC(funcTest2);
   LOC_FUNC(funcTest3);
 
-  // Use VMUtils to devirtualize our last section
-  PortableExecutable pe;
-  if (true == pe.Attach())
+  // Use VMUtils to decode our last section
   {
     // Generate UID
     VMUtils::GenerateUniqueIdentifier();
 
-    // Remove last section virtualization
-    VMUtils::XORvSection(pe.PointerToLastSection(0), 
-                         pe.LastSectionHeader->SizeOfRawData);
-
     // Validate UID
-    if (false == VMUtils::ValidateUniqueId(pe.PointerToLastSection(0)))
+    if (false == VMUtils::ValidateUniqueId(VMUtils::GetLayout()))
     {
       printf("You are not authorized to use this.");
       TerminateProcess(GetCurrentProcess(), 0);